@@ -58,10 +58,9 @@ static Capture *findopen (Capture *cap) {
 
 
 /*
-** Go to the next capture
+** Return the capture after 'cap' and its nested captures
 */
-static void nextcap (CapState *cs) {
-  Capture *cap = cs->cap;
+static Capture *skipcap (Capture *cap) {
   if (!isfullcap(cap)) {  /* not a single capture? */
     int n = 0;  /* number of opens waiting a close */
     for (;;) {  /* look for corresponding close */
@@ -72,7 +71,15 @@ static void nextcap (CapState *cs) {
       else if (!isfullcap(cap)) n++;
     }
   }
-  cs->cap = cap + 1;  /* + 1 to skip last close (or entire single capture) */
+  return cap + 1;  /* + 1 to skip last close (or entire single capture) */
+}
+
+
+/*
+** Go to the next capture
+*/
+static void nextcap (CapState *cs) {
+  cs->cap = skipcap(cs->cap);
 }
 
 
@@ -91,8 +98,17 @@ static int pushnestedvalues (CapState *cs, int addextra) {
   }
   else {
     int n = 0;
-    while (!isclosecap(cs->cap))  /* repeat for all nested patterns */
-      n += pushcapture(cs);
+    while (!isclosecap(cs->cap)) {  /* repeat for all nested patterns */
+      Capture *cap = cs->cap;
+      if (captype(cap) == Csimple && isfullcap(cap)) {  /* plain substring? */
+        luaL_checkstack(cs->L, 1, "too many captures");
+        lua_pushlstring(cs->L, cap->s, cap->siz - 1);
+        cs->cap++;
+        n++;
+      }
+      else
+        n += pushcapture(cs);
+    }
     if (addextra || n == 0) {  /* need extra? */
       lua_pushlstring(cs->L, co->s, cs->cap->s - co->s);  /* push whole match */
       n++;
@@ -154,19 +170,36 @@ static int backrefcap (CapState *cs) {
 
 /*
 ** Table capture: creates a new table and populates it with nested
-** captures.
+** captures. The table is presized assuming that each nested capture
+** other than a named group produces one value. Simple captures with no
+** nested captures (the usual list of substrings) go straight into
+** the table.
 */
 static int tablecap (CapState *cs) {
   lua_State *L = cs->L;
   int n = 0;
-  lua_newtable(L);
-  if (isfullcap(cs->cap++))
+  int narr = 0, nrec = 0;
+  Capture *cap;
+  if (isfullcap(cs->cap++)) {
+    lua_newtable(L);
     return 1;  /* table is empty */
+  }
+  for (cap = cs->cap; !isclosecap(cap); cap = skipcap(cap)) {
+    if (captype(cap) == Cgroup && cap->idx != 0) nrec++;
+    else narr++;
+  }
+  lua_createtable(L, narr, nrec);
   while (!isclosecap(cs->cap)) {
-    if (captype(cs->cap) == Cgroup && cs->cap->idx != 0) {  /* named group? */
+    cap = cs->cap;
+    if (captype(cap) == Csimple && isfullcap(cap)) {  /* plain substring? */
+      lua_pushlstring(L, cap->s, cap->siz - 1);
+      lua_rawseti(L, -2, ++n);
+      cs->cap++;
+    }
+    else if (captype(cap) == Cgroup && cap->idx != 0) {  /* named group? */
       pushluaval(cs);  /* push group name */
       pushonenestedvalue(cs);
-      lua_settable(L, -3);
+      lua_rawset(L, -3);  /* (new table has no metamethods) */
     }
     else {  /* not a named group */
       int i;
@@ -450,7 +483,7 @@ static int pushcapture (CapState *cs) {
   luaL_checkstack(L, 4, "too many captures");
   switch (captype(cs->cap)) {
     case Cposition: {
-      lua_pushinteger(L, cs->cap->s - cs->s + 1);
+      lua_pushinteger(L, cs->cap->s - cs->s + cs->base + 1);
       cs->cap++;
       return 1;
     }
@@ -475,6 +508,10 @@ static int pushcapture (CapState *cs) {
       lua_pushvalue(L, (cs->cap++)->idx);  /* value is in the stack */
       return 1;
     }
+    case Cmset: {
+      lua_pushinteger(L, (cs->cap++)->idx);  /* number of string found */
+      return 1;
+    }
     case Cstring: {
       luaL_Buffer b;
       luaL_buffinit(L, &b);
@@ -513,25 +550,121 @@ static int pushcapture (CapState *cs) {
 ** captures in the stack pushing its results. 's' is the subject
 ** string, 'r' is the final position of the match, and 'ptop' 
 ** the index in the stack where some useful values were pushed.
+** 'base' is the position of 's' in the whole subject (in stream mode
+** the part before it may have been discarded).
 ** Returns the number of results pushed. (If the list produces no
 ** results, push the final position of the match.)
 */
-int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
+int getcaptures (lua_State *L, const char *s, const char *r, int ptop,
+                 size_t base) {
   Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
   int n = 0;
   if (!isclosecap(capture)) {  /* is there any capture? */
     CapState cs;
     cs.ocap = cs.cap = capture; cs.L = L;
-    cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
+    cs.s = s; cs.base = base; cs.valuecached = 0; cs.ptop = ptop;
     do {  /* collect their values */
       n += pushcapture(&cs);
     } while (!isclosecap(cs.cap));
   }
   if (n == 0) {  /* no capture values? */
-    lua_pushinteger(L, r - s + 1);  /* return only end position */
+    lua_pushinteger(L, r - s + base + 1);  /* return only end position */
     n = 1;
   }
   return n;
 }
 
 
+
+
+/*
+** {======================================================
+** Capture offsets (for matches without a Lua state)
+** =======================================================
+*/
+
+/*
+** Store pair 'k' (if it fits in the 'n' pairs of 'ovec'): the offsets
+** of 'a' and 'b' in subject 's'
+*/
+static void putoffsets (int *ovec, int n, int k, const char *s,
+                        const char *a, const char *b) {
+  if (k < n) {
+    ovec[2 * k] = a - s;
+    ovec[2 * k + 1] = b - s;
+  }
+}
+
+
+/*
+** Store the values of the capture at '*cap' as pairs of offsets from
+** pair 'k' on, and move '*cap' past it. A simple capture gives its
+** start and end (followed by its nested values), a position capture
+** gives its position twice, an anonymous group gives its nested values
+** (or its start and end, if it has none), and a named group gives
+** nothing, as they do in 'pushcapture'. Return the next pair, or
+** LPEG_ENOLUA for any other capture.
+*/
+static int offsetcapture (Capture **cap, const char *s, int *ovec, int n,
+                          int k) {
+  Capture *co = *cap;
+  int k0 = k;
+  const char *e;
+  switch (captype(co)) {
+    case Cposition: {
+      putoffsets(ovec, n, k, s, co->s, co->s);
+      *cap = co + 1;
+      return k + 1;
+    }
+    case Cgroup: {
+      if (co->idx != 0) {  /* named group? */
+        *cap = skipcap(co);
+        return k;
+      }
+      break;
+    }
+    case Csimple: {
+      k++;  /* whole match goes before nested values */
+      break;
+    }
+    default: return LPEG_ENOLUA;
+  }
+  if (isfullcap(co)) {  /* no nested captures? */
+    e = closeaddr(co);
+    *cap = co + 1;
+  }
+  else {
+    *cap = co + 1;
+    while (!isclosecap(*cap)) {
+      k = offsetcapture(cap, s, ovec, n, k);
+      if (k < 0) return k;
+    }
+    e = (*cap)->s;
+    (*cap)++;  /* skip close */
+  }
+  if (captype(co) == Csimple)
+    putoffsets(ovec, n, k0, s, co->s, e);
+  else if (k == k0) {  /* group without values? */
+    putoffsets(ovec, n, k0, s, co->s, e);
+    k++;
+  }
+  return k;
+}
+
+
+/*
+** Store the offsets of the values of the captures in 'capture' (over
+** subject 's') in 'ovec', which has room for 'n' pairs; pair 0 (the
+** whole match) is set by the caller. Return the number of pairs the
+** captures produce, counting pair 0 (which can be more than 'n'), or
+** LPEG_ENOLUA if some capture produces Lua values.
+*/
+int getcapoffsets (Capture *capture, const char *s, int *ovec, int n) {
+  Capture *cap = capture;
+  int k = 1;
+  while (!isclosecap(cap) && k >= 0)
+    k = offsetcapture(&cap, s, ovec, n, k);
+  return k;
+}
+
+/* }====================================================== */
@@ -25,7 +25,8 @@ typedef enum CapKind {
   Csubst,  /* substitution capture; next node is pattern */
   Cfold,  /* ktable[key] is function; next node is pattern */
   Cruntime,  /* not used in trees (is uses another type for tree) */
-  Cgroup  /* ktable[key] is group's "name" */
+  Cgroup,  /* ktable[key] is group's "name" */
+  Cmset  /* not used in trees; 'idx' is number of string found by Mset */
 } CapKind;
 
 
@@ -43,13 +44,21 @@ typedef struct CapState {
   lua_State *L;
   int ptop;  /* index of last argument to 'match' */
   const char *s;  /* original string */
+  size_t base;  /* position of 's' in the subject (> 0 only in stream mode) */
   int valuecached;  /* value stored in cache slot */
 } CapState;
 
 
+/* errors of matches without a Lua state ('lpeg_match') */
+#define LPEG_ENOLUA	(-1)  /* pattern needs Lua to produce its captures */
+#define LPEG_ENOMEM	(-2)  /* backtrack stack overflow or out of memory */
+
+
 int runtimecap (CapState *cs, Capture *close, const char *s, int *rem);
-int getcaptures (lua_State *L, const char *s, const char *r, int ptop);
+int getcaptures (lua_State *L, const char *s, const char *r, int ptop,
+                 size_t base);
 int finddyncap (Capture *cap, Capture *last);
+int getcapoffsets (Capture *capture, const char *s, int *ovec, int n);
 
 #endif
 
@@ -4,6 +4,8 @@
 */
 
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 #include "lua.h"
@@ -16,6 +18,14 @@
 /* signals a "no-instruction */
 #define NOINST		-1
 
+/* minimum number of alternatives (or trie branches) for a IDispatch */
+#if !defined(MINDISPATCH)
+#define MINDISPATCH	4
+#endif
+
+/* maximum number of targets of a IDispatch (its map stores them in bytes) */
+#define MAXDISPATCH	UCHAR_MAX
+
 
 
 static const Charset fullset_ =
@@ -152,7 +162,7 @@ static int callrecursive (TTree *tree, int f (TTree *t), int def) {
 int hascaptures (TTree *tree) {
  tailcall:
   switch (tree->tag) {
-    case TCapture: case TRunTime:
+    case TCapture: case TRunTime: case TMset:
       return 1;
     case TCall:
       return callrecursive(tree, hascaptures, 0);
@@ -197,7 +207,7 @@ int checkaux (TTree *tree, int pred) {
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
-    case TFalse: case TOpenCall:
+    case TFalse: case TOpenCall: case TMset:
       return 0;  /* not nullable */
     case TRep: case TTrue:
       return 1;  /* no fail */
@@ -220,7 +230,7 @@ int checkaux (TTree *tree, int pred) {
       if (checkaux(sib2(tree), pred)) return 1;
       /* else return checkaux(sib1(tree), pred); */
       tree = sib1(tree); goto tailcall;
-    case TCapture: case TGrammar: case TRule:
+    case TCapture: case TGrammar: case TRule: case TMemo:
       /* return checkaux(sib1(tree), pred); */
       tree = sib1(tree); goto tailcall;
     case TCall:  /* return checkaux(sib2(tree), pred); */
@@ -241,9 +251,9 @@ int fixedlen (TTree *tree) {
       return len + 1;
     case TFalse: case TTrue: case TNot: case TAnd: case TBehind:
       return len;
-    case TRep: case TRunTime: case TOpenCall:
+    case TRep: case TRunTime: case TOpenCall: case TMset:
       return -1;
-    case TCapture: case TRule: case TGrammar:
+    case TCapture: case TRule: case TGrammar: case TMemo:
       /* return fixedlen(sib1(tree)); */
       tree = sib1(tree); goto tailcall;
     case TCall: {
@@ -306,6 +316,10 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
       loopset(i, firstset->cs[i] = 0);
       return 0;
     }
+    case TMset: {  /* a search may start with any char */
+      loopset(i, firstset->cs[i] = 0xFF);
+      return 0;
+    }
     case TChoice: {
       Charset csaux;
       int e1 = getfirst(sib1(tree), follow, firstset);
@@ -334,7 +348,7 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
       loopset(i, firstset->cs[i] |= follow->cs[i]);
       return 1;  /* accept the empty string */
     }
-    case TCapture: case TGrammar: case TRule: {
+    case TCapture: case TGrammar: case TRule: case TMemo: {
       /* return getfirst(sib1(tree), follow, firstset); */
       tree = sib1(tree); goto tailcall;
     }
@@ -380,9 +394,9 @@ static int headfail (TTree *tree) {
     case TChar: case TSet: case TAny: case TFalse:
       return 1;
     case TTrue: case TRep: case TRunTime: case TNot:
-    case TBehind:
+    case TBehind: case TMset:
       return 0;
-    case TCapture: case TGrammar: case TRule: case TAnd:
+    case TCapture: case TGrammar: case TRule: case TAnd: case TMemo:
       tree = sib1(tree); goto tailcall;  /* return headfail(sib1(tree)); */
     case TCall:
       tree = sib2(tree); goto tailcall;  /* return headfail(sib2(tree)); */
@@ -409,7 +423,8 @@ static int needfollow (TTree *tree) {
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
     case TFalse: case TTrue: case TAnd: case TNot:
-    case TRunTime: case TGrammar: case TCall: case TBehind:
+    case TRunTime: case TGrammar: case TCall: case TBehind: case TMemo:
+    case TMset:
       return 0;
     case TChoice: case TRep:
       return 1;
@@ -438,9 +453,13 @@ static int needfollow (TTree *tree) {
 int sizei (const Instruction *i) {
   switch((Opcode)i->i.code) {
     case ISet: case ISpan: return CHARSETINSTSIZE;
+    case IString: return strinstsize(i);
+    case IDispatch: return DISPATCHINSTSIZE + i->i.key;
+    case IMset: return (i + 1)->offset;
     case ITestSet: return CHARSETINSTSIZE + 1;
     case ITestChar: case ITestAny: case IChoice: case IJmp: case ICall:
     case IOpenCall: case ICommit: case IPartialCommit: case IBackCommit:
+    case IMemo: case IMemoEnd:
       return 2;
     default: return 1;
   }
@@ -453,6 +472,8 @@ int sizei (const Instruction *i) {
 typedef struct CompileState {
   Pattern *p;  /* pattern being compiled */
   int ncode;  /* next position in p->code to be filled */
+  int notail;  /* keep tail calls as calls (for profiling) */
+  int nmemo;  /* number of memoized patterns */
   lua_State *L;
 } CompileState;
 
@@ -495,6 +516,7 @@ static int addinstruction (CompileState *compst, Opcode op, int aux) {
   int i = nextinstruction(compst);
   getinstr(compst, i).i.code = op;
   getinstr(compst, i).i.aux = aux;
+  getinstr(compst, i).i.key = 0;
   return i;
 }
 
@@ -605,6 +627,71 @@ static void codecharset (CompileState *compst, const byte *cs, int tt) {
 }
 
 
+/*
+** number of characters in a chain of TChar's at the start of a
+** sequence (the tree built for a literal string)
+*/
+static int strlength (TTree *tree) {
+  int n = 0;
+  while (tree->tag == TSeq && sib1(tree)->tag == TChar) {
+    n++;
+    tree = sib2(tree);
+  }
+  return (tree->tag == TChar) ? n + 1 : n;
+}
+
+
+/*
+** Code the chain of 'n' TChar's starting at 'tree' as IString
+** instructions (each one with at most MAXSTRLEN chars); the first
+** char becomes an IAny if there is an equivalent test dominating it.
+** Return what follows the chain in the sequence (NULL if nothing).
+*/
+static TTree *codestring (CompileState *compst, TTree *tree, int n, int tt) {
+  while (n > 0) {
+    int len = (n < MAXSTRLEN) ? n : MAXSTRLEN;
+    int i, p;
+    if (len == 1 || tt >= 0) {  /* single char or dominated first char? */
+      TTree *c = (tree->tag == TSeq) ? sib1(tree) : tree;
+      codechar(compst, c->u.n, tt);
+      tree = (tree->tag == TSeq) ? sib2(tree) : NULL;
+      tt = NOINST;
+      n--;
+      continue;
+    }
+    p = addinstruction(compst, IString, len);
+    for (i = 1; i < (int)instsize(len); i++)
+      nextinstruction(compst);  /* space for the string */
+    for (i = 0; i < len; i++) {
+      TTree *c = (tree->tag == TSeq) ? sib1(tree) : tree;
+      getinstr(compst, p + 1).buff[i] = (byte)c->u.n;
+      tree = (tree->tag == TSeq) ? sib2(tree) : NULL;
+    }
+    for (; i < (int)((instsize(len) - 1) * sizeof(Instruction)); i++)
+      getinstr(compst, p + 1).buff[i] = 0;  /* clear padding */
+    n -= len;
+  }
+  return tree;
+}
+
+
+/*
+** code a span of chars in 'cs': when the set excludes only one
+** char, use an IScan (a 'memchr' for that char), else an ISpan
+*/
+static void codespan (CompileState *compst, const byte *cs) {
+  Charset cm;
+  int c = 0;
+  loopset(i, cm.cs[i] = ~cs[i]);
+  if (charsettype(cm.cs, &c) == IChar)
+    addinstruction(compst, IScan, c);
+  else {
+    addinstruction(compst, ISpan, 0);
+    addcharset(compst, cs);
+  }
+}
+
+
 /*
 ** code a test set, optimizing unit sets for ITestChar, "complete"
 ** sets for ITestAny, and empty sets for IJmp (always fails).
@@ -663,6 +750,334 @@ static void codebehind (CompileState *compst, TTree *tree) {
 }
 
 
+/*
+** {======================================================
+** Dispatch tables for choices with many alternatives
+** =======================================================
+*/
+
+/*
+** Add a IDispatch instruction with 'n' targets; all chars start
+** mapped to no target (that is, the instruction fails for them)
+*/
+static int adddispatch (CompileState *compst, int n) {
+  int i;
+  int d = addinstruction(compst, IDispatch, 0);
+  for (i = 1; i < (int)DISPATCHINSTSIZE + n; i++)
+    nextinstruction(compst);  /* space for map and targets */
+  getinstr(compst, d).i.key = n;
+  for (i = 0; i <= UCHAR_MAX; i++)
+    getinstr(compst, d + 1).buff[i] = 0;
+  return d;
+}
+
+
+/*
+** Map char 'c' in dispatch 'd' to its target 'k' (1..n)
+*/
+#define setdispatchchar(compst,d,c,k)  (getinstr(compst, (d) + 1).buff[c] = (k))
+
+
+/*
+** Set target 'k' of dispatch 'd' to the current position
+*/
+static void setdispatchtarget (CompileState *compst, int d, int k) {
+  getinstr(compst, d + DISPATCHINSTSIZE + k - 1).offset =
+      gethere(compst) - d;
+}
+
+
+/*
+** Add a jump to the end of a dispatch, chaining it to the previous
+** one ('*jmp'), so that only the last one needs to be patched
+** (peephole optimization collapses the chain).
+*/
+static void addchainjmp (CompileState *compst, int *jmp) {
+  int j = addoffsetinst(compst, IJmp);
+  jumptothere(compst, *jmp, j);
+  *jmp = j;
+}
+
+
+/*
+** number of alternatives in a (possibly nested) ordered choice
+*/
+static int numalts (TTree *tree) {
+  if (tree->tag != TChoice) return 1;
+  else return numalts(sib1(tree)) + numalts(sib2(tree));
+}
+
+
+/*
+** Check whether the alternatives of a choice cannot match the empty
+** string and have pairwise disjoint first sets; 'all' accumulates
+** the first sets already seen.
+*/
+static int disjointalts (TTree *tree, Charset *all) {
+  Charset cs;
+  if (tree->tag == TChoice)
+    return disjointalts(sib1(tree), all) && disjointalts(sib2(tree), all);
+  if (getfirst(tree, fullset, &cs) != 0 || !cs_disjoint(&cs, all))
+    return 0;
+  loopset(i, all->cs[i] |= cs.cs[i]);
+  return 1;
+}
+
+
+/*
+** Code each alternative as a target of dispatch 'd', selected by the
+** chars in its first set. 'k' counts the targets already coded.
+*/
+static void codealts (CompileState *compst, TTree *tree, int d, int *k,
+                      int *jmp, const Charset *fl) {
+  if (tree->tag == TChoice) {
+    codealts(compst, sib1(tree), d, k, jmp, fl);
+    codealts(compst, sib2(tree), d, k, jmp, fl);
+  }
+  else {
+    Charset cs;
+    int c;
+    if (*k > 0)  /* not the first alternative? */
+      addchainjmp(compst, jmp);  /* previous one jumps to the end */
+    getfirst(tree, fullset, &cs);
+    (*k)++;
+    for (c = 0; c <= UCHAR_MAX; c++)
+      if (testchar(cs.cs, c)) setdispatchchar(compst, d, c, *k);
+    setdispatchtarget(compst, d, *k);
+    codegen(compst, tree, 0, NOINST, fl);
+  }
+}
+
+
+/*
+** A literal string from a choice of literals, with its position
+** in that choice
+*/
+typedef struct Literal {
+  const byte *s;
+  int len;
+  int order;
+} Literal;
+
+
+/*
+** Check whether a tree is only a literal string (a chain of TChar's)
+*/
+static int isliteral (TTree *tree) {
+  while (tree->tag == TSeq && sib1(tree)->tag == TChar)
+    tree = sib2(tree);
+  return (tree->tag == TChar);
+}
+
+
+static int allliterals (TTree *tree, int *nbytes) {
+  if (tree->tag == TChoice)
+    return allliterals(sib1(tree), nbytes) && allliterals(sib2(tree), nbytes);
+  *nbytes += strlength(tree);
+  return isliteral(tree);
+}
+
+
+/*
+** Copy the literals of a choice into 'lits' (and their chars into
+** 'buff'); return the next free position in 'buff'
+*/
+static byte *getliterals (TTree *tree, Literal *lits, int *n, byte *buff) {
+  if (tree->tag == TChoice) {
+    buff = getliterals(sib1(tree), lits, n, buff);
+    return getliterals(sib2(tree), lits, n, buff);
+  }
+  else {
+    Literal *l = &lits[*n];
+    l->s = buff; l->len = 0; l->order = (*n)++;
+    for (; tree->tag == TSeq; tree = sib2(tree))
+      buff[l->len++] = (byte)sib1(tree)->u.n;
+    buff[l->len++] = (byte)tree->u.n;
+    return buff + l->len;
+  }
+}
+
+
+/*
+** Sort literals as strings (a prefix comes first); equal literals
+** keep their order in the choice
+*/
+static int literalcmp (const void *a, const void *b) {
+  const Literal *l1 = (const Literal *)a;
+  const Literal *l2 = (const Literal *)b;
+  int res = memcmp(l1->s, l2->s, (l1->len < l2->len) ? l1->len : l2->len);
+  if (res != 0) return res;
+  else if (l1->len != l2->len) return l1->len - l2->len;
+  else return l1->order - l2->order;
+}
+
+
+/*
+** Code 'n' chars from 's' as IString instructions (IChar for a
+** single char)
+*/
+static void codebytes (CompileState *compst, const byte *s, int n) {
+  while (n > 0) {
+    int len = (n < MAXSTRLEN) ? n : MAXSTRLEN;
+    int i, p;
+    if (len == 1) {
+      addinstruction(compst, IChar, *s);
+      return;
+    }
+    p = addinstruction(compst, IString, len);
+    for (i = 1; i < (int)instsize(len); i++)
+      nextinstruction(compst);  /* space for the string */
+    memcpy(getinstr(compst, p + 1).buff, s, len);
+    s += len; n -= len;
+  }
+}
+
+
+static void codetrie (CompileState *compst, Literal *lits, int n,
+                      int depth, int limit);
+
+
+/*
+** Code the branches of a trie node: literals in 'lits[0..n)' longer
+** than 'depth' and before 'limit' in the choice. Each branch starts
+** with a different char; when there is only one, the chars common to
+** all its literals are matched at once.
+*/
+static void codebranches (CompileState *compst, Literal *lits, int n,
+                          int depth, int limit) {
+  int first[UCHAR_MAX + 1], last[UCHAR_MAX + 1];
+  int nb = 0;  /* number of branches */
+  int i, c, k, d = NOINST, jmp = NOINST, test = NOINST;
+  for (c = 0; c <= UCHAR_MAX; c++) first[c] = -1;
+  for (i = 0; i < n; i++) {
+    if (lits[i].order < limit && lits[i].len > depth) {
+      c = lits[i].s[depth];
+      if (first[c] < 0) { first[c] = i; nb++; }
+      last[c] = i + 1;
+    }
+  }
+  if (nb == 1) {  /* single branch: match common chars at once */
+    int ncommon = INT_MAX;
+    const byte *s = NULL;
+    for (i = 0; i < n; i++) {
+      if (lits[i].order < limit && lits[i].len > depth) {
+        int j = depth;
+        if (s == NULL) s = lits[i].s;
+        while (j < lits[i].len && j - depth < ncommon && lits[i].s[j] == s[j])
+          j++;
+        ncommon = j - depth;
+      }
+    }
+    codebytes(compst, s + depth, ncommon);
+    codetrie(compst, lits, n, depth + ncommon, limit);
+    return;
+  }
+  if (nb >= MINDISPATCH && nb <= MAXDISPATCH)
+    d = adddispatch(compst, nb);
+  for (c = 0, k = 0; c <= UCHAR_MAX; c++) {
+    if (first[c] < 0) continue;
+    if (k++ > 0) {
+      addchainjmp(compst, &jmp);  /* previous branch jumps to the end */
+      jumptohere(compst, test);  /* previous test fails to here */
+    }
+    if (d != NOINST) {  /* char was already checked */
+      setdispatchchar(compst, d, c, k);
+      setdispatchtarget(compst, d, k);
+      addinstruction(compst, IAny, 0);
+    }
+    else if (k < nb) {  /* test; any */
+      test = addoffsetinst(compst, ITestChar);
+      getinstr(compst, test).i.aux = c;
+      addinstruction(compst, IAny, 0);
+    }
+    else  /* last branch */
+      addinstruction(compst, IChar, c);
+    codetrie(compst, lits + first[c], last[c] - first[c], depth + 1, limit);
+  }
+  jumptohere(compst, jmp);
+}
+
+
+/*
+** Code a trie node: literals in 'lits[0..n)' (sorted) all share their
+** first 'depth' chars, which were already matched. If one of them
+** (before 'limit') ends here, it matches, so only longer literals
+** before it in the choice are tried: <longer> / true.
+*/
+static void codetrie (CompileState *compst, Literal *lits, int n,
+                      int depth, int limit) {
+  int i;
+  int ended = 0;
+  int longer = 0;
+  for (i = 0; i < n; i++) {
+    if (lits[i].order < limit && lits[i].len == depth) {
+      limit = lits[i].order;  /* later literals cannot be chosen */
+      ended = 1;
+    }
+  }
+  for (i = 0; i < n; i++)
+    if (lits[i].order < limit && lits[i].len > depth) longer = 1;
+  if (!longer)
+    return;  /* literal ended here; match succeeds */
+  else if (!ended)
+    codebranches(compst, lits, n, depth, limit);
+  else {  /* choice L1; <longer>; commit L1; L1: */
+    int pchoice = addoffsetinst(compst, IChoice);
+    int pcommit;
+    codebranches(compst, lits, n, depth, limit);
+    pcommit = addoffsetinst(compst, ICommit);
+    jumptohere(compst, pchoice);
+    jumptohere(compst, pcommit);
+  }
+}
+
+
+/*
+** Choice with many alternatives; optimizations:
+** - when all alternatives are literal strings, code them as a trie
+** (matching each char once, whatever the number of alternatives);
+** - when no alternative accepts the empty string and their first sets
+** are disjoint, a IDispatch goes straight to the only alternative
+** that can match the next char.
+** Return 0 if none of these applies.
+*/
+static int codedispatch (CompileState *compst, TTree *p1, TTree *p2,
+                         const Charset *fl) {
+  int n = numalts(p1) + numalts(p2);
+  int nbytes = 0;
+  Charset all;
+  if (n < MINDISPATCH)
+    return 0;
+  if (allliterals(p1, &nbytes) && allliterals(p2, &nbytes)) {
+    lua_State *L = compst->L;
+    Literal *lits;
+    byte *buff;
+    int i = 0;
+    luaL_checkstack(L, 1, "too many nested choices");
+    lits = (Literal *)lua_newuserdata(L, n * sizeof(Literal) + nbytes);
+    buff = (byte *)(lits + n);
+    buff = getliterals(p1, lits, &i, buff);
+    getliterals(p2, lits, &i, buff);
+    qsort(lits, n, sizeof(Literal), literalcmp);
+    codetrie(compst, lits, n, 0, INT_MAX);
+    lua_pop(L, 1);  /* remove literals */
+    return 1;
+  }
+  loopset(i, all.cs[i] = 0);
+  if (n <= MAXDISPATCH && disjointalts(p1, &all) && disjointalts(p2, &all)) {
+    int k = 0, jmp = NOINST;
+    int d = adddispatch(compst, n);
+    codealts(compst, p1, d, &k, &jmp, fl);
+    codealts(compst, p2, d, &k, &jmp, fl);
+    jumptohere(compst, jmp);
+    return 1;
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Choice; optimizations:
 ** - when p1 is headfail or
@@ -673,12 +1088,16 @@ static void codebehind (CompileState *compst, TTree *tree) {
 ** as then there is no character at all...)
 ** - when p2 is empty and opt is true; a IPartialCommit can reuse
 ** the Choice already active in the stack.
+** - with many alternatives, see 'codedispatch'.
 */
 static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
                         const Charset *fl) {
   int emptyp2 = (p2->tag == TTrue);
   Charset cs1, cs2;
-  int e1 = getfirst(p1, fullset, &cs1);
+  int e1;
+  if (codedispatch(compst, p1, p2, fl))
+    return;
+  e1 = getfirst(p1, fullset, &cs1);
   if (headfail(p1) ||
       (!e1 && (getfirst(p2, fl, &cs2), cs_disjoint(&cs1, &cs2)))) {
     /* <p1 / p2> == test (fail(p1)) -> L1 ; p1 ; jmp L2; L1: p2; L2: */
@@ -764,9 +1183,52 @@ static void coderuntime (CompileState *compst, TTree *tree, int tt) {
 }
 
 
+/*
+** Multiple-string search: the automaton follows the instruction,
+** whose offset is its total size
+*/
+static void codemset (CompileState *compst, TTree *tree) {
+  int n = tree->u.n;  /* size of the automaton, in ints */
+  int i = addinstruction(compst, IMset, 0);
+  int k;
+  for (k = 0; k <= n; k++)
+    nextinstruction(compst);  /* space for the size and the automaton */
+  setoffset(compst, i, n + 2);
+  memcpy(&getinstr(compst, i + 2), treebuffer(tree), n * sizeof(int));
+}
+
+
+/*
+** Memoized pattern; each one gets its own key:
+**     memo key L1; p; memo_end key L2; L1: memo_fail key; L2:
+** 'memo' replays a saved result (jumping past 'memo_fail' on success)
+** or stacks an entry like a choice; 'memo_end' pops it and saves the
+** success; 'memo_fail' saves the failure. 'p' is coded as a pattern
+** by itself, as its result must not depend on what follows it.
+*/
+static void codememo (CompileState *compst, TTree *tree) {
+  int key = compst->nmemo++;
+  int pmemo, pend;
+  if (key > SHRT_MAX)
+    luaL_error(compst->L, "too many memoized patterns");
+  pmemo = addoffsetinst(compst, IMemo);
+  getinstr(compst, pmemo).i.key = key;
+  codegen(compst, sib1(tree), 0, NOINST, fullset);
+  pend = addoffsetinst(compst, IMemoEnd);
+  getinstr(compst, pend).i.key = key;
+  jumptohere(compst, pmemo);
+  addinstruction(compst, IMemoFail, 0);
+  getinstr(compst, gethere(compst) - 1).i.key = key;
+  jumptohere(compst, pend);
+}
+
+
 /*
 ** Repetion; optimizations:
-** When pattern is a charset, can use special instruction ISpan.
+** When pattern is a charset, can use special instruction ISpan (or
+** IScan).
+** When pattern is (1 - p), any char not in first(p) can be skipped
+** with an ISpan (or IScan) before the loop.
 ** When pattern is head fail, or if it starts with characters that
 ** are disjoint from what follows the repetions, a simple test
 ** is enough (a fail inside the repetition would backtrack to fail
@@ -777,12 +1239,17 @@ static void coderuntime (CompileState *compst, TTree *tree, int tt) {
 static void coderep (CompileState *compst, TTree *tree, int opt,
                      const Charset *fl) {
   Charset st;
-  if (tocharset(tree, &st)) {
-    addinstruction(compst, ISpan, 0);
-    addcharset(compst, st.cs);
-  }
+  if (tocharset(tree, &st))
+    codespan(compst, st.cs);
   else {
-    int e1 = getfirst(tree, fullset, &st);
+    int e1;
+    if (tree->tag == TSeq && sib1(tree)->tag == TNot &&
+        sib2(tree)->tag == TAny &&
+        getfirst(sib1(sib1(tree)), fullset, &st) == 0) {
+      cs_complement(&st);  /* chars where 'p' surely fails */
+      codespan(compst, st.cs);
+    }
+    e1 = getfirst(tree, fullset, &st);
     if (headfail(tree) || (!e1 && cs_disjoint(&st, fl))) {
       /* L1: test (fail(p1)) -> L2; <p>; jmp L1; L2: */
       int jmp;
@@ -842,7 +1309,7 @@ static void codenot (CompileState *compst, TTree *tree) {
 ** correct offsets; also optimize tail calls
 */
 static void correctcalls (CompileState *compst, int *positions,
-                          int from, int to) {
+                          int *names, int from, int to) {
   int i;
   Instruction *code = compst->p->code;
   for (i = from; i < to; i += sizei(&code[i])) {
@@ -850,10 +1317,12 @@ static void correctcalls (CompileState *compst, int *positions,
       int n = code[i].i.key;  /* rule number */
       int rule = positions[n];  /* rule position */
       assert(rule == from || code[rule - 1].i.code == IRet);
-      if (code[finaltarget(code, i + 2)].i.code == IRet)  /* call; ret ? */
+      if (!compst->notail &&
+          code[finaltarget(code, i + 2)].i.code == IRet)  /* call; ret ? */
         code[i].i.code = IJmp;  /* tail call */
       else
         code[i].i.code = ICall;
+      code[i].i.key = names[n];  /* rule name (for profiling) */
       jumptothere(compst, i, rule);  /* call jumps to respective rule */
     }
   }
@@ -867,20 +1336,23 @@ static void correctcalls (CompileState *compst, int *positions,
 */
 static void codegrammar (CompileState *compst, TTree *grammar) {
   int positions[MAXRULES];
+  int names[MAXRULES];  /* 'ktable' indices of rule names */
   int rulenumber = 0;
   TTree *rule;
   int firstcall = addoffsetinst(compst, ICall);  /* call initial rule */
   int jumptoend = addoffsetinst(compst, IJmp);  /* jump to the end */
   int start = gethere(compst);  /* here starts the initial rule */
   jumptohere(compst, firstcall);
+  getinstr(compst, firstcall).i.key = sib1(grammar)->key;
   for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule)) {
+    names[rulenumber] = rule->key;
     positions[rulenumber++] = gethere(compst);  /* save rule position */
     codegen(compst, sib1(rule), 0, NOINST, fullset);  /* code rule */
     addinstruction(compst, IRet, 0);
   }
   assert(rule->tag == TTrue);
   jumptohere(compst, jumptoend);
-  correctcalls(compst, positions, start, gethere(compst));
+  correctcalls(compst, positions, names, start, gethere(compst));
 }
 
 
@@ -932,9 +1404,20 @@ static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
     case TAnd: codeand(compst, sib1(tree), tt); break;
     case TCapture: codecapture(compst, tree, tt, fl); break;
     case TRunTime: coderuntime(compst, tree, tt); break;
+    case TMemo: codememo(compst, tree); break;
+    case TMset: codemset(compst, tree); break;
     case TGrammar: codegrammar(compst, tree); break;
     case TCall: codecall(compst, tree); break;
     case TSeq: {
+      if (sib1(tree)->tag == TChar) {  /* literal string? */
+        int n = strlength(tree);
+        if (n > 1) {
+          tree = codestring(compst, tree, n, tt);
+          if (tree == NULL) break;  /* sequence was only a string */
+          tt = NOINST;
+          goto tailcall;
+        }
+      }
       tt = codeseq1(compst, sib1(tree), sib2(tree), tt, fl);  /* code 'p1' */
       /* codegen(compst, p2, opt, tt, fl); */
       tree = sib2(tree); goto tailcall;
@@ -961,10 +1444,18 @@ static void peephole (CompileState *compst) {
     switch (code[i].i.code) {
       case IChoice: case ICall: case ICommit: case IPartialCommit:
       case IBackCommit: case ITestChar: case ITestSet:
-      case ITestAny: {  /* instructions with labels */
+      case ITestAny: case IMemoEnd: {  /* instructions with labels */
         jumptothere(compst, i, finallabel(code, i));  /* optimize label */
         break;
       }
+      case IDispatch: {  /* optimize all its labels */
+        int k;
+        for (k = 1; k <= code[i].i.key; k++) {
+          Instruction *t = &code[i + DISPATCHINSTSIZE + k - 1];
+          t->offset = finaltarget(code, i + t->offset) - i;
+        }
+        break;
+      }
       case IJmp: {
         int ft = finaltarget(code, i);
         switch (code[ft].i.code) {  /* jumping to what? */
@@ -998,9 +1489,10 @@ static void peephole (CompileState *compst) {
 /*
 ** Compile a pattern
 */
-Instruction *compile (lua_State *L, Pattern *p) {
+Instruction *compile (lua_State *L, Pattern *p, int notail) {
   CompileState compst;
   compst.p = p;  compst.ncode = 0;  compst.L = L;
+  compst.notail = notail;  compst.nmemo = 0;
   realloccode(L, p, 2);  /* minimum initial size */
   codegen(&compst, p->tree, 0, NOINST, fullset);
   addinstruction(&compst, IEnd, 0);
@@ -16,7 +16,7 @@ int checkaux (TTree *tree, int pred);
 int fixedlen (TTree *tree);
 int hascaptures (TTree *tree);
 int lp_gc (lua_State *L);
-Instruction *compile (lua_State *L, Pattern *p);
+Instruction *compile (lua_State *L, Pattern *p, int notail);
 void realloccode (lua_State *L, Pattern *p, int nsize);
 int sizei (const Instruction *i);
 
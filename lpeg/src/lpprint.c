@@ -42,7 +42,7 @@ static const char *capkind (int kind) {
     "close", "position", "constant", "backref",
     "argument", "simple", "table", "function",
     "query", "string", "num", "substitution", "fold",
-    "runtime", "group"};
+    "runtime", "group", "mset"};
   return modes[kind];
 }
 
@@ -54,12 +54,13 @@ static void printjmp (const Instruction *op, const Instruction *p) {
 
 void printinst (const Instruction *op, const Instruction *p) {
   const char *const names[] = {
-    "any", "char", "set",
+    "any", "char", "set", "string",
     "testany", "testchar", "testset",
-    "span", "behind",
+    "span", "scan", "dispatch", "behind",
     "ret", "end",
     "choice", "jmp", "call", "open_call",
     "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
+    "memo", "memo_end", "memo_fail", "mset",
      "fullcapture", "opencapture", "closecapture", "closeruntime"
   };
   printf("%02ld: %s ", (long)(p - op), names[p->i.code]);
@@ -72,6 +73,14 @@ void printinst (const Instruction *op, const Instruction *p) {
       printf("'%c'", p->i.aux); printjmp(op, p);
       break;
     }
+    case IString: {
+      printf("'%.*s'", p->i.aux, (const char *)(p+1)->buff);
+      break;
+    }
+    case IScan: {
+      printf("'%c'", p->i.aux);
+      break;
+    }
     case IFullCapture: {
       printf("%s (size = %d)  (idx = %d)",
              capkind(getkind(p)), getoff(p), p->i.key);
@@ -93,6 +102,18 @@ void printinst (const Instruction *op, const Instruction *p) {
       printcharset((p+1)->buff);
       break;
     }
+    case IDispatch: {
+      int k, c;
+      for (k = 1; k <= p->i.key; k++) {  /* print chars for each target */
+        Charset cs;
+        loopset(i, cs.cs[i] = 0);
+        for (c = 0; c <= UCHAR_MAX; c++)
+          if ((p+1)->buff[c] == k) setchar(cs.cs, c);
+        printcharset(cs.cs);
+        printf("-> %d ", (int)(p + (p + DISPATCHINSTSIZE + k - 1)->offset - op));
+      }
+      break;
+    }
     case IOpenCall: {
       printf("-> %d", (p + 1)->offset);
       break;
@@ -101,6 +122,18 @@ void printinst (const Instruction *op, const Instruction *p) {
       printf("%d", p->i.aux);
       break;
     }
+    case IMemo: case IMemoEnd: {
+      printf("%d ", p->i.key); printjmp(op, p);
+      break;
+    }
+    case IMemoFail: {
+      printf("%d", p->i.key);
+      break;
+    }
+    case IMset: {
+      printf("(%d states)", ((const int *)(p + 2))[0]);
+      break;
+    }
     case IJmp: case ICall: case ICommit: case IChoice:
     case IPartialCommit: case IBackCommit: case ITestAny: {
       printjmp(op, p);
@@ -153,7 +186,8 @@ static const char *tagnames[] = {
   "not", "and",
   "call", "opencall", "rule", "grammar",
   "behind",
-  "capture", "run-time"
+  "capture", "run-time",
+  "memo", "mset"
 };
 
 
@@ -180,6 +214,10 @@ void printtree (TTree *tree, int ident) {
       printf(" key: %d  (rule: %d)\n", tree->key, sib2(tree)->cap);
       break;
     }
+    case TMset: {
+      printf(" (%d states)\n", ((const int *)treebuffer(tree))[0]);
+      break;
+    }
     case TBehind: {
       printf(" %d\n", tree->u.n);
         printtree(sib1(tree), ident + 2);
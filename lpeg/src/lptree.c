@@ -5,6 +5,7 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -27,7 +28,9 @@ const byte numsiblings[] = {
   1, 1,		/* not, and */
   0, 0, 2, 1,  /* call, opencall, rule, grammar */
   1,  /* behind */
-  1, 1  /* capture, runtime capture */
+  1, 1,  /* capture, runtime capture */
+  1,  /* memo */
+  0  /* mset */
 };
 
 
@@ -362,7 +365,8 @@ static TTree *newtree (lua_State *L, int len) {
   lua_pushvalue(L, -1);
   lua_setuservalue(L, -3);
   lua_setmetatable(L, -2);
-  p->code = NULL;  p->codesize = 0;
+  p->code = NULL;  p->codesize = 0;  p->prof = NULL;
+  memset(p->tree, 0, len * sizeof(TTree));  /* keep dumps deterministic */
   return p->tree;
 }
 
@@ -611,6 +615,15 @@ static int lp_and (lua_State *L) {
 }
 
 
+/*
+** M(p): p with its results memoized
+*/
+static int lp_memo (lua_State *L) {
+  newroot1sib(L, TMemo);
+  return 1;
+}
+
+
 /*
 ** -p == !p
 */
@@ -690,6 +703,138 @@ static int lp_behind (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Multiple-string search
+** =======================================================
+*/
+
+typedef struct MsetString {
+  const byte *s;
+  size_t len;
+  int n;  /* position in the list */
+} MsetString;
+
+
+/*
+** Sort strings (a prefix comes first); equal strings keep their order
+** in the list
+*/
+static int msetcmp (const void *a, const void *b) {
+  const MsetString *s1 = (const MsetString *)a;
+  const MsetString *s2 = (const MsetString *)b;
+  int res = memcmp(s1->s, s2->s, (s1->len < s2->len) ? s1->len : s2->len);
+  if (res != 0) return res;
+  else if (s1->len != s2->len) return (s1->len < s2->len) ? -1 : 1;
+  else return s1->n - s2->n;
+}
+
+
+static size_t commonprefix (const MsetString *s1, const MsetString *s2) {
+  size_t i = 0;
+  while (i < s1->len && i < s2->len && s1->s[i] == s2->s[i]) i++;
+  return i;
+}
+
+
+/*
+** Build the Aho-Corasick automaton for the strings in 'strs' (sorted)
+** into 'a', which has space for 'ns' states and 'nr' rows. The trie is
+** built in the order of the strings, so the children of each state are
+** created in the order of their chars. 'aux' has space for
+** 3 * ns + maxlen + 1 ints.
+*/
+static void buildmset (int *a, int ns, int nr, const MsetString *strs,
+                       int n, int *aux) {
+  int *parent = aux, *ch = aux + ns, *queue = aux + 2 * ns;
+  int *path = aux + 3 * ns;  /* states along the previous string */
+  int *first, *fail, *out, *row, *edges, *rows;
+  int i, st, qn;
+  a[0] = ns; a[1] = nr;  /* (needed to locate the arrays) */
+  first = msetfirst(a); fail = msetfail(a); out = msetout(a);
+  row = msetrow(a); edges = msetedges(a); rows = msetrows(a);
+  path[0] = 0;
+  for (i = 0, st = 1; i < n; i++) {  /* build the trie */
+    size_t d = (i > 0) ? commonprefix(&strs[i - 1], &strs[i]) : 0;
+    for (; d < strs[i].len; d++) {
+      parent[st] = path[d]; ch[st] = strs[i].s[d];
+      path[d + 1] = st++;
+    }
+    if (out[path[strs[i].len]] == 0)  /* first occurrence of string? */
+      out[path[strs[i].len]] = strs[i].n;
+  }
+  assert(st == ns);
+  for (st = 1; st < ns; st++)  /* count children of each state */
+    first[parent[st]]++;
+  for (i = 1; i <= ns; i++)  /* 'first[i]' is end of edges of state 'i' */
+    first[i] += first[i - 1];
+  for (st = ns - 1; st > 0; st--)  /* fill edges backwards */
+    edges[--first[parent[st]]] = (st << 8) | ch[st];
+  for (st = 1; st < ns; st++) row[st] = -1;
+  for (i = first[0]; i < first[1]; i++)  /* row of initial state */
+    rows[edges[i] & 0xFF] = edges[i] >> 8;
+  for (i = first[0]; i < first[1]; i++) {  /* rows of its children */
+    int u = edges[i] >> 8, e;
+    int *r = rows + (i - first[0] + 1) * (UCHAR_MAX + 1);
+    row[u] = i - first[0] + 1;
+    memcpy(r, rows, (UCHAR_MAX + 1) * sizeof(int));  /* failures */
+    for (e = first[u]; e < first[u + 1]; e++)
+      r[edges[e] & 0xFF] = edges[e] >> 8;
+  }
+  queue[0] = 0;
+  for (i = 0, qn = 1; i < qn; i++) {  /* failures, in breadth-first order */
+    int r = queue[i], e;
+    for (e = first[r]; e < first[r + 1]; e++) {
+      int u = edges[e] >> 8;
+      fail[u] = (r == 0) ? 0 : msetnext(a, fail[r], edges[e] & 0xFF);
+      if (out[u] == 0)  /* no string ends here? */
+        out[u] = out[fail[u]];  /* longest one that ends in its suffix */
+      queue[qn++] = u;
+    }
+  }
+}
+
+
+static int lp_mset (lua_State *L) {
+  int n, i, ns = 1, nr = 1, maxlen = 0;
+  size_t total = 0;
+  MsetString *strs;
+  TTree *tree;
+  int *aux;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_rawlen(L, 1);
+  luaL_argcheck(L, n <= USHRT_MAX, 1, "too many strings");
+  strs = (MsetString *)lua_newuserdata(L, n * sizeof(MsetString));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_argerror(L, 1, "list of strings expected");
+    strs[i].s = (const byte *)lua_tolstring(L, -1, &strs[i].len);
+    strs[i].n = i + 1;
+    luaL_argcheck(L, strs[i].len > 0, 1, "empty string in set");
+    total += strs[i].len;
+    luaL_argcheck(L, total < MAXMSETSTATES, 1, "strings too long");
+    lua_pop(L, 1);  /* (string is kept by the list) */
+  }
+  qsort(strs, n, sizeof(MsetString), msetcmp);
+  for (i = 0; i < n; i++) {  /* count states (one per trie node) */
+    ns += strs[i].len - ((i > 0) ? commonprefix(&strs[i - 1], &strs[i]) : 0);
+    if (i > 0 && strs[i].s[0] != strs[i - 1].s[0])
+      nr++;  /* one more child of the initial state */
+    if ((int)strs[i].len > maxlen) maxlen = strs[i].len;
+  }
+  if (n > 0) nr++;  /* (first child) */
+  aux = (int *)lua_newuserdata(L, (3 * ns + maxlen + 1) * sizeof(int));
+  tree = newtree(L, bytes2slots(msetsize(ns, nr) * sizeof(int)) + 1);
+  tree->tag = TMset;
+  tree->u.n = msetsize(ns, nr);
+  buildmset((int *)treebuffer(tree), ns, nr, strs, n, aux);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Create a non-terminal
 */
@@ -1004,7 +1149,7 @@ static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
-    case TFalse:
+    case TFalse: case TMset:
       return nb;  /* cannot pass from here */
     case TTrue:
     case TBehind:  /* look-behind cannot have calls */
@@ -1012,7 +1157,7 @@ static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
     case TNot: case TAnd: case TRep:
       /* return verifyrule(L, sib1(tree), passed, npassed, 1); */
       tree = sib1(tree); nb = 1; goto tailcall;
-    case TCapture: case TRunTime:
+    case TCapture: case TRunTime: case TMemo:
       /* return verifyrule(L, sib1(tree), passed, npassed, nb); */
       tree = sib1(tree); goto tailcall;
     case TCall:
@@ -1103,7 +1248,22 @@ static Instruction *prepcompile (lua_State *L, Pattern *p, int idx) {
   lua_getuservalue(L, idx);  /* push 'ktable' (may be used by 'finalfix') */
   finalfix(L, 0, NULL, p->tree);
   lua_pop(L, 1);  /* remove 'ktable' */
-  return compile(L, p);
+  return compile(L, p, 0);
+}
+
+
+/*
+** Get the code to run for the pattern at 'idx' (its profiling code,
+** if it is being profiled) and its profiling counters
+*/
+static Instruction *getcode (lua_State *L, Pattern *p, int idx,
+                             ProfCount **prof) {
+  if (p->prof != NULL) {
+    *prof = p->prof->count;
+    return p->prof->code;
+  }
+  *prof = NULL;
+  return (p->code != NULL) ? p->code : prepcompile(L, p, idx);
 }
 
 
@@ -1135,8 +1295,8 @@ static int lp_printcode (lua_State *L) {
 ** Get the initial position for the match, interpreting negative
 ** values from the end of the subject
 */
-static size_t initposition (lua_State *L, size_t len) {
-  lua_Integer ii = luaL_optinteger(L, 3, 1);
+static size_t initposition (lua_State *L, size_t len, int idx) {
+  lua_Integer ii = luaL_optinteger(L, idx, 1);
   if (ii > 0) {  /* positive index? */
     if ((size_t)ii <= len)  /* inside the string? */
       return (size_t)ii - 1;  /* return it (corrected to 0-base) */
@@ -1151,29 +1311,925 @@ static size_t initposition (lua_State *L, size_t len) {
 
 
 /*
-** Main match function
+** Match context: the stack and capture list that grew in a previous
+** match are kept (in the table at upvalue 1 of the match functions)
+** and reused, so that patterns that routinely need large ones do not
+** reallocate them on every call. A match takes them out of the
+** context and gives them back when done; a nested match (from inside
+** a capture) or a match that raised an error just does not reuse them.
 */
-static int lp_match (lua_State *L) {
+#define CTXCAPS		1
+#define CTXSTACK	2
+
+
+/*
+** Push the rest of the stack layout for the VM (above the match
+** arguments), taking the arrays in the context. Return the capture
+** list. 'ms->prof' must be already set: the profiling state of the
+** pattern is kept in the stack so that the match does not lose its
+** code if a Lua function stops the profiling.
+*/
+static Capture *takecontext (lua_State *L, Capture *capture,
+                             MatchState *ms) {
+  int ctx = lua_upvalueindex(1);
+  ms->more = 0; ms->p = NULL;
+  ms->stacksize = ms->capsize = 0;
+  lua_pushnil(L);  /* initialize subscache */
+  lua_rawgeti(L, ctx, CTXCAPS);  /* initialize caplistidx */
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushlightuserdata(L, capture);
+  }
+  else {
+    capture = (Capture *)lua_touserdata(L, -1);
+    ms->capsize = lua_rawlen(L, -1) / sizeof(Capture);
+    lua_pushnil(L);
+    lua_rawseti(L, ctx, CTXCAPS);
+  }
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  if (ms->prof == NULL)
+    lua_pushnil(L);  /* initialize profidx */
+  else {
+    lua_getfield(L, LUA_REGISTRYINDEX, PROFILESIDX);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);  /* initialize profidx */
+    lua_remove(L, -2);
+  }
+  lua_rawgeti(L, ctx, CTXSTACK);
+  if (lua_isnil(L, -1))
+    lua_pop(L, 1);  /* 'match' will push its own stack */
+  else {
+    ms->stacksize = lua_rawlen(L, -1) / sizeof(Stack);
+    lua_pushnil(L);
+    lua_rawseti(L, ctx, CTXSTACK);
+  }
+  return capture;
+}
+
+
+/*
+** Give back to the context the arrays used by a match, if they are
+** Lua userdata (that is, they are not the initial C arrays) and not
+** too large
+*/
+static void givecontext (lua_State *L, int ptop) {
+  int ctx = lua_upvalueindex(1);
+  if (lua_type(L, caplistidx(ptop)) == LUA_TUSERDATA &&
+      lua_rawlen(L, caplistidx(ptop)) <= MAXCONTEXT) {
+    lua_pushvalue(L, caplistidx(ptop));
+    lua_rawseti(L, ctx, CTXCAPS);
+  }
+  if (lua_type(L, stackidx(ptop)) == LUA_TUSERDATA &&
+      lua_rawlen(L, stackidx(ptop)) <= MAXCONTEXT) {
+    lua_pushvalue(L, stackidx(ptop));
+    lua_rawseti(L, ctx, CTXSTACK);
+  }
+}
+
+
+/*
+** Run a match whose arguments are already in the stack (up to 'ptop')
+** and push its results. Return their number (0 if the match fails).
+*/
+static int runmatch (lua_State *L, const Instruction *code,
+                     ProfCount *prof, const char *s, size_t i, size_t l,
+                     int ptop) {
   Capture capture[INITCAPSIZE];
+  MatchState ms;
+  Capture *cap;
   const char *r;
+  int n;
+  ms.prof = prof;
+  cap = takecontext(L, capture, &ms);
+  r = match(L, s, s + i, s + l, code, cap, ptop, &ms);
+  n = (r == NULL) ? 0 : getcaptures(L, s, r, ptop, 0);
+  givecontext(L, ptop);
+  return n;
+}
+
+
+/*
+** Main match function
+*/
+static int lp_match (lua_State *L) {
   size_t l;
+  ProfCount *prof;
   Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
-  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  Instruction *code = getcode(L, p, 1, &prof);
   const char *s = luaL_checklstring(L, SUBJIDX, &l);
-  size_t i = initposition(L, l);
-  int ptop = lua_gettop(L);
+  size_t i = initposition(L, l, 3);
+  int n = runmatch(L, code, prof, s, i, l, lua_gettop(L));
+  if (n == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  return n;
+}
+
+
+/*
+** match_into(pattern, subject, table [, init, ...]): like 'match', but
+** store the results in 'table' (from index 1, clearing the old
+** sequence after them) instead of returning them. Return the number
+** of results, or nil if the match fails.
+*/
+static int lp_matchinto (lua_State *L) {
+  size_t l;
+  int n, k;
+  ProfCount *prof;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Instruction *code = getcode(L, p, 1, &prof);
+  const char *s = luaL_checklstring(L, SUBJIDX, &l);
+  size_t i = initposition(L, l, 4);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  if (lua_gettop(L) >= 4)
+    lua_remove(L, 4);  /* table goes to the place of 'init' */
+  n = runmatch(L, code, prof, s, i, l, lua_gettop(L));
+  if (n == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  for (k = n; k > 0; k--)
+    lua_rawseti(L, 3, k);
+  for (k = n + 1; ; k++) {  /* clear old results */
+    lua_rawgeti(L, 3, k);
+    if (lua_isnil(L, -1)) break;
+    lua_pushnil(L);
+    lua_rawseti(L, 3, k);
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+
+/*
+** code(pattern): the compiled code of a pattern (a light userdata), to
+** be run by 'lpeg_match'. It is valid while the pattern is alive.
+*/
+static int lp_code (lua_State *L) {
+  Pattern *p = getpattern(L, 1);
+  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  lua_pushlightuserdata(L, code);
+  return 1;
+}
+
+
+/*
+** Match without a Lua state, for foreign callers (such as the LuaJIT
+** FFI): run 'code' (from 'lpeg.code') over 'subject' from offset
+** 'init' and store in 'ovec', which has room for 'n' pairs of offsets
+** (start, end), the match and the values of its captures. Only simple,
+** position, and group captures have such values. Return the number of
+** pairs (which can be more than 'n'; only the first 'n' are stored),
+** 0 if the match fails, or an error code (LPEG_ENOLUA, LPEG_ENOMEM).
+** The VM reads no byte at or after 'subject + len', so 'subject' does
+** not need a terminator.
+*/
+LUALIB_API int lpeg_match (const void *code, const char *subject,
+                           size_t len, size_t init, int *ovec, int n);
+int lpeg_match (const void *code, const char *subject, size_t len,
+                size_t init, int *ovec, int n) {
+  Capture capture[INITCAPSIZE];
+  MatchState ms;
+  const char *r;
+  int k;
+  if (len > (size_t)INT_MAX)  /* offsets would not fit in 'ovec' */
+    return LPEG_ENOMEM;
+  if (init > len) init = len;
+  memset(&ms, 0, sizeof(ms));
+  ms.ccapture = capture;
+  r = match(NULL, subject, subject + init, subject + len,
+            (const Instruction *)code, capture, 0, &ms);
+  if (ms.err != 0)
+    k = ms.err;
+  else if (r == NULL)
+    k = 0;
+  else {
+    if (n > 0) {
+      ovec[0] = (int)init;
+      ovec[1] = r - subject;
+    }
+    k = getcapoffsets(ms.ccapture, subject, ovec, n);
+  }
+  if (ms.capheap) free(ms.ccapture);
+  if (ms.stackheap) free(ms.cstack);
+  return k;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Stream matching
+** =======================================================
+*/
+
+/* status of a stream match (as returned to Lua) */
+#define STREAM_MORE	1
+#define STREAM_DONE	0
+#define STREAM_FAIL	(-1)
+
+/* minimum size for the input buffer of a stream match */
+#define MINSTREAMBUFF	1024
+
+/* slots in the environment table of a stream match */
+#define ENVPATT		1  /* pattern */
+#define ENVCAPS		2  /* capture list */
+#define ENVSTACK	3  /* backtrack stack */
+#define ENVDYN		4  /* table with the dynamic captures */
+#define ENVPROF		5  /* profiling state whose code the match runs */
+#define ENVARGS		6  /* first extra argument */
+
+
+/*
+** A match fed with input in chunks. The input still needed by the
+** match is kept in 'buff'; the backtrack stack and the capture list
+** of a suspended match point into it.
+*/
+typedef struct StreamState {
+  MatchState ms;
+  const Instruction *code;  /* code being run (fixed when stream starts) */
+  char *buff;  /* input kept for the match */
+  size_t size;  /* size of 'buff' */
+  size_t len;  /* number of input bytes in 'buff' */
+  size_t base;  /* position of 'buff' in the whole input */
+  size_t init;  /* initial position of the match in the whole input */
+  int status;
+  int hasruntime;  /* pattern has match-time captures? */
+  int nargs;  /* number of extra arguments */
+} StreamState;
+
+
+/*
+** Make all positions of a suspended match that point into the input
+** at 'from' point to the same input at 'to'
+*/
+static void moveinput (StreamState *st, Stack *stack, Capture *capture,
+                       const char *from, const char *to) {
+  int i;
+  if (st->ms.p == NULL) return;  /* no suspended match */
+  for (i = 0; i < st->ms.nstack; i++)
+    if (stack[i].s != NULL) stack[i].s = to + (stack[i].s - from);
+  for (i = 0; i < st->ms.captop; i++)
+    capture[i].s = to + (capture[i].s - from);
+  st->ms.s = to + (st->ms.s - from);
+}
+
+
+static void freeinput (lua_State *L, StreamState *st) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  f(ud, st->buff, st->size, 0);
+  st->buff = NULL; st->size = st->len = 0;
+}
+
+
+/*
+** Add a chunk of input to the buffer (keeping it zero terminated, as
+** the VM may read the char at the end of the subject)
+*/
+static void addinput (lua_State *L, StreamState *st, Stack *stack,
+                      Capture *capture, const char *chunk, size_t l) {
+  if (st->len + l + 1 > st->size) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    size_t newsize = st->size * 2;
+    char *newbuff;
+    if (newsize < st->len + l + 1) newsize = st->len + l + 1;
+    if (newsize < MINSTREAMBUFF) newsize = MINSTREAMBUFF;
+    newbuff = (char *)f(ud, NULL, 0, newsize);
+    if (newbuff == NULL)
+      luaL_error(L, "not enough memory");
+    if (st->buff != NULL) {
+      memcpy(newbuff, st->buff, st->len);
+      moveinput(st, stack, capture, st->buff, newbuff);
+      f(ud, st->buff, st->size, 0);
+    }
+    st->buff = newbuff; st->size = newsize;
+  }
+  memcpy(st->buff + st->len, chunk, l);
+  st->len += l;
+  st->buff[st->len] = '\0';
+}
+
+
+/*
+** Discard the input before all positions that a suspended match can
+** still reach (keeping MAXBEHIND chars for look-behinds). Match-time
+** captures get the whole subject, so their patterns keep all input.
+** Input is only moved when at least half of it can go.
+*/
+static void shrinkinput (StreamState *st, Stack *stack, Capture *capture) {
+  const char *keep = st->ms.s;
+  size_t d;
+  int i;
+  if (st->hasruntime) return;
+  for (i = 1; i < st->ms.nstack; i++)  /* entry 0 is never resumed */
+    if (stack[i].s != NULL && stack[i].s < keep) keep = stack[i].s;
+  for (i = 0; i < st->ms.captop; i++)
+    if (capture[i].s < keep) keep = capture[i].s;
+  d = keep - st->buff;
+  d = (d > MAXBEHIND) ? d - MAXBEHIND : 0;
+  if (d == 0 || d < st->len / 2) return;
+  if (st->ms.prof != NULL) {  /* entry positions of calls move too */
+    for (i = 1; i < st->ms.nstack; i++)
+      if (stack[i].s == NULL) stack[i].caplevel -= d;
+  }
+  stack[0].s = st->buff + d;
+  moveinput(st, stack, capture, st->buff + d, st->buff);
+  memmove(st->buff, st->buff + d, st->len - d + 1);
+  st->len -= d;
+  st->base += d;
+}
+
+
+/*
+** Push the stack and capture list of the stream's match (kept in its
+** environment) and return them in '*stack' and '*capture'
+*/
+static void getmatchstate (lua_State *L, int env, Stack **stack,
+                           Capture **capture) {
+  lua_rawgeti(L, env, ENVSTACK);
+  *stack = (Stack *)lua_touserdata(L, -1);
+  lua_rawgeti(L, env, ENVCAPS);
+  *capture = (Capture *)lua_touserdata(L, -1);
+}
+
+
+/*
+** Save the state of a suspended match into its environment: capture
+** list and stack (which may have been reallocated) and dynamic
+** captures (which are in the Lua stack)
+*/
+static void savematchstate (lua_State *L, StreamState *st, int env,
+                            int ptop) {
+  int i;
+  lua_pushvalue(L, caplistidx(ptop));
+  lua_rawseti(L, env, ENVCAPS);
+  lua_pushvalue(L, stackidx(ptop));
+  lua_rawseti(L, env, ENVSTACK);
+  if (st->ms.ndyncap > 0) {
+    lua_createtable(L, st->ms.ndyncap, 0);
+    for (i = 1; i <= st->ms.ndyncap; i++) {
+      lua_pushvalue(L, memoidx(ptop) + i);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  else lua_pushnil(L);
+  lua_rawseti(L, env, ENVDYN);
+}
+
+
+/*
+** Function returned by 'streammatch': feed the match with another
+** chunk of input ('eos' is true for the last one). Returns
+** STREAM_MORE while the match needs more input; otherwise returns
+** STREAM_FAIL or STREAM_DONE plus the match results.
+*/
+static int lp_streamfeed (lua_State *L) {
+  StreamState *st = (StreamState *)lua_touserdata(L, lua_upvalueindex(1));
+  int env = lua_upvalueindex(2);
+  size_t l;
+  const char *chunk = luaL_optlstring(L, 1, "", &l);
+  int eos = lua_toboolean(L, 2);
+  size_t start;
+  int ptop, i, n;
+  Stack *stack;
+  Capture *capture;
+  const char *r;
+  if (st->status != STREAM_MORE)
+    return luaL_error(L, "stream match already finished");
+  getmatchstate(L, env, &stack, &capture);
+  addinput(L, st, stack, capture, chunk, l);
+  if (st->ms.p == NULL && st->len < st->init && !eos) {
+    lua_pushinteger(L, STREAM_MORE);  /* not at the initial position yet */
+    return 1;
+  }
+  st->ms.more = !eos;
+  /* build the same stack layout as 'lp_match' */
+  lua_settop(L, 0);
+  lua_rawgeti(L, env, ENVPATT);
+  if (st->hasruntime)  /* match-time captures get the subject */
+    lua_pushlstring(L, st->buff, st->len);
+  else
+    lua_pushnil(L);
+  lua_pushnil(L);  /* no 'init' */
+  luaL_checkstack(L, st->nargs + 4, "too many arguments");
+  for (i = 0; i < st->nargs; i++)
+    lua_rawgeti(L, env, ENVARGS + i);
+  ptop = lua_gettop(L);
   lua_pushnil(L);  /* initialize subscache */
-  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_rawgeti(L, env, ENVCAPS);  /* initialize caplistidx */
   lua_getuservalue(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
+  lua_rawgeti(L, env, ENVPROF);  /* initialize profidx */
+  if (st->ms.p != NULL) {  /* resume: push stack and dynamic captures */
+    lua_rawgeti(L, env, ENVSTACK);
+    lua_pushnil(L);  /* memo table is not kept across chunks */
+    luaL_checkstack(L, st->ms.ndyncap, "too many captures");
+    if (st->ms.ndyncap > 0) {
+      lua_rawgeti(L, env, ENVDYN);
+      for (i = 1; i <= st->ms.ndyncap; i++)
+        lua_rawgeti(L, -i, i);
+      lua_remove(L, -(st->ms.ndyncap + 1));  /* remove table */
+    }
+  }
+  st->status = STREAM_FAIL;  /* in case of errors */
+  start = (st->len < st->init) ? st->len : st->init;  /* (if not resuming) */
+  r = match(L, st->buff, st->buff + start, st->buff + st->len, st->code,
+            (Capture *)lua_touserdata(L, caplistidx(ptop)), ptop, &st->ms);
+  if (st->ms.p != NULL) {  /* suspended? */
+    st->status = STREAM_MORE;
+    savematchstate(L, st, env, ptop);
+    shrinkinput(st, (Stack *)lua_touserdata(L, stackidx(ptop)),
+                    (Capture *)lua_touserdata(L, caplistidx(ptop)));
+    lua_pushinteger(L, STREAM_MORE);
+    return 1;
+  }
   if (r == NULL) {
-    lua_pushnil(L);
+    freeinput(L, st);
+    lua_pushinteger(L, STREAM_FAIL);
     return 1;
   }
-  return getcaptures(L, s, r, ptop);
+  st->status = STREAM_DONE;
+  n = getcaptures(L, st->buff, r, ptop, st->base);
+  freeinput(L, st);
+  lua_pushinteger(L, STREAM_DONE);
+  lua_insert(L, -(n + 1));
+  return n + 1;
+}
+
+
+static int lp_streamgc (lua_State *L) {
+  StreamState *st = (StreamState *)luaL_checkudata(L, 1, STREAM_T);
+  freeinput(L, st);
+  return 0;
+}
+
+
+/*
+** Create a function to match a pattern against input that arrives
+** in chunks: streammatch(pattern [, init, ...])
+*/
+static int lp_streammatch (lua_State *L) {
+  ProfCount *prof;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Instruction *code = getcode(L, p, 1, &prof);
+  int codesize = (prof != NULL) ? p->prof->codesize : p->codesize;
+  lua_Integer init = luaL_optinteger(L, 2, 1);
+  int nargs = (lua_gettop(L) > 2) ? lua_gettop(L) - 2 : 0;
+  StreamState *st;
+  int i;
+  luaL_argcheck(L, init > 0, 2, "initial position must be positive");
+  st = (StreamState *)lua_newuserdata(L, sizeof(StreamState));
+  memset(st, 0, sizeof(StreamState));
+  st->init = (size_t)(init - 1);
+  st->status = STREAM_MORE;
+  st->nargs = nargs;
+  st->code = code;
+  st->ms.prof = prof;
+  for (i = 0; i < codesize; i += sizei(&code[i]))
+    if (code[i].i.code == ICloseRunTime) st->hasruntime = 1;
+  luaL_getmetatable(L, STREAM_T);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, ENVARGS + nargs, 0);  /* environment */
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, ENVPATT);
+  lua_newuserdata(L, INITCAPSIZE * sizeof(Capture));
+  lua_rawseti(L, -2, ENVCAPS);
+  if (prof != NULL) {  /* keep the profiled code alive */
+    lua_getfield(L, LUA_REGISTRYINDEX, PROFILESIDX);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    lua_rawseti(L, -3, ENVPROF);
+    lua_pop(L, 1);
+  }
+  for (i = 0; i < nargs; i++) {
+    lua_pushvalue(L, 3 + i);
+    lua_rawseti(L, -2, ENVARGS + i);
+  }
+  lua_pushcclosure(L, lp_streamfeed, 2);
+  return 1;
+}
+
+
+
+/*
+** {======================================================
+** Pattern serialization
+**
+** A dump has a header (signature, format, and the sizes and byte
+** order of the machine), the sizes of the tree and of the code, both
+** arrays as they are in memory, and the 'ktable'. Strings, numbers,
+** and booleans in the 'ktable' are dumped by value; other values
+** (functions, tables) are dumped by the names given for them.
+** =======================================================
+*/
+
+#define DUMPSIGNATURE	"\033LPeg"
+/* must change whenever opcodes or tree tags change */
+#define DUMPFORMAT	4
+#define DUMPCHECKINT	0x12345678
+#define DUMPCHECKNUM	((lua_Number)370.5)
+
+/* tags for 'ktable' values */
+#define KNIL		0
+#define KBOOLEAN	1
+#define KNUMBER		2
+#define KSTRING		3
+#define KNAME		4
+
+
+typedef struct DumpHeader {
+  char signature[sizeof(DUMPSIGNATURE) - 1];
+  byte format;
+  byte sizes[4];  /* int, size_t, Instruction, TTree */
+  int checkint;
+  lua_Number checknum;
+} DumpHeader;
+
+
+static void makeheader (DumpHeader *h) {
+  memset(h, 0, sizeof(*h));  /* clear padding */
+  memcpy(h->signature, DUMPSIGNATURE, sizeof(h->signature));
+  h->format = DUMPFORMAT;
+  h->sizes[0] = sizeof(int);
+  h->sizes[1] = sizeof(size_t);
+  h->sizes[2] = sizeof(Instruction);
+  h->sizes[3] = sizeof(TTree);
+  h->checkint = DUMPCHECKINT;
+  h->checknum = DUMPCHECKNUM;
+}
+
+
+/*
+** Push element 'k' of the ktable at 'ktable' or, if 'names' is not 0,
+** its name in the table at 'names'. Return the length of the string.
+*/
+static size_t pushkstring (lua_State *L, int ktable, int names, int k) {
+  size_t len;
+  lua_rawgeti(L, ktable, k);
+  if (names != 0) {
+    lua_pushvalue(L, -1);
+    if (lua_isnil(L, names))
+      lua_pushnil(L);
+    else
+      lua_gettable(L, names);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "no name for %s in pattern", luaL_typename(L, -2));
+    lua_remove(L, -2);  /* remove value */
+  }
+  lua_tolstring(L, -1, &len);
+  return len;
+}
+
+
+/*
+** Add a string from the ktable (see 'pushkstring') and its length to
+** the buffer. (Values cannot stay in the stack across buffer
+** operations, so the string is pushed again for 'luaL_addvalue'.)
+*/
+static void dumpstring (lua_State *L, luaL_Buffer *b, int ktable,
+                        int names, int k) {
+  size_t len = pushkstring(L, ktable, names, k);
+  lua_pop(L, 1);
+  luaL_addlstring(b, (const char *)&len, sizeof(len));
+  pushkstring(L, ktable, names, k);
+  luaL_addvalue(b);
+}
+
+
+static void dumpktable (lua_State *L, luaL_Buffer *b, int ktable,
+                        int names) {
+  int n = lua_rawlen(L, ktable);
+  int k;
+  luaL_addlstring(b, (const char *)&n, sizeof(n));
+  for (k = 1; k <= n; k++) {
+    lua_Number num = 0;
+    int type, bvalue = 0;
+    lua_rawgeti(L, ktable, k);
+    type = lua_type(L, -1);
+    if (type == LUA_TBOOLEAN) bvalue = lua_toboolean(L, -1);
+    else if (type == LUA_TNUMBER) num = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    switch (type) {
+      case LUA_TNIL: luaL_addchar(b, KNIL); break;
+      case LUA_TBOOLEAN: {
+        luaL_addchar(b, KBOOLEAN);
+        luaL_addchar(b, bvalue);
+        break;
+      }
+      case LUA_TNUMBER: {
+        luaL_addchar(b, KNUMBER);
+        luaL_addlstring(b, (const char *)&num, sizeof(num));
+        break;
+      }
+      case LUA_TSTRING: {
+        luaL_addchar(b, KSTRING);
+        dumpstring(L, b, ktable, 0, k);
+        break;
+      }
+      default: {
+        luaL_addchar(b, KNAME);
+        dumpstring(L, b, ktable, names, k);
+        break;
+      }
+    }
+  }
+}
+
+
+/*
+** dump(pattern [, names]): serialize the compiled pattern. 'names'
+** maps the functions and tables used by the pattern to strings.
+*/
+static int lp_dump (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  int treesize = getsize(L, 1);
+  DumpHeader h;
+  luaL_Buffer b;
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (p->code == NULL)  /* not compiled yet? */
+    prepcompile(L, p, 1);
+  lua_getuservalue(L, 1);  /* ktable at index 3 */
+  makeheader(&h);
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, (const char *)&h, sizeof(h));
+  luaL_addlstring(&b, (const char *)&treesize, sizeof(treesize));
+  luaL_addlstring(&b, (const char *)&p->codesize, sizeof(p->codesize));
+  luaL_addlstring(&b, (const char *)p->tree, treesize * sizeof(TTree));
+  luaL_addlstring(&b, (const char *)p->code,
+                      p->codesize * sizeof(Instruction));
+  dumpktable(L, &b, 3, 2);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+typedef struct LoadState {
+  const char *s;
+  size_t left;
+} LoadState;
+
+
+static const char *loadbytes (lua_State *L, LoadState *ls, size_t n) {
+  const char *s = ls->s;
+  if (n > ls->left)
+    luaL_error(L, "truncated pattern dump");
+  ls->s += n;  ls->left -= n;
+  return s;
+}
+
+
+#define loadvar(L,ls,v)	memcpy(&(v), loadbytes(L, ls, sizeof(v)), sizeof(v))
+
+
+static int loadsize (lua_State *L, LoadState *ls, size_t elemsize) {
+  int n;
+  loadvar(L, ls, n);
+  if (n <= 0 || (size_t)n > ls->left / elemsize)
+    luaL_error(L, "malformed pattern dump");
+  return n;
+}
+
+
+/*
+** Fill the ktable at the top of the stack. Names are resolved in the
+** table at 'values'.
+*/
+static void loadktable (lua_State *L, LoadState *ls, int values) {
+  int n, k;
+  loadvar(L, ls, n);
+  if (n < 0 || n > USHRT_MAX)
+    luaL_error(L, "malformed pattern dump");
+  for (k = 1; k <= n; k++) {
+    int tag = *loadbytes(L, ls, 1);
+    switch (tag) {
+      case KNIL: continue;
+      case KBOOLEAN: lua_pushboolean(L, *loadbytes(L, ls, 1)); break;
+      case KNUMBER: {
+        lua_Number num;
+        loadvar(L, ls, num);
+        lua_pushnumber(L, num);
+        break;
+      }
+      case KSTRING: case KNAME: {
+        size_t len;
+        loadvar(L, ls, len);
+        lua_pushlstring(L, loadbytes(L, ls, len), len);
+        if (tag == KNAME) {
+          lua_pushvalue(L, -1);
+          if (lua_isnil(L, values))
+            lua_pushnil(L);
+          else
+            lua_gettable(L, values);
+          if (lua_isnil(L, -1))
+            luaL_error(L, "no value for name '%s'", lua_tostring(L, -2));
+          lua_remove(L, -2);  /* remove name */
+        }
+        break;
+      }
+      default: luaL_error(L, "malformed pattern dump");
+    }
+    lua_rawseti(L, -2, k);
+  }
+}
+
+
+/*
+** load(string [, values]): rebuild a pattern from a dump, binding
+** names to the elements of 'values'. As with Lua binary chunks, the
+** code itself is not checked, so dumps must come from trusted sources.
+*/
+static int lp_load (lua_State *L) {
+  LoadState ls;
+  DumpHeader h, mine;
+  int treesize, codesize;
+  Pattern *p;
+  ls.s = luaL_checklstring(L, 1, &ls.left);
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  makeheader(&mine);
+  loadvar(L, &ls, h);
+  if (memcmp(h.signature, DUMPSIGNATURE, sizeof(h.signature)) != 0)
+    luaL_error(L, "not a pattern dump");
+  if (memcmp(&h, &mine, sizeof(h)) != 0)
+    luaL_error(L, "pattern dump from an incompatible version or machine");
+  treesize = loadsize(L, &ls, sizeof(TTree));
+  codesize = loadsize(L, &ls, sizeof(Instruction));
+  newtree(L, treesize);
+  p = getpattern(L, -1);
+  memcpy(p->tree, loadbytes(L, &ls, treesize * sizeof(TTree)),
+                  treesize * sizeof(TTree));
+  realloccode(L, p, codesize);
+  memcpy(p->code, loadbytes(L, &ls, codesize * sizeof(Instruction)),
+                  codesize * sizeof(Instruction));
+  newktable(L, 0);
+  lua_getuservalue(L, -1);
+  loadktable(L, &ls, 2);
+  lua_pop(L, 1);  /* remove ktable */
+  if (ls.left != 0)
+    luaL_error(L, "malformed pattern dump");
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Profiling
+**
+** A pattern being profiled runs its own code, compiled without tail
+** calls, with a counter for each instruction. Its state is a userdata
+** kept in a table in the registry (with weak keys), indexed by the
+** pattern; stream matches also keep it while they run that code.
+** The VM only counts in builds with LPEG_PROFILE defined.
+** =======================================================
+*/
+
+#if defined(LPEG_PROFILE)
+
+static void startprofile (lua_State *L, Pattern *p) {
+  int size = getsize(L, 1);
+  Pattern *tmp;
+  Profile *prof;
+  if (p->code == NULL)
+    prepcompile(L, p, 1);  /* also fixes the tree */
+  newtree(L, size);
+  tmp = getpattern(L, -1);
+  memcpy(tmp->tree, p->tree, size * sizeof(TTree));
+  compile(L, tmp, 1);
+  prof = (Profile *)lua_newuserdata(L, sizeof(Profile) +
+                       tmp->codesize * (sizeof(ProfCount) + sizeof(Instruction)));
+  prof->count = (ProfCount *)(prof + 1);
+  prof->code = (Instruction *)(prof->count + tmp->codesize);
+  prof->codesize = tmp->codesize;
+  memcpy(prof->code, tmp->code, tmp->codesize * sizeof(Instruction));
+  realloccode(L, tmp, 0);  /* temporary code is not needed anymore */
+  lua_getfield(L, LUA_REGISTRYINDEX, PROFILESIDX);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);  /* profiles[pattern] = prof */
+  lua_pop(L, 3);
+  p->prof = prof;
+}
+
+
+static void stopprofile (lua_State *L, Pattern *p) {
+  lua_getfield(L, LUA_REGISTRYINDEX, PROFILESIDX);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  p->prof = NULL;
+}
+
+
+static void setcount (lua_State *L, const char *name, size_t n) {
+  lua_pushnumber(L, (lua_Number)n);
+  lua_setfield(L, -2, name);
+}
+
+
+/*
+** Push a table with the counters 'c' and append it to the list at
+** 'list', leaving it on the top of the stack
+*/
+static void pushcounters (lua_State *L, int list, ProfCount *c) {
+  lua_createtable(L, 0, 7);
+  setcount(L, "entries", c->entries);
+  setcount(L, "successes", c->successes);
+  setcount(L, "failures", c->failures);
+  setcount(L, "bytes", c->bytes);
+  setcount(L, "maxdepth", c->maxdepth);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, list, lua_rawlen(L, list) + 1);
+}
+
+
+/*
+** Push a table with the lists of rules and of choices (in code order)
+** and their counters. Rules are the targets of calls (whose key is the
+** rule name); each choice belongs to the last rule starting before it.
+*/
+static void pushprofile (lua_State *L, Profile *prof) {
+  Instruction *code = prof->code;
+  int *rule = (int *)lua_newuserdata(L, prof->codesize * sizeof(int));
+  int ktable = lua_gettop(L) + 1;
+  int rules = ktable + 1;
+  int choices = ktable + 2;
+  int i, current = 0;
+  memset(rule, 0, prof->codesize * sizeof(int));
+  for (i = 0; i < prof->codesize; i += sizei(&code[i]))
+    if (code[i].i.code == ICall)
+      rule[i + code[i + 1].offset] = code[i].i.key;
+  lua_getuservalue(L, 1);
+  lua_newtable(L);
+  lua_newtable(L);
+  for (i = 0; i < prof->codesize; i += sizei(&code[i])) {
+    if (rule[i] != 0) {
+      current = rule[i];
+      pushcounters(L, rules, &prof->count[i]);
+      lua_rawgeti(L, ktable, current);
+      lua_setfield(L, -2, "name");
+      lua_pop(L, 1);
+    }
+    if (code[i].i.code == IChoice) {
+      pushcounters(L, choices, &prof->count[i + code[i + 1].offset]);
+      setcount(L, "pc", i);
+      lua_rawgeti(L, ktable, current);
+      lua_setfield(L, -2, "rule");
+      lua_pop(L, 1);
+    }
+  }
+  lua_createtable(L, 0, 2);
+  lua_pushvalue(L, rules);
+  lua_setfield(L, -2, "rules");
+  lua_pushvalue(L, choices);
+  lua_setfield(L, -2, "choices");
+  lua_replace(L, ktable - 1);  /* result replaces 'rule' array */
+  lua_settop(L, ktable - 1);
 }
 
 
+/*
+** profile(pattern [, on]): with 'on' true, start profiling the pattern
+** (or reset its counters); with 'on' false, stop it. Return the
+** current counters (nil if the pattern is not being profiled).
+*/
+static int lp_profile (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  int on = lua_toboolean(L, 2);
+  lua_settop(L, 2);
+  if (on) {
+    if (p->prof == NULL)
+      startprofile(L, p);
+    memset(p->prof->count, 0, p->prof->codesize * sizeof(ProfCount));
+  }
+  if (p->prof == NULL)
+    lua_pushnil(L);
+  else
+    pushprofile(L, p->prof);
+  if (!on && !lua_isnil(L, 2))
+    stopprofile(L, p);
+  return 1;
+}
+
+#else
+
+static int lp_profile (lua_State *L) {
+  return luaL_error(L, "function only implemented in profiling builds");
+}
+
+#endif
+
+/* }====================================================== */
+
 
 /*
 ** {======================================================
@@ -1193,6 +2249,15 @@ static int lp_setmax (lua_State *L) {
 }
 
 
+static int lp_setmaxmemo (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= lim && lim <= MAXLIM, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, MAXMEMOIDX);
+  return 0;
+}
+
+
 static int lp_version (lua_State *L) {
   lua_pushstring(L, VERSION);
   return 1;
@@ -1251,8 +2316,14 @@ static int lp_locale (lua_State *L) {
 static struct luaL_Reg pattreg[] = {
   {"ptree", lp_printtree},
   {"pcode", lp_printcode},
-  {"match", lp_match},
+  {"streammatch", lp_streammatch},
+  {"dump", lp_dump},
+  {"load", lp_load},
+  {"profile", lp_profile},
+  {"code", lp_code},
   {"B", lp_behind},
+  {"M", lp_memo},
+  {"Mset", lp_mset},
   {"V", lp_V},
   {"C", lp_simplecapture},
   {"Cc", lp_constcapture},
@@ -1270,6 +2341,7 @@ static struct luaL_Reg pattreg[] = {
   {"locale", lp_locale},
   {"version", lp_version},
   {"setmaxstack", lp_setmax},
+  {"setmaxmemo", lp_setmaxmemo},
   {"type", lp_type},
   {NULL, NULL}
 };
@@ -1293,13 +2365,31 @@ int luaopen_lpeg (lua_State *L) {
   luaL_newmetatable(L, PATTERN_T);
   lua_pushnumber(L, MAXBACK);  /* initialize maximum backtracking */
   lua_setfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+  lua_pushinteger(L, MAXMEMO);  /* initialize maximum memo size */
+  lua_setfield(L, LUA_REGISTRYINDEX, MAXMEMOIDX);
+  lua_newtable(L);  /* profiles */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, PROFILESIDX);
   luaL_setfuncs(L, metareg, 0);
   
   /*luaL_newlib(L, pattreg);*/
   lua_newtable(L);
   luaL_setfuncs(L, pattreg, 0);
+  lua_newtable(L);  /* match context */
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, lp_match, 1);
+  lua_setfield(L, -3, "match");
+  lua_pushcclosure(L, lp_matchinto, 1);
+  lua_setfield(L, -2, "match_into");
   lua_pushvalue(L, -1);
   lua_setfield(L, -3, "__index");
+  luaL_newmetatable(L, STREAM_T);
+  lua_pushcfunction(L, lp_streamgc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
   return 1;
 }
 
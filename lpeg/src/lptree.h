@@ -33,8 +33,11 @@ typedef enum TTag {
   TCapture,  /* captures: 'cap' is kind of capture (enum 'CapKind');
                 ktable[key] is Lua value associated with capture;
                 'sib1' is capture body */
-  TRunTime  /* run-time capture: 'key' is Lua function;
+  TRunTime,  /* run-time capture: 'key' is Lua function;
                'sib1' is capture body */
+  TMemo,  /* 'sib1' with its results memoized */
+  TMset  /* search for a set of strings; the automaton is stored in the
+            next 'n' ints */
 } TTag;
 
 
@@ -55,6 +58,30 @@ typedef struct TTree {
 } TTree;
 
 
+/*
+** Aho-Corasick automaton of a TMset (also copied after its IMset
+** instruction), as an array 'a' of ints: a[0] is the number of states
+** (state 0 is the initial one) and a[1] the number of rows; then, for
+** each state, the index in the edges of its first edge (plus an extra
+** entry for the end), its failure state, the number of the longest
+** string that ends in it (0 if none), and its row (-1 if none); then
+** the edges of all states, each sorted by char and coded as
+** ((target << 8) | char); then the rows. The initial state and its
+** children have rows, with their transitions (failures included) for
+** each char, so most chars cost a single lookup.
+*/
+#define msetsize(ns,nr)	(2 + 5 * (ns) + (UCHAR_MAX + 1) * (nr))
+#define msetfirst(a)	((a) + 2)
+#define msetfail(a)	(msetfirst(a) + (a)[0] + 1)
+#define msetout(a)	(msetfail(a) + (a)[0])
+#define msetrow(a)	(msetout(a) + (a)[0])
+#define msetedges(a)	(msetrow(a) + (a)[0])
+#define msetrows(a)	(msetedges(a) + (a)[0] - 1)
+
+/* maximum number of states in an automaton (targets have 23 bits) */
+#define MAXMSETSTATES	((1 << 23) - 1)
+
+
 /*
 ** A complete pattern has its tree plus, if already compiled,
 ** its corresponding code
@@ -62,6 +89,7 @@ typedef struct TTree {
 typedef struct Pattern {
   union Instruction *code;
   int codesize;
+  struct Profile *prof;  /* profiling state (NULL if not profiling) */
   TTree tree[1];
 } Pattern;
 
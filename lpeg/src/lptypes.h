@@ -23,7 +23,10 @@
 
 
 #define PATTERN_T	"lpeg-pattern"
+#define STREAM_T	"lpeg-stream"
 #define MAXSTACKIDX	"lpeg-maxstack"
+#define PROFILESIDX	"lpeg-profiles"
+#define MAXMEMOIDX	"lpeg-maxmemo"
 
 
 /*
@@ -55,6 +58,12 @@
 #endif
 
 
+/* default maximum number of entries in the memo table of a match */
+#if !defined(MAXMEMO)
+#define MAXMEMO         (1 << 16)
+#endif
+
+
 /* maximum number of rules in a grammar (limited by 'unsigned char') */
 #if !defined(MAXRULES)
 #define MAXRULES        250
@@ -66,6 +75,12 @@
 #define INITCAPSIZE	32
 
 
+/* maximum size (in bytes) of a stack or capture list kept for reuse */
+#if !defined(MAXCONTEXT)
+#define MAXCONTEXT	(1 << 20)
+#endif
+
+
 /* index, on Lua stack, for subject */
 #define SUBJIDX		2
 
@@ -78,8 +93,14 @@
 /* index, on Lua stack, for pattern's ktable */
 #define ktableidx(ptop)		((ptop) + 3)
 
+/* index, on Lua stack, for profiling state being run (or nil) */
+#define profidx(ptop)	((ptop) + 4)
+
 /* index, on Lua stack, for backtracking stack */
-#define stackidx(ptop)	((ptop) + 4)
+#define stackidx(ptop)	((ptop) + 5)
+
+/* index, on Lua stack, for memo table (dynamic captures come after it) */
+#define memoidx(ptop)	((ptop) + 6)
 
 
 
@@ -137,6 +158,15 @@ typedef struct Charset {
 /* size (in elements) for a ISet instruction */
 #define CHARSETINSTSIZE		instsize(CHARSETSIZE)
 
+/* size (in elements) for a IString instruction */
+#define strinstsize(p)		instsize((p)->i.aux)
+
+/* maximum length of a literal in a IString instruction */
+#define MAXSTRLEN	MAXAUX
+
+/* size (in elements) for a IDispatch instruction without its targets */
+#define DISPATCHINSTSIZE	instsize(UCHAR_MAX + 1)
+
 /* size (in elements) for a IFunc instruction */
 #define funcinstsize(p)		((p)->i.aux + 2)
 
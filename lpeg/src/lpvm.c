@@ -4,6 +4,7 @@
 */
 
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -22,6 +23,12 @@
 #endif
 
 
+/* minimum number of entries in a memo table */
+#if !defined(MINMEMO)
+#define MINMEMO		64
+#endif
+
+
 #define getoffset(p)	(((p) + 1)->offset)
 
 static const Instruction giveup = {{IGiveup, 0, 0}};
@@ -34,25 +41,35 @@ static const Instruction giveup = {{IGiveup, 0, 0}};
 */
 
 
-typedef struct Stack {
-  const char *s;  /* saved position (or NULL for calls) */
-  const Instruction *p;  /* next instruction */
-  int caplevel;
-} Stack;
-
-
-#define getstackbase(L, ptop)	((Stack *)lua_touserdata(L, stackidx(ptop)))
+/*
+** Base of the backtrack stack: in its Lua slot or, for a match without
+** a Lua state, in 'ms'
+*/
+#define getstackbase(L, ptop)  \
+	((L) != NULL ? (Stack *)lua_touserdata(L, stackidx(ptop)) : ms->cstack)
 
 
 /*
 ** Make the size of the array of captures 'cap' twice as large as needed
-** (which is 'captop'). ('n' is the number of new elements.)
+** (which is 'captop'). ('n' is the number of new elements.) Without a
+** Lua state, the new array goes to the C heap and errors return NULL.
 */
-static Capture *doublecap (lua_State *L, Capture *cap, int captop,
-                                         int n, int ptop) {
+static Capture *doublecap (lua_State *L, MatchState *ms, Capture *cap,
+                           int captop, int n, int ptop) {
   Capture *newc;
-  if (captop >= INT_MAX/((int)sizeof(Capture) * 2))
+  if (captop >= INT_MAX/((int)sizeof(Capture) * 2)) {
+    if (L == NULL) return NULL;
     luaL_error(L, "too many captures");
+  }
+  if (L == NULL) {
+    newc = (Capture *)malloc(captop * 2 * sizeof(Capture));
+    if (newc == NULL) return NULL;
+    memcpy(newc, cap, (captop - n) * sizeof(Capture));
+    if (ms->capheap) free(cap);
+    ms->ccapture = newc;
+    ms->capheap = 1;
+    return newc;
+  }
   newc = (Capture *)lua_newuserdata(L, captop * 2 * sizeof(Capture));
   memcpy(newc, cap, (captop - n) * sizeof(Capture));
   lua_replace(L, caplistidx(ptop));
@@ -61,20 +78,38 @@ static Capture *doublecap (lua_State *L, Capture *cap, int captop,
 
 
 /*
-** Double the size of the stack
+** Double the size of the stack. Without a Lua state, the limit is the
+** default one, the new stack goes to the C heap and errors return NULL.
 */
-static Stack *doublestack (lua_State *L, Stack **stacklimit, int ptop) {
+static Stack *doublestack (lua_State *L, MatchState *ms, Stack **stacklimit,
+                           int ptop) {
   Stack *stack = getstackbase(L, ptop);
   Stack *newstack;
   int n = *stacklimit - stack;  /* current stack size */
   int max, newn;
-  lua_getfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
-  max = lua_tointeger(L, -1);  /* maximum allowed size */
-  lua_pop(L, 1);
-  if (n >= max)  /* already at maximum size? */
+  if (L == NULL)
+    max = MAXBACK;
+  else {
+    lua_getfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+    max = lua_tointeger(L, -1);  /* maximum allowed size */
+    lua_pop(L, 1);
+  }
+  if (n >= max) {  /* already at maximum size? */
+    if (L == NULL) return NULL;
     luaL_error(L, "backtrack stack overflow (current limit is %d)", max);
+  }
   newn = 2 * n;  /* new size */
   if (newn > max) newn = max;
+  if (L == NULL) {
+    newstack = (Stack *)malloc(newn * sizeof(Stack));
+    if (newstack == NULL) return NULL;
+    memcpy(newstack, stack, n * sizeof(Stack));
+    if (ms->stackheap) free(stack);
+    ms->cstack = newstack;
+    ms->stackheap = 1;
+    *stacklimit = newstack + newn;
+    return newstack + n;
+  }
   newstack = (Stack *)lua_newuserdata(L, newn * sizeof(Stack));
   memcpy(newstack, stack, n * sizeof(Stack));
   lua_replace(L, stackidx(ptop));
@@ -144,19 +179,271 @@ static int removedyncap (lua_State *L, Capture *capture,
 
 
 /*
-** Opcode interpreter
+** In stream mode, a match that needs input beyond 'e' must suspend
+** instead of failing (or taking the branch for an absent char)
+*/
+#define moreinput(ms)	((ms) != NULL && (ms)->more)
+
+
+/*
+** Save the stack of a suspended match in 'ms'. A stack still in the
+** C stack is moved into a Lua userdata (in its Lua slot).
+*/
+static void savestack (lua_State *L, MatchState *ms, Stack *stackbase,
+                       Stack *stack, Stack *stacklimit, int ptop) {
+  Stack *base = getstackbase(L, ptop);
+  ms->nstack = stack - base;
+  ms->stacksize = stacklimit - base;
+  if (base == stackbase) {  /* stack is in the C stack? */
+    Stack *newstack = (Stack *)lua_newuserdata(L, ms->nstack * sizeof(Stack));
+    memcpy(newstack, base, ms->nstack * sizeof(Stack));
+    lua_replace(L, stackidx(ptop));
+    ms->stacksize = ms->nstack;
+  }
+}
+
+
+/*
+** {======================================================
+** Memo tables
+** =======================================================
+*/
+
+/*
+** A memo table caches the results of memoized patterns ('lpeg.M')
+** during a match. It is direct mapped, indexed by subject position and
+** pattern key; a newer result replaces whatever is in its entry.
+** Successes keep a copy of their captures in 'caps'; when that array
+** is full, the whole table is flushed.
+*/
+typedef struct MemoEntry {
+  const char *s;  /* position where the pattern ran (NULL if empty) */
+  const char *e;  /* end of its match (NULL if it failed) */
+  int key;  /* which memoized pattern */
+  int cap;  /* index of its first capture in 'caps' */
+  int ncap;  /* number of captures */
+} MemoEntry;
+
+
+typedef struct Memo {
+  int size;  /* number of entries (a power of 2; 0 if disabled) */
+  int capsize;  /* size of 'caps' */
+  int ncap;  /* number of captures in use in 'caps' */
+  MemoEntry *entry;
+  Capture *caps;
+} Memo;
+
+
+#define memoentry(m,pos,key)  \
+	((m)->entry + (((unsigned)(pos) + (unsigned)(key) * 0x9E3779B1u) & \
+	               (unsigned)((m)->size - 1)))
+
+
+/*
+** Create the memo table of a match (in its Lua slot), with about one
+** entry per subject byte, within the limits
+*/
+static Memo *newmemo (lua_State *L, const char *o, const char *e,
+                      int ptop) {
+  Memo *memo;
+  int max, size = MINMEMO;
+  lua_getfield(L, LUA_REGISTRYINDEX, MAXMEMOIDX);
+  max = lua_tointeger(L, -1);  /* maximum allowed size */
+  lua_pop(L, 1);
+  while (size < e - o && size < max) size *= 2;
+  while (size > max) size /= 2;  /* keep it a power of 2 (or 0) */
+  memo = (Memo *)lua_newuserdata(L, sizeof(Memo) +
+                   size * (sizeof(MemoEntry) + 2 * sizeof(Capture)));
+  memo->size = size;
+  memo->capsize = 2 * size;
+  memo->ncap = 0;
+  memo->entry = (MemoEntry *)(memo + 1);
+  memo->caps = (Capture *)(memo->entry + size);
+  memset(memo->entry, 0, size * sizeof(MemoEntry));
+  lua_replace(L, memoidx(ptop));
+  return memo;
+}
+
+
+/* memo table of matches without a Lua state (memoization disabled) */
+static Memo nomemo = {0, 0, 0, NULL, NULL};
+
+
+/*
+** Save the result of pattern 'key' at 's': its end 'e' (NULL for a
+** failure) and its 'n' captures 'cap'. Captures with values in the Lua
+** stack (from match-time captures) cannot be replayed, so results with
+** them are not saved.
+*/
+static void memosave (Memo *memo, const char *o, const char *s, int key,
+                      const char *e, const Capture *cap, int n) {
+  MemoEntry *m;
+  int i;
+  if (memo->size == 0 || n > memo->capsize / 4)
+    return;
+  for (i = 0; i < n; i++) {
+    if (cap[i].kind == Cruntime)
+      return;
+  }
+  if (memo->ncap + n > memo->capsize) {  /* no space for captures? */
+    memset(memo->entry, 0, memo->size * sizeof(MemoEntry));  /* flush */
+    memo->ncap = 0;
+  }
+  m = memoentry(memo, s - o, key);
+  m->s = s; m->e = e; m->key = key;
+  m->cap = memo->ncap; m->ncap = n;
+  if (n > 0) {
+    memcpy(memo->caps + memo->ncap, cap, n * sizeof(Capture));
+    memo->ncap += n;
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Multiple-string search
+** =======================================================
+*/
+
+/*
+** Next state of automaton 'a' from state 'st' with char 'c' (following
+** failure links while 'st' has no edge for 'c')
+*/
+int msetnext (const int *a, int st, int c) {
+  const int *first = msetfirst(a);
+  const int *row = msetrow(a);
+  const int *edges = msetedges(a);
+  for (;;) {
+    int lo = first[st], hi = first[st + 1];
+    if (row[st] >= 0)  /* state has all its transitions? */
+      return msetrows(a)[row[st] * (UCHAR_MAX + 1) + c];
+    while (lo < hi) {  /* binary search for 'c' */
+      int m = (lo + hi) / 2;
+      int ec = edges[m] & 0xFF;
+      if (ec == c) return edges[m] >> 8;
+      else if (ec < c) lo = m + 1;
+      else hi = m;
+    }
+    st = msetfail(a)[st];
+  }
+}
+
+
+/*
+** Search [s, e) for the first end of a string recognized by automaton
+** 'a'; return that end and the number of the longest string that ends
+** there (in '*n'), or NULL if there is none. In the initial state,
+** chars that start no string are skipped in a tight loop.
+*/
+static const char *msetfind (const int *a, const char *s, const char *e,
+                             int *n) {
+  const int *root = msetrows(a);  /* row of the initial state */
+  const int *out = msetout(a);
+  int st = 0;
+  while (s < e) {
+    if (st == 0) {
+      while (root[(byte)*s] == 0)
+        if (++s == e) return NULL;
+      st = root[(byte)*s++];
+    }
+    else
+      st = msetnext(a, st, (byte)*s++);
+    if (out[st] != 0) {
+      *n = out[st];
+      return s;
+    }
+  }
+  return NULL;
+}
+
+/* }====================================================== */
+
+
+/* profiling hooks are compiled only in profiling builds */
+#if defined(LPEG_PROFILE)
+#define profiling(ms)	((ms) != NULL && (ms)->prof != NULL)
+#else
+#define profiling(ms)	0
+#endif
+
+
+/*
+** Profiling: the counter of instruction 'q', and the rule called by
+** the call entry 'f' in the stack (its return address follows the
+** ICall instruction)
+*/
+#define profcount(q)	(prof + ((q) - op))
+#define calledrule(f)	((f)->p - 2 + getoffset((f)->p - 2))
+
+
+static void profenter (ProfCount *c, int depth) {
+  c->entries++;
+  if (depth > c->maxdepth) c->maxdepth = depth;
+}
+
+
+/*
+** Count a failure at 's': the calls it unwinds fail, and the choice
+** where it stops (if any) gets the bytes it gives back
+*/
+static void proffail (ProfCount *prof, const Instruction *op,
+                      const Stack *stack, const char *s) {
+  do {
+    stack--;
+    if (stack->s == NULL)
+      profcount(calledrule(stack))->failures++;
+  } while (stack->s == NULL);
+  if (stack->p != &giveup) {
+    ProfCount *c = profcount(stack->p);
+    c->failures++;
+    if (s > stack->s) c->bytes += s - stack->s;
+  }
+}
+
+
+/*
+** Opcode interpreter. 'ms' can be NULL (all defaults); when it has a
+** suspended match, the caller has pushed that match's stack and
+** dynamic captures, and 'capture' is its capture list.
+** 'L' can be NULL for a match without a Lua state (see 'MatchState');
+** then the pattern cannot have match-time captures.
 */
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop) {
+                   const Instruction *op, Capture *capture, int ptop,
+                   MatchState *ms) {
   Stack stackbase[INITBACK];
   Stack *stacklimit = stackbase + INITBACK;
   Stack *stack = stackbase;  /* point to first empty slot in stack */
   int capsize = INITCAPSIZE;
   int captop = 0;  /* point to first empty slot in captures */
   int ndyncap = 0;  /* number of dynamic captures (in Lua stack) */
+  Memo *memo = NULL;  /* memo table (created by the first 'memo') */
   const Instruction *p = op;  /* current instruction */
-  stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
-  lua_pushlightuserdata(L, stackbase);
+  if (ms != NULL && ms->p != NULL) {  /* resume a suspended match? */
+    Stack *base = getstackbase(L, ptop);
+    stack = base + ms->nstack;
+    stacklimit = base + ms->stacksize;
+    capsize = ms->capsize; captop = ms->captop; ndyncap = ms->ndyncap;
+    p = ms->p; s = ms->s;
+    ms->p = NULL;
+  }
+  else {
+    if (ms != NULL && ms->stacksize > 0) {  /* caller pushed a stack? */
+      stack = getstackbase(L, ptop);
+      stacklimit = stack + ms->stacksize;
+    }
+    else if (L != NULL)
+      lua_pushlightuserdata(L, stackbase);
+    else
+      ms->cstack = stackbase;
+    if (L != NULL)
+      lua_pushnil(L);  /* no memo table yet */
+    if (ms != NULL && ms->capsize > 0)
+      capsize = ms->capsize;
+    stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
+  }
   for (;;) {
 #if defined(DEBUG)
       printf("-------------------------------------\n");
@@ -165,7 +452,8 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
              s, (int)(stack - getstackbase(L, ptop)), ndyncap, captop);
       printinst(op, p);
 #endif
-    assert(stackidx(ptop) + ndyncap == lua_gettop(L) && ndyncap <= captop);
+    assert((L == NULL || memoidx(ptop) + ndyncap == lua_gettop(L)) &&
+           ndyncap <= captop);
     switch ((Opcode)p->i.code) {
       case IEnd: {
         assert(stack == getstackbase(L, ptop) + 1);
@@ -180,75 +468,128 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       case IRet: {
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s == NULL);
         p = (--stack)->p;
+        if (profiling(ms)) {
+          ProfCount *prof = ms->prof;
+          ProfCount *c = profcount(calledrule(stack));
+          c->successes++;
+          c->bytes += (s - o) - stack->caplevel;
+        }
         continue;
       }
       case IAny: {
         if (s < e) { p++; s++; }
+        else if (moreinput(ms)) goto suspend;
         else goto fail;
         continue;
       }
       case ITestAny: {
         if (s < e) p += 2;
+        else if (moreinput(ms)) goto suspend;
         else p += getoffset(p);
         continue;
       }
       case IChar: {
-        if ((byte)*s == p->i.aux && s < e) { p++; s++; }
+        if (s < e && (byte)*s == p->i.aux) { p++; s++; }
+        else if (s >= e && moreinput(ms)) goto suspend;
         else goto fail;
         continue;
       }
       case ITestChar: {
-        if ((byte)*s == p->i.aux && s < e) p += 2;
+        if (s < e && (byte)*s == p->i.aux) p += 2;
+        else if (s >= e && moreinput(ms)) goto suspend;
         else p += getoffset(p);
         continue;
       }
       case ISet: {
-        int c = (byte)*s;
-        if (testchar((p+1)->buff, c) && s < e)
+        if (s < e && testchar((p+1)->buff, (byte)*s))
           { p += CHARSETINSTSIZE; s++; }
+        else if (s >= e && moreinput(ms)) goto suspend;
         else goto fail;
         continue;
       }
       case ITestSet: {
-        int c = (byte)*s;
-        if (testchar((p + 2)->buff, c) && s < e)
+        if (s < e && testchar((p + 2)->buff, (byte)*s))
           p += 1 + CHARSETINSTSIZE;
+        else if (s >= e && moreinput(ms)) goto suspend;
         else p += getoffset(p);
         continue;
       }
+      case IDispatch: {
+        int k = (s < e) ? (p+1)->buff[(byte)*s] : 0;
+        if (s >= e && moreinput(ms)) goto suspend;
+        if (k == 0) goto fail;
+        p += (p + DISPATCHINSTSIZE + k - 1)->offset;
+        continue;
+      }
       case IBehind: {
         int n = p->i.aux;
         if (n > s - o) goto fail;
         s -= n; p++;
         continue;
       }
+      case IString: {
+        int n = p->i.aux;
+        if (e - s >= n && memcmp(s, (p+1)->buff, n) == 0)
+          { p += strinstsize(p); s += n; }
+        else if (e - s < n && moreinput(ms) &&
+                 memcmp(s, (p+1)->buff, e - s) == 0)
+          goto suspend;  /* what is available matches; wait for more */
+        else goto fail;
+        continue;
+      }
       case ISpan: {
+        const byte *cs = (p+1)->buff;
+        /* test four chars per bound check */
+        while (e - s >= 4 && testchar(cs, (byte)s[0]) &&
+               testchar(cs, (byte)s[1]) && testchar(cs, (byte)s[2]) &&
+               testchar(cs, (byte)s[3]))
+          s += 4;
         for (; s < e; s++) {
           int c = (byte)*s;
-          if (!testchar((p+1)->buff, c)) break;
+          if (!testchar(cs, c)) break;
         }
+        if (s == e && moreinput(ms)) goto suspend;  /* span may go on */
         p += CHARSETINSTSIZE;
         continue;
       }
+      case IScan: {
+        const char *f = (const char *)memchr(s, p->i.aux, e - s);
+        s = (f != NULL) ? f : e;
+        if (f == NULL && moreinput(ms)) goto suspend;
+        p++;
+        continue;
+      }
       case IJmp: {
         p += getoffset(p);
         continue;
       }
       case IChoice: {
-        if (stack == stacklimit)
-          stack = doublestack(L, &stacklimit, ptop);
+        if (stack == stacklimit &&
+            (stack = doublestack(L, ms, &stacklimit, ptop)) == NULL)
+          goto nomem;
         stack->p = p + getoffset(p);
         stack->s = s;
         stack->caplevel = captop;
+        if (profiling(ms)) {
+          ProfCount *prof = ms->prof;
+          profenter(profcount(stack->p), stack - getstackbase(L, ptop));
+        }
         stack++;
         p += 2;
         continue;
       }
       case ICall: {
-        if (stack == stacklimit)
-          stack = doublestack(L, &stacklimit, ptop);
+        if (stack == stacklimit &&
+            (stack = doublestack(L, ms, &stacklimit, ptop)) == NULL)
+          goto nomem;
         stack->s = NULL;
         stack->p = p + 2;  /* save return address */
+        if (profiling(ms)) {
+          ProfCount *prof = ms->prof;
+          profenter(profcount(p + getoffset(p)),
+                    stack - getstackbase(L, ptop));
+          stack->caplevel = s - o;
+        }
         stack++;
         p += getoffset(p);
         continue;
@@ -256,6 +597,10 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       case ICommit: {
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
         stack--;
+        if (profiling(ms)) {
+          ProfCount *prof = ms->prof;
+          profcount(stack->p)->successes++;
+        }
         p += getoffset(p);
         continue;
       }
@@ -263,6 +608,10 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
         (stack - 1)->s = s;
         (stack - 1)->caplevel = captop;
+        if (profiling(ms)) {
+          ProfCount *prof = ms->prof;
+          profcount((stack - 1)->p)->successes++;
+        }
         p += getoffset(p);
         continue;
       }
@@ -270,15 +619,90 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
         s = (--stack)->s;
         captop = stack->caplevel;
+        if (profiling(ms)) {
+          ProfCount *prof = ms->prof;
+          profcount(stack->p)->successes++;
+        }
+        p += getoffset(p);
+        continue;
+      }
+      case IMset: {
+        int n;
+        const char *r = msetfind((const int *)(p + 2), s, e, &n);
+        if (r == NULL) {
+          if (moreinput(ms)) goto suspend;
+          goto fail;
+        }
+        capture[captop].kind = Cmset;  /* capture number of string found */
+        capture[captop].idx = n;
+        capture[captop].siz = 1;
+        capture[captop].s = r;
+        if (++captop >= capsize) {
+          capture = doublecap(L, ms, capture, captop, 0, ptop);
+          if (capture == NULL) goto nomem;
+          capsize = 2 * captop;
+        }
+        s = r;
+        p += getoffset(p);
+        continue;
+      }
+      case IMemo: {
+        MemoEntry *m;
+        if (memo == NULL)
+          memo = (L != NULL) ? newmemo(L, o, e, ptop) : &nomemo;
+        if (memo->size > 0 &&
+            (m = memoentry(memo, s - o, p->i.key))->s == s &&
+            m->key == p->i.key) {  /* result already known? */
+          if (m->e == NULL)
+            goto fail;
+          if (m->ncap > 0) {  /* replay its captures */
+            if ((captop += m->ncap) >= capsize) {
+              capture = doublecap(L, ms, capture, captop, m->ncap, ptop);
+              if (capture == NULL) goto nomem;
+              capsize = 2 * captop;
+            }
+            memcpy(capture + captop - m->ncap, memo->caps + m->cap,
+                   m->ncap * sizeof(Capture));
+          }
+          s = m->e;
+          p += getoffset(p) + 1;  /* skip pattern and its 'memo_fail' */
+          continue;
+        }
+        if (stack == stacklimit &&
+            (stack = doublestack(L, ms, &stacklimit, ptop)) == NULL)
+          goto nomem;
+        stack->p = p + getoffset(p);  /* 'memo_fail' */
+        stack->s = s;
+        stack->caplevel = captop;
+        stack++;
+        p += 2;
+        continue;
+      }
+      case IMemoEnd: {
+        assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
+        stack--;
+        if (memo != NULL)
+          memosave(memo, o, stack->s, p->i.key, s,
+                   capture + stack->caplevel, captop - stack->caplevel);
         p += getoffset(p);
         continue;
       }
+      case IMemoFail: {
+        if (memo != NULL)
+          memosave(memo, o, s, p->i.key, NULL, NULL, 0);
+        goto fail;
+      }
       case IFailTwice:
         assert(stack > getstackbase(L, ptop));
         stack--;
+        if (profiling(ms)) {
+          ProfCount *prof = ms->prof;
+          profcount(stack->p)->successes++;
+        }
         /* go through */
       case IFail:
       fail: { /* pattern failed: try to backtrack */
+        if (profiling(ms)) proffail(ms->prof, op, stack, s);
         do {  /* remove pending calls */
           assert(stack > getstackbase(L, ptop));
           s = (--stack)->s;
@@ -295,8 +719,13 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       case ICloseRunTime: {
         CapState cs;
         int rem, res, n;
-        int fr = lua_gettop(L) + 1;  /* stack index of first result */
-        cs.s = o; cs.L = L; cs.ocap = capture; cs.ptop = ptop;
+        int fr;
+        if (L == NULL) {  /* no Lua to call? */
+          ms->err = LPEG_ENOLUA;
+          return NULL;
+        }
+        fr = lua_gettop(L) + 1;  /* stack index of first result */
+        cs.s = o; cs.base = 0; cs.L = L; cs.ocap = capture; cs.ptop = ptop;
         n = runtimecap(&cs, capture + captop, s, &rem);  /* call function */
         captop -= n;  /* remove nested captures */
         ndyncap -= rem;  /* update number of dynamic captures */
@@ -311,7 +740,8 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
           if (fr + n >= SHRT_MAX)
             luaL_error(L, "too many results in match-time capture");
           if ((captop += n + 2) >= capsize) {
-            capture = doublecap(L, capture, captop, n + 2, ptop);
+            capture = doublecap(L, ms, capture, captop, n + 2, ptop);
+            if (capture == NULL) goto nomem;
             capsize = 2 * captop;
           }
           /* add new captures to 'capture' list */
@@ -348,12 +778,23 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         capture[captop].idx = p->i.key;
         capture[captop].kind = getkind(p);
         if (++captop >= capsize) {
-          capture = doublecap(L, capture, captop, 0, ptop);
+          capture = doublecap(L, ms, capture, captop, 0, ptop);
+          if (capture == NULL) goto nomem;
           capsize = 2 * captop;
         }
         p++;
         continue;
       }
+      nomem: {  /* no Lua state: stack or capture list cannot grow */
+        ms->err = LPEG_ENOMEM;
+        return NULL;
+      }
+      suspend: {  /* stream mode: wait for more input */
+        savestack(L, ms, stackbase, stack, stacklimit, ptop);
+        ms->p = p; ms->s = s;
+        ms->captop = captop; ms->capsize = capsize; ms->ndyncap = ndyncap;
+        return NULL;
+      }
       default: assert(0); return NULL;
     }
   }
@@ -13,10 +13,13 @@ typedef enum Opcode {
   IAny, /* if no char, fail */
   IChar,  /* if char != aux, fail */
   ISet,  /* if char not in buff, fail */
+  IString,  /* if next 'aux' chars != buff, fail */
   ITestAny,  /* in no char, jump to 'offset' */
   ITestChar,  /* if char != aux, jump to 'offset' */
   ITestSet,  /* if char not in buff, jump to 'offset' */
   ISpan,  /* read a span of chars in buff */
+  IScan,  /* skip chars up to the next 'aux' (or to the end) */
+  IDispatch,  /* jump to target of char in map (fail if none) */
   IBehind,  /* walk back 'aux' characters (fail if not possible) */
   IRet,  /* return from a rule */
   IEnd,  /* end of pattern */
@@ -30,6 +33,10 @@ typedef enum Opcode {
   IFailTwice,  /* pop one choice and then fail */
   IFail,  /* go back to saved state on choice and jump to saved offset */
   IGiveup,  /* internal use */
+  IMemo,  /* replay memoized result 'key' or stack a memo entry */
+  IMemoEnd,  /* pop memo entry, save its success, and jump to 'offset' */
+  IMemoFail,  /* save failure of memo 'key' and fail */
+  IMset,  /* search for strings with automaton in next instructions */
   IFullCapture,  /* complete capture of last 'off' chars */
   IOpenCapture,  /* start a capture */
   ICloseCapture,
@@ -49,9 +56,72 @@ typedef union Instruction {
 } Instruction;
 
 
+typedef struct Stack {
+  const char *s;  /* saved position (or NULL for calls) */
+  const Instruction *p;  /* next instruction */
+  int caplevel;  /* (entry position of calls, when profiling) */
+} Stack;
+
+
+/*
+** Profiling counters, kept for the first instruction of each rule and
+** for the alternative of each choice
+*/
+typedef struct ProfCount {
+  size_t entries;  /* rule calls; choices pushed */
+  size_t successes;  /* rule returns; choices committed */
+  size_t failures;  /* rule failures; backtracks to the choice */
+  size_t bytes;  /* matched by the rule; given back by backtracking */
+  int maxdepth;  /* largest backtrack stack depth at entry */
+} ProfCount;
+
+
+/*
+** State of a pattern being profiled: its code, compiled without tail
+** calls (so that every rule returns through its own call), and the
+** counters for that code
+*/
+typedef struct Profile {
+  ProfCount *count;  /* one for each instruction */
+  Instruction *code;
+  int codesize;
+} Profile;
+
+
+/*
+** State of a match in stream mode: when it needs input beyond the
+** end of the subject, 'match' suspends and saves its state here (the
+** backtrack stack and the capture list stay in their Lua slots);
+** a later call with more input resumes it.
+** For a new match, a non-zero 'stacksize' means that the caller has
+** pushed a stack to be used, and a non-zero 'capsize' gives the size
+** of the capture list (instead of the defaults).
+** A match without a Lua state keeps its stack and capture list here
+** (growing them in the C heap) and reports errors in 'err'.
+*/
+typedef struct MatchState {
+  int more;  /* true if more input can follow the end of the subject */
+  const Instruction *p;  /* instruction to resume (NULL if not suspended) */
+  const char *s;  /* position to resume */
+  int nstack;  /* number of entries in the backtrack stack */
+  int stacksize;  /* size of the backtrack stack */
+  int captop;  /* number of entries in the capture list */
+  int capsize;  /* size of the capture list */
+  int ndyncap;  /* number of dynamic captures (in Lua stack) */
+  ProfCount *prof;  /* profiling counters (NULL if not profiling) */
+  Stack *cstack;  /* (no Lua state) backtrack stack */
+  Capture *ccapture;  /* (no Lua state) capture list */
+  int stackheap;  /* true if 'cstack' is in the C heap */
+  int capheap;  /* true if 'ccapture' is in the C heap */
+  int err;  /* (no Lua state) error code, or 0 */
+} MatchState;
+
+
 void printpatt (Instruction *p, int n);
+int msetnext (const int *a, int st, int c);
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop);
+                   const Instruction *op, Capture *capture, int ptop,
+                   MatchState *ms);
 
 
 #endif
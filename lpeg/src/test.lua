@@ -1161,6 +1161,426 @@ t = {p:match('abacc')}
 checkeq(t, {'a', 'aa', 20, 'a', 'aaa', 'aaa'})
 
 
+-- literal strings, spans, and scans
+do
+  local s = string.rep("x", 600)
+  assert(m.match(s, s) == 601)
+  assert(not m.match(s, s:sub(2) .. "y"))
+  assert(not m.match(s, s:sub(2)))
+  assert(m.match(m.P(s:sub(1, 255)) * "x", s) == 257)
+  assert(m.match(m.P"HTTP/1.1" * " 200", "HTTP/1.1 200") == 13)
+  assert(not m.match(m.P"HTTP/1.1" * " 200", "HTTP/1.0 200"))
+  assert(not m.match("HTTP/1.1", "HTTP/1."))
+  assert(m.match(m.C("abc") * m.C("de"), "abcdef") == "abc")
+  assert(m.match(m.P"abc" + "abd" + "ab", "abd") == 4)
+  assert(m.match(m.P"abc" + "abd" + "ab", "abe") == 3)
+  assert(m.match("\0\1\0", "\0\1\0") == 4)
+  assert(not m.match("\0\1\0", "\0\1\1"))
+
+  local sp = m.S"ab"^0
+  assert(m.match(sp, "abbaabbaab") == 11)
+  assert(m.match(sp, "abbaabbaabc") == 11)
+  assert(m.match(sp, "abbaac") == 6)
+  assert(m.match(sp, "") == 1)
+
+  local sc = (1 - m.P"\n")^0
+  assert(m.match(sc, "abc\ndef") == 4)
+  assert(m.match(sc, "abcdef") == 7)
+  assert(m.match(sc, "\n") == 1)
+  assert(m.match(sc * "\n" * m.C(sc), "abc\ndef") == "def")
+
+  local line = (1 - m.P"\r\n")^0 * m.Cp() * "\r\n"
+  assert(m.match(line, "abc\rd\r\r\n") == 7)
+  assert(not m.match(line, "abc\rd\r"))
+  assert(m.match((1 - (m.P"ab" + "cd"))^0 * m.Cp(), "xxaxcxcd") == 7)
+  local t = {}
+  assert(m.match((1 - m.Cmt("z", function (_, i) t[#t + 1] = i end))^0,
+                 "azbz") == 5)
+  checkeq(t, {3, 5})
+end
+
+
+-- choices with many alternatives (tries and dispatch tables)
+do
+  local kw = m.P"if" + "in" + "int" + "else" + "end" + "elseif" + "abc"
+  assert(kw:match("if") == 3)
+  assert(kw:match("int") == 3)   -- "in" comes first
+  assert(kw:match("elseif") == 5)   -- "else" comes first
+  assert(kw:match("end") == 4)
+  assert(kw:match("abcd") == 4)
+  assert(not kw:match("e"))
+  assert(not kw:match("ab"))
+  assert(not kw:match(""))
+
+  local p = m.P"abcd" + "abc" + "ab" + "x" + "xyz"
+  assert(p:match("abcde") == 5)
+  assert(p:match("abce") == 4)
+  assert(p:match("abx") == 3)
+  assert(p:match("xyz") == 2)
+  assert(not p:match("a"))
+
+  local words, p = {}, m.P(false)
+  for i = 1, 300 do
+    words[i] = "/r/" .. string.char(97 + i % 26) .. i .. ";"
+    p = p + words[i]
+  end
+  for i = 1, 300 do assert(p:match(words[i] .. "/") == #words[i] + 1) end
+  assert(not p:match("/r/a"))
+  assert(p:match("/r/b1;0") == 7)
+  assert(not p:match("/r/b10"))
+
+  local d = m.P"a" * m.C(m.R"09"^1) + m.P"b" * 1 + m.P"c" * m.Cc(3) +
+            m.P"dd" * m.Cc(4) + m.S"ef" * m.Cc(5)
+  assert(d:match("a12") == "12")
+  assert(d:match("bx") == 3)
+  assert(d:match("c") == 3)
+  assert(d:match("dd") == 4)
+  assert(d:match("f") == 5)
+  assert(not d:match("a"))
+  assert(not d:match("d"))
+  assert(not d:match("g"))
+  assert(not d:match(""))
+  assert(m.match(m.Cs((d / "" + 1)^0), "xa1yccz") == "xyz")
+
+  -- more alternatives than a dispatch table can hold
+  local all, lits = m.P(false), m.P(false)
+  for i = 0, 255 do
+    all = all + m.P(string.char(i)) * m.Cc(i)
+    lits = lits + (string.char(i) .. "x")
+  end
+  for i = 0, 255 do
+    assert(all:match(string.char(i)) == i)
+    assert(lits:match(string.char(i) .. "x") == 3)
+  end
+  assert(not lits:match("\255"))
+end
+
+
+-- stream matching
+do
+  local function feed (p, chunks, ...)
+    local f = p:streammatch(...)
+    local res
+    for i = 1, #chunks do
+      res = {f(chunks[i], i == #chunks)}
+      if res[1] ~= 1 then break end
+    end
+    return unpack(res)
+  end
+
+  checkeq({feed(m.C"abc" * m.C"def", {"ab", "c", "de", "f"})},
+          {0, "abc", "def"})
+  checkeq({feed(m.C"abc" * m.C"def", {"ab", "c", "dx", "f"})}, {-1})
+  checkeq({feed(m.C(m.R"az"^1) * m.Cp(), {"ab", "cd", "", "12"})},
+          {0, "abcd", 5})
+  checkeq({feed((m.P"ab" + "ac")^0 * m.Cp(), {"a", "b", "a", "c", "a"})},
+          {0, 5})
+  checkeq({feed(m.B"ab" * m.Cp(), {"a", "b"}, 3)}, {0, 3})
+  checkeq({feed(m.Carg(1) * m.Carg(2), {"a"}, 1, "x", "y")}, {0, "x", "y"})
+  checkeq({feed(m.Cmt(m.C"a", function (_, i, c) return i, c:upper() end) *
+                m.C"b", {"a", "b"})}, {0, "A", "b"})
+  checkeq({feed(m.Ct((m.C(m.R"az"^1) + 1)^0), {"one tw", "o thr", "ee"})},
+          {0, {"one", "two", "three"}})
+
+  -- partial input must not decide a match
+  local f = m.P"abc":streammatch()
+  assert(f("ab") == 1)
+  assert(f("c") == 0)
+  checkerr("finished", f, "d")
+
+  -- input no longer needed is discarded
+  local line = (1 - m.P"\n")^0 * "\n"
+  local chunk = string.rep("a line of text\n", 100)
+  f = (line^0 * m.Cp()):streammatch()
+  for i = 1, 1000 do assert(f(chunk:sub(1, 7)) == 1 and f(chunk:sub(8)) == 1) end
+  checkeq({f("", true)}, {0, #chunk * 1000 + 1})
+end
+
+
+-- matching into a table, and reuse of match state between calls
+do
+  local t = {"x", "y", "z", "w"}
+  local p = m.C(m.R"az"^1) * (" " * m.C(m.R"az"^1))^0
+  assert(p:match_into("one two", t) == 2)
+  checkeq(t, {"one", "two"})
+  assert(m.match_into(p, "abc", t) == 1 and #t == 1 and t[1] == "abc")
+  assert(p:match_into("123", t) == nil and t[1] == "abc")
+  assert(m.P"ab":match_into("ab", t) == 1 and t[1] == 3 and t[2] == nil)
+  assert(p:match_into("a b c", t, 3) == 2 and t[1] == "b" and t[2] == "c")
+  assert(m.Carg(1):match_into("", t, 1, 10) == 1 and t[1] == 10)
+  checkerr("table expected", m.match_into, p, "a", nil)
+
+  -- grown stacks and capture lists are reused, also by nested matches
+  local deep = m.P{"(" * m.V(1)^-1 * ")"}
+  local many = m.Ct(m.C(1)^0)
+  local subj = string.rep("a", 2000)
+  local nested = m.Cmt(1, function (s, i)
+    return #many:match(subj) == 2000 and deep:match(string.rep("(", 300) ..
+                                                    string.rep(")", 300)) == 601
+  end)
+  for i = 1, 20 do
+    assert(#many:match(subj) == 2000)
+    assert(nested:match("x") == 2)
+    assert(deep:match(string.rep("(", 300 + i) .. string.rep(")", 300)) == nil)
+    assert(not pcall(m.match, m.Cmt(many, error), subj))
+  end
+end
+
+
+-- dumping and loading compiled patterns
+do
+  local function rev (s) return s:reverse() end
+  local kt = {x = "X"}
+  local p = m.P{"S";
+    S = m.Ct((m.V"W" + m.Cc(true, 1.5, "k") * " " + m.P"x" / kt + 1)^0),
+    W = m.C(m.R"az" - "x") * m.C(m.R"az"^1) / rev,
+  }
+  local d = m.dump(p, {[rev] = "rev", [kt] = "kt"})
+  assert(d == m.dump(p, {[rev] = "rev", [kt] = "kt"}))
+  local l = m.load(d, {rev = rev, kt = kt})
+  assert(m.type(l) == "pattern")
+  for _, s in ipairs{"ab cd", "x yz", "", "a"} do
+    checkeq(p:match(s), l:match(s))
+  end
+  assert(m.load(m.dump(m.P"abc" * -1)):match("abc") == 4)
+  assert(m.load(m.dump(m.C(m.R"09"^1))):match("123") == "123")
+  -- loaded code keeps working when composed and recompiled
+  assert(#m.match(m.Ct(l * m.Cc"end"), "ab") == 2)
+
+  checkerr("no name for", m.dump, p)
+  checkerr("no value for name 'kt'", m.load, d, {rev = rev})
+  checkerr("truncated", m.load, d:sub(1, -2), {rev = rev, kt = kt})
+  checkerr("malformed", m.load, d .. "x", {rev = rev, kt = kt})
+  checkerr("not a pattern dump", m.load, string.rep("x", 100))
+end
+
+
+-- profiling (counters are only available in builds with LPEG_PROFILE)
+if not pcall(m.profile, m.P"a") then
+  checkerr("profiling builds", m.profile, m.P"a", true)
+else
+  local g = m.P{"list";
+    list = m.V"item" * ("," * m.V"item")^0 * -1,
+    item = m.V"num" + m.V"word",
+    num = m.C(m.R"09"^1) * #(m.P"," + -1),
+    word = m.R"az"^1,
+  }
+  assert(m.profile(g) == nil)
+  local prof = m.profile(g, true)
+  assert(#prof.rules == 4 and prof.rules[1].entries == 0)
+  for i = 1, 10 do
+    assert(g:match("12,ab,7x,9") == nil)
+    checkeq({g:match("12,ab,9")}, {"12", "9"})
+  end
+  prof = m.profile(g)
+  local rules = {}
+  for _, r in ipairs(prof.rules) do rules[r.name] = r end
+  checkeq(rules.list, {name = "list", entries = 20, successes = 10,
+                       failures = 10, bytes = 70, maxdepth = 1})
+  checkeq(rules.num, {name = "num", entries = 40, successes = 30,
+                      failures = 10, bytes = 50, maxdepth = 3})
+  assert(rules.item.entries == 60 and rules.item.failures == 10)
+  assert(rules.word.successes == 20 and rules.word.bytes == 40)
+  -- the look-ahead in 'num' fails once for "7x"
+  assert(#prof.choices == 1 and prof.choices[1].rule == "num")
+  assert(prof.choices[1].entries == 40 and prof.choices[1].failures == 10)
+  -- resetting, streams, and stopping
+  prof = m.profile(g, true)
+  assert(prof.rules[1].entries == 0)
+  local f = g:streammatch()
+  assert(f("12,a") == 1)
+  checkeq({f("b,9", true)}, {0, "12", "9"})
+  assert(m.profile(g).rules[1].successes == 1)
+  assert(m.profile(g, false).rules[1].successes == 1)
+  assert(m.profile(g) == nil and g:match("1,b") == "1")
+  -- stopping the profiling in the middle of a match
+  local h
+  h = m.P{"S";
+    S = m.Cmt("", function () m.profile(h, false); collectgarbage(); return true end)
+        * m.V"word" * ("," * m.V"word")^0,
+    word = m.R"az"^1,
+  }
+  m.profile(h, true)
+  assert(h:match("ab,cd,e") == 8 and m.profile(h) == nil)
+end
+
+
+-- memoized patterns
+do
+  -- without memoization, 'A' runs 3 + 3^2 + ... + 3^(n+1) times for n
+  -- nested parentheses
+  local calls = 0
+  local function counter () calls = calls + 1; return true end
+  local count = m.Cmt(m.P"", counter)
+  local function gram (memo)
+    return m.P{"S";
+      S = m.V"A" * "x" / 0 + m.V"A" * "y" / 0 + m.V"A" * m.C"z",
+      A = memo(count * (m.C("(" * m.V"S" * ")") + m.C"a")),
+    }
+  end
+  local subj = string.rep("(", 8) .. "a" .. string.rep("z)", 8) .. "z"
+  local plain = {gram(function (p) return p end):match(subj)}
+  assert(#plain == 18 and plain[1] == subj:sub(1, -2) and calls == (3^10 - 3) / 2)
+  calls = 0
+  local g = gram(m.M)
+  checkeq({g:match(subj)}, plain)
+  assert(calls == 9)
+  m.setmaxmemo(0)
+  calls = 0
+  checkeq({g:match(subj)}, plain)
+  assert(calls == (3^10 - 3) / 2)
+  m.setmaxmemo(1)   -- tiny table: only failures fit
+  checkeq({g:match(subj)}, plain)
+  m.setmaxmemo(65536)
+  checkerr("out of range", m.setmaxmemo, -1)
+  -- remembered captures are replayed
+  local p = m.M(m.Ct(m.Cg(m.C(m.R"az"^1), "w") * m.C(m.R"09"^0)))
+  g = m.P{ m.V"x" * "!" + m.V"x" * "?", x = p }
+  checkeq(g:match("abc12?"), {w = "abc", "12"})
+  assert(g:match("abc12.") == nil)
+  -- successes with values from match-time captures are not remembered
+  calls = 0
+  p = m.M(m.Cmt(m.R"az"^1, function (_, _, c)
+    calls = calls + 1; return true, c:upper()
+  end))
+  g = m.P{ m.V"x" * "!" + m.V"x" * "?", x = p }
+  assert(g:match("abc?") == "ABC" and calls == 2)
+  -- in stream mode
+  local f = gram(m.M):streammatch()
+  assert(f(subj:sub(1, 10)) == 1)
+  checkeq({f(subj:sub(11), true)}, {0, unpack(plain)})
+  local d = m.dump(gram(m.M), {[counter] = "counter"})
+  calls = 0
+  assert(m.load(d, {counter = counter}):match(subj) == plain[1] and calls == 9)
+end
+
+
+-- table captures mixing substrings, named groups, and other values
+do
+  local item = m.C(m.R"az") + m.Cg(m.C"=", "eq") + m.Cg(m.Cc(1, 2) * "#")
+             + m.P"!" / {} + m.P"-" / function () end
+  local t = m.Ct(item^0):match("ab=c#!-d")
+  checkeq(t, {"a", "b", "c", 1, 2, "d", eq = "="})
+  local words = {}
+  for i = 1, 10000 do words[i] = "w" .. i end
+  t = m.Ct((m.C((1 - m.P" ")^1) * m.P" "^-1)^0):match(table.concat(words, " "))
+  checkeq(t, words)
+  checkerr("too many captures", m.match, m.C(m.C(1)^0), string.rep("a", 1e6))
+end
+
+
+-- searching for a set of strings
+do
+  local p = m.Mset{"he", "she", "his", "hers"}
+  assert(p:match("ushers") == 2)   -- "she" and "he" end there; longest wins
+  checkeq({(p * m.Cp()):match("ahis")}, {3, 5})
+  checkeq(m.Ct(p^0):match("ushers his she"), {2, 3, 2})
+  assert(p:match("xyz") == nil and p:match("") == nil)
+  assert(m.Mset{}:match("abc") == nil)
+  assert(m.Mset{"ab", "b", "ab"}:match("xab") == 1)   -- duplicates keep 1st
+  checkeq({m.C(m.Mset{"b"}):match("aab")}, {"aab", 1})
+  -- inside grammars and with other captures
+  local g = m.P{ "list";
+    list = m.Ct((m.V"item" * ("," + -m.P(1)))^0),
+    item = m.Cg(m.Mset{"cat", "dog"}, "pet") * (1 - m.P",")^0,
+  }
+  checkeq(g:match("hotdog,x"), {pet = 2})
+  -- compare with a direct search over random strings
+  for i = 1, 200 do
+    local strs, subj = {}, {}
+    for j = 1, math.random(1, 6) do
+      local t = {}
+      for k = 1, math.random(1, 3) do t[k] = string.char(math.random(97, 99)) end
+      strs[j] = table.concat(t)
+    end
+    for k = 1, math.random(0, 10) do subj[k] = string.char(math.random(97, 99)) end
+    subj = table.concat(subj)
+    local expn, expe
+    for e = 1, #subj do
+      for j = 1, #strs do
+        local l = #strs[j]
+        if subj:sub(e - l + 1, e) == strs[j] and (not expn or l > #strs[expn]) then
+          expn, expe = j, e + 1
+        end
+      end
+      if expn then break end
+    end
+    local n, e = (m.Mset(strs) * m.Cp()):match(subj)
+    assert(n == expn and e == expe)
+  end
+  -- in stream mode, dumped, and errors
+  local f = (p * m.Cp()):streammatch()
+  assert(f("xxh") == 1 and f("i") == 1)
+  checkeq({f("sx", true)}, {0, 3, 6})
+  assert(m.load(m.dump(p)):match("ushers") == 2)
+  checkerr("list of strings", m.Mset, {"a", 1})
+  checkerr("empty string", m.Mset, {"a", ""})
+  checkerr("fixed length", m.B, p)
+end
+
+
+-- matching through the FFI entry point (LuaJIT only)
+if rawget(_G, "jit") then
+  local ffi = require "ffi"
+  ffi.cdef[[
+    int lpeg_match (const void *code, const char *subject, size_t len,
+                    size_t init, int *ovec, int n);
+  ]]
+  local lib = ffi.load(package.searchpath("lpeg", package.cpath))
+  local ovec = ffi.new("int[?]", 2 * 64)
+  -- run 'p' over 's' through the FFI; return its pairs as a list
+  local function fmatch (p, s, init, n)
+    local k = lib.lpeg_match(m.code(p), s, #s, init or 0, ovec, n or 64)
+    if k <= 0 then return k end
+    local t = {}
+    for i = 0, math.min(k, n or 64) - 1 do
+      t[#t + 1] = {ovec[2 * i], ovec[2 * i + 1]}
+    end
+    return t
+  end
+  local word = m.R"az"^1
+  checkeq(fmatch(word, "abc1"), {{0, 3}})
+  checkeq(fmatch(word, "abc1", 3), 0)
+  checkeq(fmatch(m.C(word) * m.Cp() * m.C(m.C"1"), "abc1"),
+          {{0, 4}, {0, 3}, {3, 3}, {3, 4}, {3, 4}})
+  checkeq(fmatch(m.Cg(m.C"a" * m.Cp()) * m.Cg(m.P"b") * m.Cg(m.C"c", "x"),
+                 "abc"), {{0, 3}, {0, 1}, {1, 1}, {1, 2}})
+  checkeq(fmatch(m.P"b", "abc", 1), {{1, 2}})
+  checkeq(fmatch(m.P"b", "abc", 10), 0)
+  -- many captures, truncated 'ovec', memoized patterns
+  local many = m.Cp() * (m.C(word) * m.P" "^-1)^0
+  local subj = string.rep("ab ", 1000)
+  assert(lib.lpeg_match(m.code(many), subj, #subj, 0, nil, 0) == 1002)
+  checkeq(fmatch(many, subj, 0, 3), {{0, 3000}, {0, 0}, {0, 2}})
+  checkeq(fmatch(m.M(m.C(word)) + 1, "ab"), {{0, 2}, {0, 2}})
+  -- compare with 'match' over a grammar
+  local g = m.P{ "S";
+    S = m.V"T" * (m.P"," * m.V"T")^0 * -1,
+    T = m.C(m.V"E") + m.Cp() * m.P"-",
+    E = m.P"(" * m.V"T" * m.P")" + word,
+  }
+  for _, s in ipairs{"a,(b),((c)),-", "(-),x", "a,", "((((z))))"} do
+    local res, t = {g:match(s)}, fmatch(g, s)
+    if res[1] == nil then assert(t == 0)
+    else
+      for i, v in ipairs(res) do
+        local a, b = t[i + 1][1], t[i + 1][2]
+        if type(v) == "number" then assert(a == v - 1 and b == a)
+        else assert(s:sub(a + 1, b) == v) end
+      end
+    end
+  end
+  -- patterns that need Lua, and overflows
+  assert(fmatch(m.Cc(1), "") == -1 and fmatch(m.Ct(m.C(1)), "a") == -1)
+  assert(fmatch(m.Cmt(1, function () return true end), "a") == -1)
+  assert(fmatch(m.Cmt(1, function () return true end) + 1, "a") == -1)
+  local deep = m.P{ m.P"(" * m.V(1) * m.P")" + "" }
+  checkeq(fmatch(deep, string.rep("(", 100) .. string.rep(")", 100)),
+          {{0, 200}})
+  assert(fmatch(deep, string.rep("(", 1000) .. string.rep(")", 1000)) == -2)
+end
+
+
 -------------------------------------------------------------------
 -- Tests for 're' module
 -------------------------------------------------------------------
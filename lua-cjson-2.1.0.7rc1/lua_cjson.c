@@ -65,6 +65,11 @@
 
 #endif
 
+#if LUA_VERSION_NUM >= 502
+#define lua_getfenv lua_getuservalue
+#define lua_setfenv lua_setuservalue
+#endif
+
 /* Workaround for Solaris platforms missing isinf() */
 #if !defined(isinf) && (defined(USE_INTERNAL_ISINF) || defined(MISSING_ISINF))
 #define isinf(x) (!isnan(x) && isnan((x) - (x)))
@@ -81,6 +86,10 @@
 #define DEFAULT_ENCODE_NUMBER_PRECISION 14
 #define DEFAULT_ENCODE_EMPTY_TABLE_AS_OBJECT 1
 #define DEFAULT_DECODE_ARRAY_WITH_ARRAY_MT 0
+#define DEFAULT_ENCODE_STREAM_CHUNK_SIZE 8192
+#define DEFAULT_SCRATCH_LIMIT (1024 * 1024)
+
+#define JSON_SCHEMA_MT  CJSON_MODNAME ".schema"
 
 #ifdef DISABLE_INVALID_NUMBERS
 #undef DEFAULT_DECODE_INVALID_NUMBERS
@@ -142,6 +151,16 @@ typedef struct {
      * encode_keep_buffer is set */
     strbuf_t encode_buf;
 
+    /* Scratch space for decoded strings, reused by decode/extract
+     * unless already in use further up the C stack */
+    strbuf_t decode_buf;
+    int decode_buf_busy;
+
+    /* Persistent buffers larger than scratch_limit bytes are shrunk
+     * after use (0: unlimited) */
+    int scratch_limit;
+    int scratch_trims;
+
     int encode_sparse_convert;
     int encode_sparse_ratio;
     int encode_sparse_safe;
@@ -156,6 +175,51 @@ typedef struct {
     int decode_array_with_array_mt;
 } json_config_t;
 
+/* Output sink used by cjson.encode_stream(). Encoded data is passed on
+ * in chunk_size pieces once enough has accumulated in the strbuf. */
+typedef struct {
+    int index;          /* Lua stack index of the sink function/table */
+    int is_table;
+    int chunk_size;
+    int next_slot;      /* Next array slot when appending to a table */
+    size_t total;       /* Bytes passed to the sink so far */
+} json_sink_t;
+
+typedef enum {
+    F_ANY,
+    F_STRING,
+    F_NUMBER,
+    F_BOOLEAN,
+    F_ARRAY,
+    F_OBJECT,           /* Table encoded with a nested schema */
+    F_ARRAY_OF          /* Array of tables encoded with a nested schema */
+} json_field_type_t;
+
+static const char *json_field_type_name[] = {
+    "any", "string", "number", "boolean", "array", NULL
+};
+
+typedef struct json_schema_s json_schema_t;
+
+typedef struct {
+    json_field_type_t type;
+    const char *literal;        /* Pre-escaped "key": */
+    size_t literal_len;
+    json_schema_t *schema;      /* F_OBJECT / F_ARRAY_OF only */
+} json_field_t;
+
+/* Compiled by cjson.compile_schema(). The key strings and nested schemas
+ * are referenced from the userdata environment table:
+ *   env[i]           key of field i
+ *   env[nfields + i] nested schema of field i (if any)
+ *   env[0]           configuration userdata
+ *   env[-1]          string holding all field literals */
+struct json_schema_s {
+    json_config_t *cfg;
+    int nfields;
+    json_field_t fields[1];
+};
+
 typedef struct {
     const char *data;
     const char *ptr;
@@ -172,7 +236,7 @@ typedef struct {
         double number;
         int boolean;
     } value;
-    int string_len;
+    size_t string_len;
 } json_token_t;
 
 static const char *char2escape[256] = {
@@ -366,6 +430,41 @@ static int json_cfg_encode_keep_buffer(lua_State *l)
     return 1;
 }
 
+/* Configures the size above which persistent encode/decode buffers are
+ * shrunk after use */
+static int json_cfg_scratch_limit(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 1);
+
+    return json_integer_option(l, 1, &cfg->scratch_limit, 0, INT_MAX);
+}
+
+/* Return buffer allocation statistics */
+static int json_scratch_stats(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 0);
+    strbuf_t *buf;
+
+    lua_createtable(l, 0, 5);
+
+    buf = &cfg->encode_buf;
+    lua_pushnumber(l, strbuf_allocated(buf) ? (lua_Number)buf->size : 0);
+    lua_setfield(l, -2, "encode_size");
+    lua_pushinteger(l, strbuf_allocated(buf) ? buf->reallocs : 0);
+    lua_setfield(l, -2, "encode_reallocs");
+
+    buf = &cfg->decode_buf;
+    lua_pushnumber(l, (lua_Number)buf->size);
+    lua_setfield(l, -2, "decode_size");
+    lua_pushinteger(l, buf->reallocs);
+    lua_setfield(l, -2, "decode_reallocs");
+
+    lua_pushinteger(l, cfg->scratch_trims);
+    lua_setfield(l, -2, "trims");
+
+    return 1;
+}
+
 #if defined(DISABLE_INVALID_NUMBERS) && !defined(USE_INTERNAL_FPCONV)
 void json_verify_invalid_number_setting(lua_State *l, int *setting)
 {
@@ -406,8 +505,10 @@ static int json_destroy_config(lua_State *l)
     json_config_t *cfg;
 
     cfg = lua_touserdata(l, 1);
-    if (cfg)
+    if (cfg) {
         strbuf_free(&cfg->encode_buf);
+        strbuf_free(&cfg->decode_buf);
+    }
     cfg = NULL;
 
     return 0;
@@ -437,10 +538,14 @@ static void json_create_config(lua_State *l)
     cfg->encode_number_precision = DEFAULT_ENCODE_NUMBER_PRECISION;
     cfg->encode_empty_table_as_object = DEFAULT_ENCODE_EMPTY_TABLE_AS_OBJECT;
     cfg->decode_array_with_array_mt = DEFAULT_DECODE_ARRAY_WITH_ARRAY_MT;
+    cfg->scratch_limit = DEFAULT_SCRATCH_LIMIT;
+    cfg->scratch_trims = 0;
 
 #if DEFAULT_ENCODE_KEEP_BUFFER > 0
     strbuf_init(&cfg->encode_buf, 0);
 #endif
+    strbuf_init(&cfg->decode_buf, 0);
+    cfg->decode_buf_busy = 0;
 
     /* Decoding init */
 
@@ -488,13 +593,64 @@ static void json_create_config(lua_State *l)
     cfg->escape2char['u'] = 'u';          /* Unicode parsing required */
 }
 
+/* ===== SCRATCH BUFFERS ===== */
+
+/* Shrink a persistent buffer which has grown beyond the scratch limit */
+static void json_scratch_trim(json_config_t *cfg, strbuf_t *buf)
+{
+    strbuf_reset(buf);
+
+    if (cfg->scratch_limit > 0 && buf->size > (size_t)cfg->scratch_limit) {
+        strbuf_resize(buf, STRBUF_DEFAULT_SIZE - 1);
+        cfg->scratch_trims++;
+    }
+}
+
+/* Fetch a buffer able to hold len bytes for decoding strings. */
+static strbuf_t *json_decode_acquire(json_config_t *cfg, size_t len)
+{
+    strbuf_t *buf;
+
+    /* A Lua finalizer run during decoding may call back into this
+     * module. Fall back to a private buffer in that case. */
+    if (cfg->decode_buf_busy)
+        return strbuf_new(len);
+
+    buf = &cfg->decode_buf;
+    cfg->decode_buf_busy = 1;
+    strbuf_reset(buf);
+    strbuf_ensure_empty_length(buf, len);
+
+    return buf;
+}
+
+static void json_decode_release(json_config_t *cfg, strbuf_t *buf)
+{
+    if (buf != &cfg->decode_buf) {
+        strbuf_free(buf);
+        return;
+    }
+
+    cfg->decode_buf_busy = 0;
+    json_scratch_trim(cfg, buf);
+}
+
 /* ===== ENCODING ===== */
 
+/* Release the encoding buffer after use or before throwing an error.
+ * The persistent buffer kept by the configuration is only trimmed. */
+static void json_encode_release(json_config_t *cfg, strbuf_t *json)
+{
+    if (json != &cfg->encode_buf)
+        strbuf_free(json);
+    else
+        json_scratch_trim(cfg, json);
+}
+
 static void json_encode_exception(lua_State *l, json_config_t *cfg, strbuf_t *json, int lindex,
                                   const char *reason)
 {
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(json);
+    json_encode_release(cfg, json);
     luaL_error(l, "Cannot serialise %s: %s",
                   lua_typename(l, lua_type(l, lindex)), reason);
 }
@@ -579,7 +735,8 @@ static int lua_array_length(lua_State *l, json_config_t *cfg, strbuf_t *json)
 }
 
 static void json_check_encode_depth(lua_State *l, json_config_t *cfg,
-                                    int current_depth, strbuf_t *json)
+                                    int current_depth, strbuf_t *json,
+                                    int slots)
 {
     /* Ensure there are enough slots free to traverse a table (key,
      * value) and push a string for a potential error message.
@@ -591,25 +748,76 @@ static void json_check_encode_depth(lua_State *l, json_config_t *cfg,
      *
      * While this won't cause a crash due to the EXTRA_STACK reserve
      * slots, it would still be an improper use of the API. */
-    if (current_depth <= cfg->encode_max_depth && lua_checkstack(l, 3))
+    if (current_depth <= cfg->encode_max_depth && lua_checkstack(l, slots))
         return;
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(json);
+    json_encode_release(cfg, json);
 
     luaL_error(l, "Cannot serialise, excessive nesting (%d)",
                current_depth);
 }
 
 static void json_append_data(lua_State *l, json_config_t *cfg,
-                             int current_depth, strbuf_t *json);
+                             int current_depth, strbuf_t *json,
+                             json_sink_t *sink);
+
+/* Pass all complete chunks in the strbuf to the sink. The remainder (less
+ * than chunk_size) is kept at the start of the strbuf unless "final" is
+ * set, in which case it is also flushed.
+ *
+ * The sink is called in protected mode so a private strbuf can be
+ * released before the error is rethrown. */
+static void json_sink_flush(lua_State *l, json_config_t *cfg,
+                            strbuf_t *json, json_sink_t *sink, int final)
+{
+    char *buf;
+    size_t len, pos, chunk;
+
+    buf = strbuf_string(json, &len);
+    if (len < (size_t)sink->chunk_size && (!final || !len))
+        return;
+
+    if (!lua_checkstack(l, 3)) {
+        json_encode_release(cfg, json);
+        luaL_error(l, "Cannot serialise, unable to grow stack for sink");
+    }
+
+    for (pos = 0; pos < len; pos += chunk) {
+        chunk = len - pos;
+        if (chunk > (size_t)sink->chunk_size)
+            chunk = sink->chunk_size;
+        else if (chunk < (size_t)sink->chunk_size && !final)
+            break;
+
+        sink->total += chunk;
+        if (sink->is_table) {
+            lua_pushlstring(l, buf + pos, chunk);
+            lua_rawseti(l, sink->index, sink->next_slot++);
+            continue;
+        }
+
+        lua_pushvalue(l, sink->index);
+        lua_pushlstring(l, buf + pos, chunk);
+        if (lua_pcall(l, 1, 0, 0) != 0) {
+            json_encode_release(cfg, json);
+            lua_error(l);
+        }
+    }
+
+    /* Move any incomplete chunk to the front of the buffer */
+    if (pos < len)
+        memmove(buf, buf + pos, len - pos);
+    strbuf_reset(json);
+    strbuf_extend_length(json, len - pos);
+}
 
 /* json_append_array args:
  * - lua_State
  * - JSON strbuf
  * - Size of passwd Lua array (top of stack) */
 static void json_append_array(lua_State *l, json_config_t *cfg, int current_depth,
-                              strbuf_t *json, int array_length)
+                              strbuf_t *json, json_sink_t *sink,
+                              int array_length)
 {
     int comma, i;
 
@@ -623,8 +831,11 @@ static void json_append_array(lua_State *l, json_config_t *cfg, int current_dept
             comma = 1;
 
         lua_rawgeti(l, -1, i);
-        json_append_data(l, cfg, current_depth, json);
+        json_append_data(l, cfg, current_depth, json, sink);
         lua_pop(l, 1);
+
+        if (sink)
+            json_sink_flush(l, cfg, json, sink, 0);
     }
 
     strbuf_append_char(json, ']');
@@ -669,7 +880,8 @@ static void json_append_number(lua_State *l, json_config_t *cfg,
 }
 
 static void json_append_object(lua_State *l, json_config_t *cfg,
-                               int current_depth, strbuf_t *json)
+                               int current_depth, strbuf_t *json,
+                               json_sink_t *sink)
 {
     int comma, keytype;
 
@@ -701,9 +913,12 @@ static void json_append_object(lua_State *l, json_config_t *cfg,
         }
 
         /* table, key, value */
-        json_append_data(l, cfg, current_depth, json);
+        json_append_data(l, cfg, current_depth, json, sink);
         lua_pop(l, 1);
         /* table, key */
+
+        if (sink)
+            json_sink_flush(l, cfg, json, sink, 0);
     }
 
     strbuf_append_char(json, '}');
@@ -711,7 +926,8 @@ static void json_append_object(lua_State *l, json_config_t *cfg,
 
 /* Serialise Lua data into JSON string. */
 static void json_append_data(lua_State *l, json_config_t *cfg,
-                             int current_depth, strbuf_t *json)
+                             int current_depth, strbuf_t *json,
+                             json_sink_t *sink)
 {
     int len;
     int as_array = 0;
@@ -732,7 +948,7 @@ static void json_append_data(lua_State *l, json_config_t *cfg,
         break;
     case LUA_TTABLE:
         current_depth++;
-        json_check_encode_depth(l, cfg, current_depth, json);
+        json_check_encode_depth(l, cfg, current_depth, json, 3);
 
         has_metatable = lua_getmetatable(l, -1);
 
@@ -745,12 +961,12 @@ static void json_append_data(lua_State *l, json_config_t *cfg,
 
         if (as_array) {
             len = lua_objlen(l, -1);
-            json_append_array(l, cfg, current_depth, json, len);
+            json_append_array(l, cfg, current_depth, json, sink, len);
         } else {
             len = lua_array_length(l, cfg, json);
 
             if (len > 0 || (len == 0 && !cfg->encode_empty_table_as_object)) {
-                json_append_array(l, cfg, current_depth, json, len);
+                json_append_array(l, cfg, current_depth, json, sink, len);
             } else {
                 if (has_metatable) {
                     lua_getmetatable(l, -1);
@@ -760,11 +976,11 @@ static void json_append_data(lua_State *l, json_config_t *cfg,
                     as_array = lua_rawequal(l, -1, -2);
                     lua_pop(l, 2); /* pop pointer + metatable */
                     if (as_array) {
-                        json_append_array(l, cfg, current_depth, json, 0);
+                        json_append_array(l, cfg, current_depth, json, sink, 0);
                         break;
                     }
                 }
-                json_append_object(l, cfg, current_depth, json);
+                json_append_object(l, cfg, current_depth, json, sink);
             }
         }
         break;
@@ -775,7 +991,7 @@ static void json_append_data(lua_State *l, json_config_t *cfg,
         if (lua_touserdata(l, -1) == NULL) {
             strbuf_append_mem(json, "null", 4);
         } else if (lua_touserdata(l, -1) == &json_array) {
-            json_append_array(l, cfg, current_depth, json, 0);
+            json_append_array(l, cfg, current_depth, json, sink, 0);
         }
         break;
     default:
@@ -792,7 +1008,7 @@ static int json_encode(lua_State *l)
     strbuf_t local_encode_buf;
     strbuf_t *encode_buf;
     char *json;
-    int len;
+    size_t len;
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
@@ -806,13 +1022,347 @@ static int json_encode(lua_State *l)
         strbuf_reset(encode_buf);
     }
 
-    json_append_data(l, cfg, 0, encode_buf);
+    json_append_data(l, cfg, 0, encode_buf, NULL);
     json = strbuf_string(encode_buf, &len);
 
     lua_pushlstring(l, json, len);
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(encode_buf);
+    json_encode_release(cfg, encode_buf);
+
+    return 1;
+}
+
+/* Serialise a Lua value into a sink without building the whole JSON
+ * string in memory.
+ * - Function sinks are called with each chunk: sink(chunk)
+ * - Table sinks have each chunk appended (suitable for ngx.print)
+ *
+ * Returns the total number of bytes passed to the sink. */
+static int json_encode_stream(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    strbuf_t encode_buf;
+    json_sink_t sink;
+    lua_Integer chunk_size;
+
+    luaL_argcheck(l, lua_gettop(l) >= 2 && lua_gettop(l) <= 3, 1,
+                  "expected 2 or 3 arguments");
+
+    sink.index = 2;
+    sink.is_table = lua_istable(l, 2);
+    luaL_argcheck(l, sink.is_table || lua_isfunction(l, 2), 2,
+                  "expected function or table");
+    sink.next_slot = sink.is_table ? lua_objlen(l, 2) + 1 : 0;
+    sink.total = 0;
+    chunk_size = luaL_optinteger(l, 3, DEFAULT_ENCODE_STREAM_CHUNK_SIZE);
+    luaL_argcheck(l, chunk_size > 0 && chunk_size < INT_MAX, 3,
+                  "expected positive chunk size");
+    sink.chunk_size = (int)chunk_size;
+
+    /* Value to serialise must be on the top of the stack */
+    lua_settop(l, 2);
+    lua_pushvalue(l, 1);
+
+    /* Always use a private buffer. It only needs to hold a single chunk
+     * (plus the value being appended) and must not be disturbed if the
+     * sink calls back into this module. */
+    strbuf_init(&encode_buf, sink.chunk_size);
+
+    json_append_data(l, cfg, 0, &encode_buf, &sink);
+    json_sink_flush(l, cfg, &encode_buf, &sink, 1);
+
+    strbuf_free(&encode_buf);
+
+    lua_pushnumber(l, (lua_Number)sink.total);
+
+    return 1;
+}
+
+/* ===== SCHEMA ENCODING ===== */
+
+/* json_append_schema args:
+ * - Schema environment table (stack index -2)
+ * - Value to serialise (top of stack)
+ *
+ * Fields are fetched by key in schema order and written after their
+ * pre-escaped key. Values which do not match the expected type, and
+ * values which are not tables, are serialised by json_append_data(). */
+static void json_append_schema(lua_State *l, json_config_t *cfg,
+                               int current_depth, strbuf_t *json,
+                               json_schema_t *schema)
+{
+    json_field_t *field;
+    int comma, i, j, len, type;
+
+    if (!lua_istable(l, -1)) {
+        json_append_data(l, cfg, current_depth, json, NULL);
+        return;
+    }
+
+    /* env, table, value, nested env, element */
+    current_depth++;
+    json_check_encode_depth(l, cfg, current_depth, json, 4);
+
+    strbuf_append_char(json, '{');
+
+    comma = 0;
+    for (i = 0; i < schema->nfields; i++) {
+        field = &schema->fields[i];
+
+        /* env, table */
+        lua_rawgeti(l, -2, i + 1);
+        lua_rawget(l, -2);
+        /* env, table, value */
+        type = lua_type(l, -1);
+        if (type == LUA_TNIL) {
+            lua_pop(l, 1);
+            continue;
+        }
+
+        if (comma)
+            strbuf_append_char(json, ',');
+        else
+            comma = 1;
+        strbuf_append_mem(json, field->literal, field->literal_len);
+
+        switch (field->type) {
+        case F_STRING:
+            if (type != LUA_TSTRING)
+                goto generic;
+            json_append_string(l, json, -1);
+            break;
+        case F_NUMBER:
+            if (type != LUA_TNUMBER)
+                goto generic;
+            json_append_number(l, cfg, json, -1);
+            break;
+        case F_BOOLEAN:
+            if (type != LUA_TBOOLEAN)
+                goto generic;
+            if (lua_toboolean(l, -1))
+                strbuf_append_mem(json, "true", 4);
+            else
+                strbuf_append_mem(json, "false", 5);
+            break;
+        case F_ARRAY:
+            if (type != LUA_TTABLE ||
+                (len = lua_array_length(l, cfg, json)) < 0)
+                goto generic;
+            json_check_encode_depth(l, cfg, current_depth + 1, json, 3);
+            json_append_array(l, cfg, current_depth + 1, json, NULL, len);
+            break;
+        case F_OBJECT:
+            if (type != LUA_TTABLE)
+                goto generic;
+            lua_rawgeti(l, -3, schema->nfields + i + 1);
+            lua_getfenv(l, -1);
+            lua_replace(l, -2);
+            lua_insert(l, -2);
+            /* env, table, nested env, value */
+            json_append_schema(l, cfg, current_depth, json, field->schema);
+            lua_pop(l, 1);
+            break;
+        case F_ARRAY_OF:
+            if (type != LUA_TTABLE ||
+                (len = lua_array_length(l, cfg, json)) < 0)
+                goto generic;
+            json_check_encode_depth(l, cfg, current_depth + 1, json, 3);
+            lua_rawgeti(l, -3, schema->nfields + i + 1);
+            lua_getfenv(l, -1);
+            lua_replace(l, -2);
+            /* env, table, value, nested env */
+            strbuf_append_char(json, '[');
+            for (j = 1; j <= len; j++) {
+                if (j > 1)
+                    strbuf_append_char(json, ',');
+                lua_rawgeti(l, -2, j);
+                json_append_schema(l, cfg, current_depth + 1, json,
+                                   field->schema);
+                lua_pop(l, 1);
+            }
+            strbuf_append_char(json, ']');
+            lua_pop(l, 1);
+            break;
+        default:
+        generic:
+            json_append_data(l, cfg, current_depth, json, NULL);
+        }
+
+        lua_pop(l, 1);
+        /* env, table */
+    }
+
+    strbuf_append_char(json, '}');
+}
+
+/* Serialise a Lua value using a compiled schema: schema:encode(value) */
+static int json_schema_encode(lua_State *l)
+{
+    json_schema_t *schema = luaL_checkudata(l, 1, JSON_SCHEMA_MT);
+    json_config_t *cfg = schema->cfg;
+    strbuf_t local_encode_buf;
+    strbuf_t *encode_buf;
+    char *json;
+    size_t len;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 1 argument");
+
+    if (!cfg->encode_keep_buffer) {
+        encode_buf = &local_encode_buf;
+        strbuf_init(encode_buf, 0);
+    } else {
+        encode_buf = &cfg->encode_buf;
+        strbuf_reset(encode_buf);
+    }
+
+    /* schema, env, value */
+    lua_getfenv(l, 1);
+    lua_insert(l, 2);
+    json_append_schema(l, cfg, 0, encode_buf, schema);
+    json = strbuf_string(encode_buf, &len);
+
+    lua_pushlstring(l, json, len);
+
+    json_encode_release(cfg, encode_buf);
+
+    return 1;
+}
+
+static int json_field_type(const char *name)
+{
+    int i;
+
+    for (i = 0; json_field_type_name[i]; i++) {
+        if (!strcmp(name, json_field_type_name[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+/* Return the schema at the stack index, or NULL */
+static json_schema_t *json_to_schema(lua_State *l, int lindex)
+{
+    void *ud = lua_touserdata(l, lindex);
+    int is_schema = 0;
+
+    if (ud && lua_getmetatable(l, lindex)) {
+        luaL_getmetatable(l, JSON_SCHEMA_MT);
+        is_schema = lua_rawequal(l, -1, -2);
+        lua_pop(l, 2);
+    }
+
+    return is_schema ? ud : NULL;
+}
+
+static void json_schema_error(lua_State *l, strbuf_t *literals, int field,
+                              const char *reason)
+{
+    strbuf_free(literals);
+    luaL_error(l, "Cannot compile schema field %d: %s", field, reason);
+}
+
+/* Compile a list of field descriptors into a schema encoder:
+ *   "key"                      any value
+ *   { "key", type }            type is any/string/number/boolean/array
+ *   { "key", schema }          table encoded with a nested schema
+ *   { "key", "array", schema } array of tables encoded with a schema */
+static int json_compile_schema(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_schema_t *schema;
+    json_field_t *field;
+    strbuf_t literals;
+    const char *buf;
+    size_t offset;
+    int nfields, i, type;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    luaL_checktype(l, 1, LUA_TTABLE);
+
+    nfields = lua_objlen(l, 1);
+    luaL_argcheck(l, nfields > 0, 1, "expected at least one field");
+
+    schema = lua_newuserdata(l, sizeof(*schema) +
+                                (nfields - 1) * sizeof(json_field_t));
+    schema->cfg = cfg;
+    schema->nfields = nfields;
+
+    lua_createtable(l, 2 * nfields, 1);
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_rawseti(l, -2, 0);
+
+    /* spec, schema, env, descriptor, key, type */
+    strbuf_init(&literals, 0);
+    for (i = 0; i < nfields; i++) {
+        field = &schema->fields[i];
+        field->type = F_ANY;
+        field->schema = NULL;
+        field->literal = NULL;
+
+        lua_rawgeti(l, 1, i + 1);
+        if (lua_istable(l, -1)) {
+            lua_rawgeti(l, -1, 1);
+            lua_rawgeti(l, -2, 2);
+        } else {
+            lua_pushvalue(l, -1);
+            lua_pushnil(l);
+        }
+
+        if (lua_type(l, -2) != LUA_TSTRING)
+            json_schema_error(l, &literals, i + 1, "key must be a string");
+
+        if (lua_type(l, -1) == LUA_TSTRING) {
+            type = json_field_type(lua_tostring(l, -1));
+            if (type < 0)
+                json_schema_error(l, &literals, i + 1, "invalid field type");
+            field->type = type;
+            if (field->type == F_ARRAY) {
+                lua_pop(l, 1);
+                lua_rawgeti(l, -2, 3);
+                if (!lua_isnil(l, -1))
+                    field->type = F_ARRAY_OF;
+            }
+        } else if (!lua_isnil(l, -1)) {
+            field->type = F_OBJECT;
+        }
+
+        if (field->type == F_OBJECT || field->type == F_ARRAY_OF) {
+            field->schema = json_to_schema(l, -1);
+            if (!field->schema)
+                json_schema_error(l, &literals, i + 1,
+                                  "expected a compiled schema");
+            lua_rawseti(l, -4, nfields + i + 1);
+        } else {
+            lua_pop(l, 1);
+        }
+
+        /* Literals are stored back to back, pointers are set below */
+        offset = strbuf_length(&literals);
+        json_append_string(l, &literals, -1);
+        strbuf_append_char(&literals, ':');
+        field->literal_len = strbuf_length(&literals) - offset;
+
+        lua_rawseti(l, -3, i + 1);
+        lua_pop(l, 1);
+    }
+
+    /* Keep the pre-escaped keys in a Lua string referenced by the
+     * environment so they live as long as the schema */
+    buf = strbuf_string(&literals, &offset);
+    lua_pushlstring(l, buf, offset);
+    strbuf_free(&literals);
+    buf = lua_tostring(l, -1);
+    lua_rawseti(l, -2, -1);
+    for (i = 0, offset = 0; i < nfields; i++) {
+        schema->fields[i].literal = buf + offset;
+        offset += schema->fields[i].literal_len;
+    }
+
+    lua_setfenv(l, -2);
+
+    luaL_getmetatable(l, JSON_SCHEMA_MT);
+    lua_setmetatable(l, -2);
 
     return 1;
 }
@@ -1187,7 +1737,7 @@ static void json_throw_parse_error(lua_State *l, json_parse_t *json,
 {
     const char *found;
 
-    strbuf_free(json->tmp);
+    json_decode_release(json->cfg, json->tmp);
 
     if (token->type == T_ERROR)
         found = token->value.string;
@@ -1213,7 +1763,7 @@ static void json_decode_descend(lua_State *l, json_parse_t *json, int slots)
         return;
     }
 
-    strbuf_free(json->tmp);
+    json_decode_release(json->cfg, json->tmp);
     luaL_error(l, "Found too many nested data structures (%d) at character %d",
         json->current_depth, json->ptr - json->data);
 }
@@ -1367,7 +1917,7 @@ static int json_decode(lua_State *l)
     /* Ensure the temporary buffer can hold the entire string.
      * This means we no longer need to do length checks since the decoded
      * string must be smaller than the entire json string */
-    json.tmp = strbuf_new(json_len);
+    json.tmp = json_decode_acquire(json.cfg, json_len);
 
     json_next_token(&json, &token);
     json_process_value(l, &json, &token);
@@ -1378,11 +1928,269 @@ static int json_decode(lua_State *l)
     if (token.type != T_END)
         json_throw_parse_error(l, &json, "the end", &token);
 
-    strbuf_free(json.tmp);
+    json_decode_release(json.cfg, json.tmp);
 
     return 1;
 }
 
+/* ===== EXTRACTION ===== */
+
+static void json_skip_whitespace(json_parse_t *json)
+{
+    const json_token_type_t *ch2token = json->cfg->ch2token;
+
+    while (ch2token[(unsigned char)*json->ptr] == T_WHITESPACE)
+        json->ptr++;
+}
+
+/* Skip a string without decoding it. json->ptr must point at the opening
+ * quote, and is left after the closing quote. */
+static void json_skip_string(lua_State *l, json_parse_t *json)
+{
+    const char *p = json->ptr + 1;
+    const char *q;
+    json_token_t token;
+
+    while (1) {
+        p = strchr(p, '"');
+        if (!p) {
+            json->ptr += strlen(json->ptr);
+            json_set_token_error(&token, json, "unexpected end of string");
+            json_throw_parse_error(l, json, "value", &token);
+        }
+
+        /* The quote is escaped when preceded by an odd number of
+         * backslashes. The opening quote stops the scan. */
+        for (q = p; *(q - 1) == '\\'; q--)
+            ;
+        if (!((p - q) & 1))
+            break;
+        p++;
+    }
+
+    json->ptr = p + 1;
+}
+
+/* Skip a complete value. Nested arrays and objects are skipped by
+ * matching brackets only, their contents are not validated. */
+static void json_skip_value(lua_State *l, json_parse_t *json)
+{
+    json_token_t token;
+    int depth;
+
+    json_skip_whitespace(json);
+
+    switch (*json->ptr) {
+    case '"':
+        json_skip_string(l, json);
+        return;
+    case '{':
+    case '[':
+        break;
+    default:
+        json_next_token(json, &token);
+        if (token.type != T_NUMBER && token.type != T_BOOLEAN &&
+            token.type != T_NULL)
+            json_throw_parse_error(l, json, "value", &token);
+        return;
+    }
+
+    depth = 0;
+    while (1) {
+        json->ptr += strcspn(json->ptr, "\"{}[]");
+
+        switch (*json->ptr) {
+        case '"':
+            json_skip_string(l, json);
+            continue;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            if (--depth == 0) {
+                json->ptr++;
+                return;
+            }
+            break;
+        default:
+            token.type = T_END;
+            token.index = json->ptr - json->data;
+            json_throw_parse_error(l, json, "object or array end", &token);
+        }
+        json->ptr++;
+    }
+}
+
+/* Compare a JSON pointer reference token (with ~0 and ~1 escapes) to a
+ * decoded object key */
+static int json_pointer_match(const char *ref, size_t ref_len,
+                              const char *key, size_t key_len)
+{
+    const char *end = ref + ref_len;
+    char ch;
+
+    while (ref < end) {
+        ch = *ref++;
+        if (ch == '~' && ref < end) {
+            if (*ref == '0')
+                ch = '~';
+            else if (*ref == '1')
+                ch = '/';
+            ref++;
+        }
+        if (!key_len || *key != ch)
+            return 0;
+        key++;
+        key_len--;
+    }
+
+    return key_len == 0;
+}
+
+/* Convert a JSON pointer reference token to an array index.
+ * Returns -1 for anything other than a decimal number without leading
+ * zeros (including the "-" past-the-end token). */
+static int json_pointer_index(const char *ref, size_t ref_len)
+{
+    size_t i;
+    int index = 0;
+
+    if (!ref_len || ref_len > 9 || (ref[0] == '0' && ref_len > 1))
+        return -1;
+
+    for (i = 0; i < ref_len; i++) {
+        if (ref[i] < '0' || ref[i] > '9')
+            return -1;
+        index = index * 10 + ref[i] - '0';
+    }
+
+    return index;
+}
+
+/* Find the value referenced by a JSON pointer (RFC 6901) and push it on
+ * the Lua stack. Values outside the path are skipped without being
+ * decoded.
+ * Returns 1 when the value was found, otherwise 0 (nothing pushed) */
+static int json_extract_pointer(lua_State *l, json_parse_t *json,
+                                const char *pointer, size_t len)
+{
+    const char *end = pointer + len;
+    const char *ref;
+    size_t ref_len;
+    json_token_t token;
+    int index, i;
+
+    json->ptr = json->data;
+    json->current_depth = 0;
+
+    if (len && *pointer != '/') {
+        json_decode_release(json->cfg, json->tmp);
+        luaL_error(l, "Invalid JSON pointer: %s", pointer);
+    }
+
+    while (pointer < end) {
+        ref = ++pointer;
+        while (pointer < end && *pointer != '/')
+            pointer++;
+        ref_len = pointer - ref;
+
+        json_next_token(json, &token);
+        switch (token.type) {
+        case T_OBJ_BEGIN:
+            json_next_token(json, &token);
+            if (token.type == T_OBJ_END)
+                return 0;
+            while (1) {
+                if (token.type != T_STRING)
+                    json_throw_parse_error(l, json, "object key string", &token);
+                i = json_pointer_match(ref, ref_len, token.value.string,
+                                       token.string_len);
+
+                json_next_token(json, &token);
+                if (token.type != T_COLON)
+                    json_throw_parse_error(l, json, "colon", &token);
+                if (i)
+                    break;
+
+                json_skip_value(l, json);
+
+                json_next_token(json, &token);
+                if (token.type == T_OBJ_END)
+                    return 0;
+                if (token.type != T_COMMA)
+                    json_throw_parse_error(l, json, "comma or object end", &token);
+                json_next_token(json, &token);
+            }
+            break;
+        case T_ARR_BEGIN:
+            index = json_pointer_index(ref, ref_len);
+            json_skip_whitespace(json);
+            if (index < 0 || *json->ptr == ']')
+                return 0;
+            for (i = 0; i < index; i++) {
+                json_skip_value(l, json);
+
+                json_next_token(json, &token);
+                if (token.type == T_ARR_END)
+                    return 0;
+                if (token.type != T_COMMA)
+                    json_throw_parse_error(l, json, "comma or array end", &token);
+            }
+            break;
+        case T_STRING:
+        case T_NUMBER:
+        case T_BOOLEAN:
+        case T_NULL:
+            /* Cannot descend into a scalar */
+            return 0;
+        default:
+            json_throw_parse_error(l, json, "value", &token);
+        }
+    }
+
+    json_next_token(json, &token);
+    json_process_value(l, json, &token);
+
+    return 1;
+}
+
+/* Return the values referenced by one or more JSON pointers, or nil for
+ * each pointer which does not exist in the document:
+ *   value, ... = cjson.extract(json_text, pointer, ...) */
+static int json_extract(lua_State *l)
+{
+    json_parse_t json;
+    size_t json_len, len;
+    const char *pointer;
+    int i, top;
+
+    top = lua_gettop(l);
+    luaL_argcheck(l, top >= 2, 2, "expected JSON pointer");
+
+    json.cfg = json_fetch_config(l);
+    json.data = luaL_checklstring(l, 1, &json_len);
+    for (i = 2; i <= top; i++)
+        luaL_checkstring(l, i);
+    luaL_checkstack(l, top, "too many JSON pointers");
+
+    if (json_len >= 2 && (!json.data[0] || !json.data[1]))
+        luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+
+    json.tmp = json_decode_acquire(json.cfg, json_len);
+
+    for (i = 2; i <= top; i++) {
+        pointer = lua_tolstring(l, i, &len);
+        if (!json_extract_pointer(l, &json, pointer, len))
+            lua_pushnil(l);
+    }
+
+    json_decode_release(json.cfg, json.tmp);
+
+    return top - 1;
+}
+
 /* ===== INITIALISATION ===== */
 
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
@@ -1412,17 +2220,14 @@ static void compat_luaL_setfuncs(lua_State *l, const luaL_Reg *reg, int nup)
 /* Call target function in protected mode with all supplied args.
  * Assumes target function only returns a single non-nil value.
  * Convert and return thrown errors as: nil, "error message" */
-static int json_protect_conversion(lua_State *l)
+static int json_protect_call(lua_State *l)
 {
     int err;
 
-    /* Deliberately throw an error for invalid arguments */
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
-
     /* pcall() the function stored as upvalue(1) */
     lua_pushvalue(l, lua_upvalueindex(1));
     lua_insert(l, 1);
-    err = lua_pcall(l, 1, 1, 0);
+    err = lua_pcall(l, lua_gettop(l) - 1, 1, 0);
     if (!err)
         return 1;
 
@@ -1437,12 +2242,32 @@ static int json_protect_conversion(lua_State *l)
     return luaL_error(l, "Memory allocation error in CJSON protected call");
 }
 
+static int json_protect_conversion(lua_State *l)
+{
+    /* Deliberately throw an error for invalid arguments */
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    return json_protect_call(l);
+}
+
+static int json_protect_stream(lua_State *l)
+{
+    /* Deliberately throw an error for invalid arguments */
+    luaL_argcheck(l, lua_gettop(l) >= 2 && lua_gettop(l) <= 3, 1,
+                  "expected 2 or 3 arguments");
+
+    return json_protect_call(l);
+}
+
 /* Return cjson module table */
 static int lua_cjson_new(lua_State *l)
 {
     luaL_Reg reg[] = {
         { "encode", json_encode },
         { "decode", json_decode },
+        { "encode_stream", json_encode_stream },
+        { "compile_schema", json_compile_schema },
+        { "extract", json_extract },
         { "encode_empty_table_as_object", json_cfg_encode_empty_table_as_object },
         { "decode_array_with_array_mt", json_cfg_decode_array_with_array_mt },
         { "encode_sparse_array", json_cfg_encode_sparse_array },
@@ -1452,6 +2277,8 @@ static int lua_cjson_new(lua_State *l)
         { "encode_keep_buffer", json_cfg_encode_keep_buffer },
         { "encode_invalid_numbers", json_cfg_encode_invalid_numbers },
         { "decode_invalid_numbers", json_cfg_decode_invalid_numbers },
+        { "scratch_limit", json_cfg_scratch_limit },
+        { "scratch_stats", json_scratch_stats },
         { "new", lua_cjson_new },
         { NULL, NULL }
     };
@@ -1482,6 +2309,15 @@ static int lua_cjson_new(lua_State *l)
         lua_rawset(l, LUA_REGISTRYINDEX);
     }
 
+    /* Create the compiled schema metatable */
+    if (luaL_newmetatable(l, JSON_SCHEMA_MT)) {
+        lua_newtable(l);
+        lua_pushcfunction(l, json_schema_encode);
+        lua_setfield(l, -2, "encode");
+        lua_setfield(l, -2, "__index");
+    }
+    lua_pop(l, 1);
+
     /* cjson module table */
     lua_newtable(l);
 
@@ -1534,6 +2370,10 @@ static int lua_cjson_safe_new(lua_State *l)
         lua_setfield(l, -2, func[i]);
     }
 
+    lua_getfield(l, -1, "encode_stream");
+    lua_pushcclosure(l, json_protect_stream, 1);
+    lua_setfield(l, -2, "encode_stream");
+
     return 1;
 }
 
@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# Run tests/bench_suite.lua against the bundled LuaJIT, and Lua 5.1.5 when
+# it has been built (make linux in depend/lua-5.1.5).
+#
+# Results are written as JSON lines to bench-<vm>-<revision>.json. Compare
+# two runs with:
+#   cd tests; lua bench_suite.lua -c ../bench-A.json ../bench-B.json [threshold]
+#
+# Extra arguments are passed to bench_suite.lua (eg, -t 1 -r 7).
+
+DEPEND="`pwd`/../depend"
+REVISION="`git rev-parse --short HEAD 2>/dev/null || echo unknown`"
+
+set -e
+
+run_bench() {
+    NAME="$1"
+    INCLUDE="$2"
+    LUA="$3"
+    OUTPUT="`pwd`/bench-$NAME-$REVISION.json"
+    shift 3
+
+    echo "===== Benchmarking $NAME ====="
+    make clean
+    make LUA_INCLUDE_DIR="$INCLUDE"
+    make -s bench LUA="$LUA" BENCH_FLAGS="-f json $*" > "$OUTPUT"
+    make clean
+    echo "Results written to $OUTPUT"
+}
+
+LD_LIBRARY_PATH="$DEPEND/luajit/lib${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}"
+export LD_LIBRARY_PATH
+
+run_bench luajit "$DEPEND/luajit/include/luajit-2.1" \
+    "$DEPEND/luajit/bin/luajit-2.1.0-beta3" "$@"
+
+if [ -x "$DEPEND/lua-5.1.5/src/lua" ]; then
+    run_bench lua51 "$DEPEND/lua-5.1.5/src" "$DEPEND/lua-5.1.5/src/lua" "$@"
+fi
+
+# vi:ai et sw=4 ts=4:
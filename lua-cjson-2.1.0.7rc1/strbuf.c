@@ -41,15 +41,18 @@ static void die(const char *fmt, ...)
     exit(-1);
 }
 
-void strbuf_init(strbuf_t *s, int len)
+void strbuf_init(strbuf_t *s, size_t len)
 {
-    int size;
+    size_t size;
 
-    if (len <= 0)
+    if (len == 0)
         size = STRBUF_DEFAULT_SIZE;
     else
         size = len + 1;         /* \0 terminator */
 
+    if (size < len)
+        die("BUG: Invalid strbuf length requested");
+
     s->buf = NULL;
     s->size = size;
     s->length = 0;
@@ -65,7 +68,7 @@ void strbuf_init(strbuf_t *s, int len)
     strbuf_ensure_null(s);
 }
 
-strbuf_t *strbuf_new(int len)
+strbuf_t *strbuf_new(size_t len)
 {
     strbuf_t *s;
 
@@ -94,8 +97,9 @@ void strbuf_set_increment(strbuf_t *s, int increment)
 static inline void debug_stats(strbuf_t *s)
 {
     if (s->debug) {
-        fprintf(stderr, "strbuf(%lx) reallocs: %d, length: %d, size: %d\n",
-                (long)s, s->reallocs, s->length, s->size);
+        fprintf(stderr, "strbuf(%lx) reallocs: %d, length: %lu, size: %lu\n",
+                (long)s, s->reallocs, (unsigned long)s->length,
+                (unsigned long)s->size);
     }
 }
 
@@ -113,7 +117,7 @@ void strbuf_free(strbuf_t *s)
         free(s);
 }
 
-char *strbuf_free_to_string(strbuf_t *s, int *len)
+char *strbuf_free_to_string(strbuf_t *s, size_t *len)
 {
     char *buf;
 
@@ -131,28 +135,32 @@ char *strbuf_free_to_string(strbuf_t *s, int *len)
     return buf;
 }
 
-static int calculate_new_size(strbuf_t *s, int len)
+static size_t calculate_new_size(strbuf_t *s, size_t len)
 {
-    int reqsize, newsize;
-
-    if (len <= 0)
-        die("BUG: Invalid strbuf length requested");
+    size_t reqsize, newsize;
 
     /* Ensure there is room for optional NULL termination */
     reqsize = len + 1;
+    if (len == 0 || reqsize < len)
+        die("BUG: Invalid strbuf length requested");
 
     /* If the user has requested to shrink the buffer, do it exactly */
     if (s->size > reqsize)
         return reqsize;
 
-    newsize = s->size;
     if (s->increment < 0) {
-        /* Exponential sizing */
-        while (newsize < reqsize)
+        /* Exponential sizing. Round up to a power of the increment so
+         * buffers fall into a small number of allocator size classes,
+         * independent of their initial size. */
+        newsize = STRBUF_DEFAULT_SIZE;
+        while (newsize < reqsize) {
+            if (newsize > (size_t)-1 / -s->increment)
+                return reqsize;
             newsize *= -s->increment;
+        }
     } else {
         /* Linear sizing */
-        newsize = ((newsize + s->increment - 1) / s->increment) * s->increment;
+        newsize = ((reqsize + s->increment - 1) / s->increment) * s->increment;
     }
 
     return newsize;
@@ -161,15 +169,15 @@ static int calculate_new_size(strbuf_t *s, int len)
 
 /* Ensure strbuf can handle a string length bytes long (ignoring NULL
  * optional termination). */
-void strbuf_resize(strbuf_t *s, int len)
+void strbuf_resize(strbuf_t *s, size_t len)
 {
-    int newsize;
+    size_t newsize;
 
     newsize = calculate_new_size(s, len);
 
     if (s->debug > 1) {
-        fprintf(stderr, "strbuf(%lx) resize: %d => %d\n",
-                (long)s, s->size, newsize);
+        fprintf(stderr, "strbuf(%lx) resize: %lu => %lu\n",
+                (long)s, (unsigned long)s->size, (unsigned long)newsize);
     }
 
     s->size = newsize;
@@ -181,7 +189,7 @@ void strbuf_resize(strbuf_t *s, int len)
 
 void strbuf_append_string(strbuf_t *s, const char *str)
 {
-    int space, i;
+    size_t space, i;
 
     space = strbuf_empty_length(s);
 
@@ -199,7 +207,7 @@ void strbuf_append_string(strbuf_t *s, const char *str)
 
 /* strbuf_append_fmt() should only be used when an upper bound
  * is known for the output string. */
-void strbuf_append_fmt(strbuf_t *s, int len, const char *fmt, ...)
+void strbuf_append_fmt(strbuf_t *s, size_t len, const char *fmt, ...)
 {
     va_list arg;
     int fmt_len;
@@ -222,7 +230,7 @@ void strbuf_append_fmt_retry(strbuf_t *s, const char *fmt, ...)
 {
     va_list arg;
     int fmt_len, try;
-    int empty_len;
+    size_t empty_len;
 
     /* If the first attempt to append fails, resize the buffer appropriately
      * and try again */
@@ -236,7 +244,9 @@ void strbuf_append_fmt_retry(strbuf_t *s, const char *fmt, ...)
         fmt_len = vsnprintf(s->buf + s->length, empty_len + 1, fmt, arg);
         va_end(arg);
 
-        if (fmt_len <= empty_len)
+        if (fmt_len < 0)
+            die("BUG: Unable to format string");
+        if ((size_t)fmt_len <= empty_len)
             break;  /* SUCCESS */
         if (try > 0)
             die("BUG: length of formatted string changed");
@@ -0,0 +1,261 @@
+#!/usr/bin/env lua
+
+-- Lua CJSON benchmark suite
+--
+-- Measures encode and decode throughput over a set of generated corpora
+-- (and optionally any JSON files given on the command line). Results are
+-- printed as tab separated values or JSON lines so runs from different
+-- commits can be compared with "-c".
+--
+-- Usage:
+--   bench_suite.lua [-t seconds] [-r repeat] [-f tsv|json] [file.json ...]
+--   bench_suite.lua -c baseline.json current.json [threshold_percent]
+--
+-- This script measures elapsed time and should be run on an unloaded
+-- system. Corpora are generated from a fixed seed, so results are
+-- comparable between runs on the same machine.
+
+local json_module = os.getenv("JSON_MODULE") or "cjson"
+
+local json = require(json_module)
+local util = require "cjson.util"
+
+-- Prefer microsecond resolution wall clock time when LuaSocket is
+-- available, otherwise fall back to CPU time.
+local gettime, timer_name
+do
+    local ok, socket = pcall(require, "socket")
+    if ok and socket.gettime then
+        gettime, timer_name = socket.gettime, "socket.gettime"
+    else
+        gettime, timer_name = os.clock, "os.clock"
+    end
+end
+
+-- Deterministic pseudo random numbers (LCG), independent of the
+-- math.random() implementation of the Lua VM being benchmarked.
+local function rng(seed)
+    local state = seed
+    return function (lo, hi)
+        state = (state * 1103515245 + 12345) % 2147483648
+        return lo + state % (hi - lo + 1)
+    end
+end
+
+local corpora = {}
+
+-- Mixed length strings including escapes and UTF-8 multibyte sequences
+corpora.strings = function ()
+    local rand = rng(1)
+    local pieces = { "lorem ", "ipsum ", "dolor ", "\"quoted\" ", "line\n",
+                     "tab\t", "path/to/file ", "\195\169t\195\169 ", "\226\130\172 " }
+    local data = {}
+    for i = 1, 2000 do
+        local s = {}
+        for j = 1, rand(1, 30) do
+            s[j] = pieces[rand(1, #pieces)]
+        end
+        data[i] = table.concat(s)
+    end
+    return data
+end
+
+-- Integers, fractions and exponents
+corpora.numbers = function ()
+    local rand = rng(2)
+    local data = {}
+    for i = 1, 10000 do
+        local kind = rand(1, 3)
+        if kind == 1 then
+            data[i] = rand(-1000000, 1000000)
+        elseif kind == 2 then
+            data[i] = rand(-1000000, 1000000) / rand(1, 1000)
+        else
+            data[i] = rand(1, 9999) * 10 ^ rand(-30, 30)
+        end
+    end
+    return data
+end
+
+-- Alternating arrays and objects nested below the default depth limits
+corpora.deep_nesting = function ()
+    local data = {}
+    for i = 1, 100 do
+        local node = "leaf"
+        for depth = 1, 400 do
+            if depth % 2 == 0 then
+                node = { node, depth }
+            else
+                node = { child = node, depth = depth }
+            end
+        end
+        data[i] = node
+    end
+    return data
+end
+
+-- A single object with many keys
+corpora.wide_object = function ()
+    local rand = rng(4)
+    local data = {}
+    for i = 1, 10000 do
+        data["key_" .. i .. "_" .. rand(0, 99999)] = rand(0, 1) == 1 and i or "v" .. i
+    end
+    return data
+end
+
+-- A long array of small records
+corpora.large_array = function ()
+    local rand = rng(5)
+    local data = {}
+    for i = 1, 20000 do
+        data[i] = { id = i, name = "user" .. rand(0, 99999),
+                    active = rand(0, 1) == 1, score = rand(0, 10000) / 100,
+                    tags = { "a", "b" } }
+    end
+    return data
+end
+
+local corpus_order = { "strings", "numbers", "deep_nesting", "wide_object",
+                       "large_array" }
+
+-- Return the median rate (calls per second) over "rep" runs of roughly
+-- "seconds" each.
+local function benchmark(func, seconds, rep)
+    local function bench(iter)
+        local t = gettime()
+        for i = 1, iter do
+            func()
+        end
+        return gettime() - t
+    end
+
+    -- Warm up and calculate the iterations required for each run
+    local iter, elapsed = 1, bench(1)
+    while elapsed < seconds / 10 do
+        iter = iter * 2
+        elapsed = bench(iter)
+    end
+    iter = math.max(1, math.ceil(iter * seconds / elapsed))
+
+    local rates = {}
+    for i = 1, rep do
+        rates[i] = iter / bench(iter)
+    end
+    table.sort(rates)
+
+    return rates[math.floor(rep / 2) + 1]
+end
+
+local function run_suite(opts)
+    local cases = {}
+    for _, name in ipairs(corpus_order) do
+        cases[#cases + 1] = { name = name, value = corpora[name]() }
+    end
+    for _, filename in ipairs(opts.files) do
+        cases[#cases + 1] = { name = filename,
+                              value = json.decode(util.file_load(filename)) }
+    end
+
+    local results = {}
+    for _, case in ipairs(cases) do
+        local text = json.encode(case.value)
+        local value = case.value
+        local ops = {
+            { "encode", function () json.encode(value) end },
+            { "decode", function () json.decode(text) end },
+        }
+        for _, op in ipairs(ops) do
+            collectgarbage()
+            local rate = benchmark(op[2], opts.seconds, opts.rep)
+            results[#results + 1] = {
+                corpus = case.name, op = op[1], bytes = #text,
+                ops_per_sec = rate, mb_per_sec = rate * #text / 1048576
+            }
+        end
+    end
+
+    return results
+end
+
+local function print_results(results, format)
+    local vm = jit and jit.version or _VERSION
+
+    if format == "json" then
+        for _, r in ipairs(results) do
+            r.vm, r.module, r.version, r.timer = vm, json_module, json._VERSION, timer_name
+            print(json.encode(r))
+        end
+        return
+    end
+
+    print(("# %s %s, %s, timer: %s"):format(json_module, json._VERSION, vm, timer_name))
+    print("corpus\top\tbytes\tops_per_sec\tmb_per_sec")
+    for _, r in ipairs(results) do
+        print(("%s\t%s\t%d\t%.1f\t%.2f"):format(r.corpus, r.op, r.bytes,
+                                               r.ops_per_sec, r.mb_per_sec))
+    end
+end
+
+-- Compare two sets of JSON line results. Returns false when any result
+-- is slower than the baseline by more than threshold percent.
+local function compare(baseline_file, current_file, threshold)
+    local function load(filename)
+        local results = {}
+        for line in io.lines(filename) do
+            local r = json.decode(line)
+            results[r.corpus .. "\t" .. r.op] = r
+        end
+        return results
+    end
+
+    local baseline, current = load(baseline_file), load(current_file)
+    local keys, ok = {}, true
+    for k in pairs(current) do keys[#keys + 1] = k end
+    table.sort(keys)
+
+    print("corpus\top\tbaseline_ops\tcurrent_ops\tchange_pct")
+    for _, k in ipairs(keys) do
+        local old, new = baseline[k], current[k]
+        if old then
+            local change = (new.ops_per_sec / old.ops_per_sec - 1) * 100
+            local flag = ""
+            if change < -threshold then
+                flag, ok = "\tREGRESSION", false
+            end
+            print(("%s\t%.1f\t%.1f\t%+.1f%s"):format(k, old.ops_per_sec,
+                                                    new.ops_per_sec, change, flag))
+        end
+    end
+
+    return ok
+end
+
+local opts = { seconds = 0.5, rep = 5, format = "tsv", files = {} }
+local i = 1
+while i <= #arg do
+    local a = arg[i]
+    if a == "-t" then
+        opts.seconds = assert(tonumber(arg[i + 1]), "-t requires seconds")
+        i = i + 1
+    elseif a == "-r" then
+        opts.rep = assert(tonumber(arg[i + 1]), "-r requires a count")
+        i = i + 1
+    elseif a == "-f" then
+        opts.format = arg[i + 1]
+        i = i + 1
+    elseif a == "-c" then
+        local threshold = tonumber(arg[i + 3]) or 5
+        if not compare(arg[i + 1], arg[i + 2], threshold) then
+            os.exit(1)
+        end
+        os.exit(0)
+    else
+        opts.files[#opts.files + 1] = a
+    end
+    i = i + 1
+end
+
+print_results(run_suite(opts), opts.format)
+
+-- vi:ai et sw=4 ts=4:
@@ -390,6 +390,108 @@ local cjson_tests = {
       function (...) return json.encode_sparse_array(...) end, { },
       true, { false, 2, 10 } },
 
+    -- Test streaming encoder
+    { "Encode stream into table",
+      function ()
+          local chunks = {}
+          local total = json.encode_stream({ 1, 2, "three", { a = true } }, chunks, 4)
+          return total, #chunks, table.concat(chunks)
+      end, { }, true, { 24, 6, '[1,2,"three",{"a":true}]' } },
+    { "Encode stream appends to existing table",
+      function ()
+          local chunks = { "HTTP body: " }
+          json.encode_stream("streamed", chunks)
+          return table.concat(chunks)
+      end, { }, true, { 'HTTP body: "streamed"' } },
+    { "Encode stream into function",
+      function ()
+          local sizes, out = {}, {}
+          local data = { string.rep("x", 20), string.rep("y", 20) }
+          json.encode_stream(data, function (chunk)
+              sizes[#sizes + 1] = #chunk
+              out[#out + 1] = chunk
+          end, 16)
+          return table.concat(sizes, ","), table.concat(out) == json.encode(data)
+      end, { }, true, { "16,16,15", true } },
+    { "Encode stream with sink error [throw error]",
+      json.encode_stream, { { "data" }, function () error("sink failed", 0) end, 1 },
+      false, { "sink failed" } },
+    { "Encode stream with invalid sink [throw error]",
+      json.encode_stream, { { "data" }, "sink" },
+      false, { "bad argument #2 to '?' (expected function or table)" } },
+    { "Encode stream with huge chunk size [throw error]",
+      json.encode_stream, { { "data" }, { }, 2^40 },
+      false, { "bad argument #3 to '?' (expected positive chunk size)" } },
+
+    -- Test schema encoding
+    { "Encode with compiled schema",
+      function ()
+          local item = json.compile_schema{ { "sku", "string" }, { "qty", "number" } }
+          local order = json.compile_schema{
+              { "id", "number" }, "note", { "paid", "boolean" },
+              { "tags", "array" }, { "items", "array", item } }
+          return order:encode{ id = 7, paid = true, tags = { "a", "b" },
+                               items = { { sku = "x\"y", qty = 2 } },
+                               ignored = "not in schema" }
+      end, { }, true, { '{"id":7,"paid":true,"tags":["a","b"],"items":[{"sku":"x\\\"y","qty":2}]}' } },
+    { "Encode with compiled schema falls back on type mismatch",
+      function ()
+          local schema = json.compile_schema{ { "id", "number" }, { "name", "string" } }
+          return schema:encode{ id = "abc", name = json.null }
+      end, { }, true, { '{"id":"abc","name":null}' } },
+    { "Encode with compiled schema falls back on non-array tables",
+      function ()
+          local item = json.compile_schema{ { "sku", "string" } }
+          local schema = json.compile_schema{ { "tags", "array" }, { "items", "array", item } }
+          return schema:encode{ tags = { a = 1 } }, schema:encode{ tags = { [1.5] = "a" } },
+                 schema:encode{ tags = { [1] = "a", [3] = "c" }, items = { sku = "x" } }
+      end, { }, true, { '{"tags":{"a":1}}', '{"tags":{"1.5":"a"}}',
+                        '{"tags":["a",null,"c"],"items":{"sku":"x"}}' } },
+    { "Compile schema with invalid field type [throw error]",
+      json.compile_schema, { { { "id", "integer" } } },
+      false, { "Cannot compile schema field 1: invalid field type" } },
+    { "Compile schema with invalid nested schema [throw error]",
+      json.compile_schema, { { "id", { "user", {} } } },
+      false, { "Cannot compile schema field 2: expected a compiled schema" } },
+
+    -- Test JSON pointer extraction
+    { "Extract values by JSON pointer",
+      json.extract, { '{ "skip": { "s": "}]\\"", "n": [[1], {}] }, "user": { "id": 42, ' ..
+                      '"tags": [ "a", "b" ] }, "a/b": true, "m~n": null }',
+                      "/user/id", "/user/tags/1", "/a~1b", "/m~0n" },
+      true, { 42, "b", true, json.null } },
+    { "Extract missing values",
+      json.extract, { '{ "list": [ 1, 2 ], "num": 3 }',
+                      "/nope", "/list/2", "/list/-", "/list/01", "/num/x" },
+      true, { nil, nil, nil, nil, nil } },
+    { "Extract whole document",
+      json.extract, { '[ 1, { "a": "b" } ]', "" },
+      true, { { 1, { a = "b" } } } },
+    { "Extract from truncated document [throw error]",
+      json.extract, { '{ "a": [ 1, 2', "/b" },
+      false, { "Expected object or array end but found T_END at character 14" } },
+    { "Extract with invalid JSON pointer [throw error]",
+      json.extract, { '{ "a": 1 }', "a" },
+      false, { "Invalid JSON pointer: a" } },
+
+    -- Test scratch buffer limits
+    { "Set scratch_limit(4096)",
+      function (...) return json.scratch_limit(...) end, { 4096 }, true, { 4096 } },
+    { "Encode and decode beyond scratch limit",
+      function ()
+          local trims = json.scratch_stats().trims
+          local text = json.encode({ string.rep("x", 8192) })
+          local value = json.decode(text)
+          local stats = json.scratch_stats()
+          return #value[1], stats.trims - trims,
+                 stats.encode_size <= 4096, stats.decode_size <= 4096
+      end, { }, true, { 8192, 2, true, true } },
+    { "Set scratch_limit(-1) [throw error]",
+      json.scratch_limit, { -1 },
+      false, { "bad argument #1 to '?' (expected integer between 0 and 2147483647)" } },
+    { "Set scratch_limit(1048576)",
+      function (...) return json.scratch_limit(...) end, { 1048576 }, true, { 1048576 } },
+
     { "Encode (safe) simple value",
       json_safe.encode, { true },
       true, { "true" } },
@@ -399,6 +501,17 @@ local cjson_tests = {
     { "Decode (safe) error generation",
       json_safe.decode, { "Oops" },
       true, { nil, "Expected value but found invalid token at character 1" } },
+    { "Encode stream (safe) into table",
+      function ()
+          local chunks = {}
+          return json_safe.encode_stream({ 1, 2 }, chunks), table.concat(chunks)
+      end, { }, true, { 5, "[1,2]" } },
+    { "Encode stream (safe) error generation",
+      json_safe.encode_stream, { { "data" }, function () error("sink failed", 0) end, 1 },
+      true, { nil, "sink failed" } },
+    { "Encode stream (safe) argument validation [throw error]",
+      json_safe.encode_stream, { { "data" } },
+      false, { "bad argument #1 to '?' (expected 2 or 3 arguments)" } },
     { "Decode (safe) error generation after new()",
       function(...) return json_safe.new().decode(...) end, { "Oops" },
       true, { nil, "Expected value but found invalid token at character 1" } },
@@ -0,0 +1,559 @@
+/*
+** Copyright (C) 2016-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+#ifdef _WIN32
+#include <process.h>
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#define MAXTHREADS 64 /* Maximum number of worker threads */
+#define DEFTHREADS 4 /* Default number of worker threads */
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef HANDLE Thread;
+#define mutexInit(m) InitializeCriticalSection(m)
+#define mutexDestroy(m) DeleteCriticalSection(m)
+#define mutexLock(m) EnterCriticalSection(m)
+#define mutexUnlock(m) LeaveCriticalSection(m)
+#define condInit(c) InitializeConditionVariable(c)
+#define condDestroy(c) (void)(c)
+#define condSignal(c) WakeConditionVariable(c)
+#define condBroadcast(c) WakeAllConditionVariable(c)
+#define WORKER unsigned __stdcall
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+typedef pthread_t Thread;
+#define mutexInit(m) pthread_mutex_init(m, 0)
+#define mutexDestroy(m) pthread_mutex_destroy(m)
+#define mutexLock(m) pthread_mutex_lock(m)
+#define mutexUnlock(m) pthread_mutex_unlock(m)
+#define condInit(c) pthread_cond_init(c, 0)
+#define condDestroy(c) pthread_cond_destroy(c)
+#define condSignal(c) pthread_cond_signal(c)
+#define condBroadcast(c) pthread_cond_broadcast(c)
+#define WORKER void *
+#endif
+
+typedef enum {
+	OP_COMMAND,
+	OP_COUNT,
+	OP_FIND,
+	OP_INSERT,
+	OP_REMOVE,
+	OP_UPDATE
+} OpKind;
+
+typedef struct Executor Executor;
+
+typedef struct Operation {
+	struct Operation *next; /* Next operation in queue */
+	Executor *executor;
+	int refs; /* References from Lua handle and queue/worker */
+	OpKind kind;
+	bool done, status;
+	char *dbname, *collname;
+	bson_t *query, *update, *options; /* Query, command or document; update; options */
+	mongoc_read_prefs_t *prefs;
+	int flags;
+	bson_t reply; /* Reply, count or found documents as an array (when done) */
+	bson_error_t error;
+} Operation;
+
+struct Executor {
+	Mutex mutex; /* Guards everything below and the state of operations */
+	Cond work; /* Signalled when an operation is queued or on shutdown */
+	Cond done; /* Broadcast when an operation is completed */
+	Operation *head, *tail; /* Queue of pending operations */
+	int refs; /* References from Lua handle and operations */
+	bool stop;
+	mongoc_client_pool_t *pool;
+	Thread threads[MAXTHREADS];
+	int nthreads;
+	int fd[2]; /* Completion notification pipe, -1 if unavailable */
+};
+
+/* Waits on 'cond' for at most 'timeout' seconds (forever if negative) */
+static void condWait(Cond *cond, Mutex *mutex, double timeout) {
+#ifdef _WIN32
+	SleepConditionVariableCS(cond, mutex, timeout < 0 ? INFINITE : (DWORD)(timeout * 1e3));
+#else
+	struct timeval tv;
+	struct timespec ts;
+	double t;
+	if (timeout < 0) {
+		pthread_cond_wait(cond, mutex);
+		return;
+	}
+	gettimeofday(&tv, 0);
+	t = tv.tv_sec + tv.tv_usec * 1e-6 + timeout;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
+
+static void notify(Executor *executor) {
+#ifndef _WIN32
+	ssize_t n;
+	if (executor->fd[1] == -1) return;
+	do n = write(executor->fd[1], "", 1); /* Pipe may be full, which is fine */
+	while (n == -1 && errno == EINTR);
+#else
+	(void)executor;
+#endif
+}
+
+static void releaseExecutor(Executor *executor) {
+	bool last;
+	mutexLock(&executor->mutex);
+	last = !--executor->refs;
+	mutexUnlock(&executor->mutex);
+	if (!last) return;
+	condDestroy(&executor->work);
+	condDestroy(&executor->done);
+	mutexDestroy(&executor->mutex);
+	bson_free(executor);
+}
+
+static void destroyOperation(Operation *op) {
+	Executor *executor = op->executor;
+	bson_free(op->dbname);
+	bson_free(op->collname);
+	if (op->query) bson_destroy(op->query);
+	if (op->update) bson_destroy(op->update);
+	if (op->options) bson_destroy(op->options);
+	if (op->prefs) mongoc_read_prefs_destroy(op->prefs);
+	if (op->done) bson_destroy(&op->reply);
+	bson_free(op);
+	releaseExecutor(executor);
+}
+
+/* Worker side */
+
+static void runOperation(mongoc_client_t *client, Operation *op) {
+	mongoc_collection_t *collection = 0;
+	if (op->collname) collection = mongoc_client_get_collection(client, op->dbname, op->collname);
+	bson_init(&op->reply);
+	switch (op->kind) {
+		case OP_COMMAND:
+			bson_destroy(&op->reply); /* Initialized by the call */
+			op->status = mongoc_client_command_with_opts(client, op->dbname, op->query, op->prefs, op->options, &op->reply, &op->error);
+			break;
+		case OP_COUNT: {
+			int64_t n = mongoc_collection_count_documents(collection, op->query, op->options, op->prefs, 0, &op->error);
+			op->status = n != -1;
+			if (op->status) BSON_APPEND_INT64(&op->reply, "n", n);
+			break;
+		}
+		case OP_FIND: {
+			mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(collection, op->query, op->options, op->prefs);
+			const bson_t *bson;
+			uint32_t i = 0;
+			while (mongoc_cursor_next(cursor, &bson)) {
+				char buf[16];
+				const char *key;
+				size_t klen = bson_uint32_to_string(i++, &key, buf, sizeof buf);
+				bson_append_document(&op->reply, key, klen, bson);
+			}
+			op->status = !mongoc_cursor_error(cursor, &op->error);
+			mongoc_cursor_destroy(cursor);
+			break;
+		}
+		case OP_INSERT:
+			op->status = mongoc_collection_insert(collection, op->flags, op->query, 0, &op->error);
+			break;
+		case OP_REMOVE:
+			op->status = mongoc_collection_remove(collection, op->flags, op->query, 0, &op->error);
+			break;
+		case OP_UPDATE:
+			op->status = mongoc_collection_update(collection, op->flags, op->query, op->update, 0, &op->error);
+			break;
+	}
+	if (collection) mongoc_collection_destroy(collection);
+}
+
+static void completeOperation(Executor *executor, Operation *op) {
+	bool last;
+	mutexLock(&executor->mutex);
+	op->done = true;
+	last = !--op->refs;
+	condBroadcast(&executor->done);
+	mutexUnlock(&executor->mutex);
+	notify(executor);
+	if (last) destroyOperation(op);
+}
+
+static WORKER worker(void *arg) {
+	Executor *executor = arg;
+	mongoc_client_t *client = mongoc_client_pool_pop(executor->pool); /* Owned by this worker */
+	for (;;) {
+		Operation *op;
+		mutexLock(&executor->mutex);
+		while (!executor->head && !executor->stop) condWait(&executor->work, &executor->mutex, -1);
+		if (executor->stop) {
+			mutexUnlock(&executor->mutex);
+			break;
+		}
+		op = executor->head;
+		executor->head = op->next;
+		if (!executor->head) executor->tail = 0;
+		mutexUnlock(&executor->mutex);
+		runOperation(client, op);
+		completeOperation(executor, op);
+	}
+	mongoc_client_pool_push(executor->pool, client);
+	return 0;
+}
+
+static bool startWorker(Executor *executor) {
+	Thread *thread = &executor->threads[executor->nthreads];
+#ifdef _WIN32
+	*thread = (HANDLE)_beginthreadex(0, 0, worker, executor, 0, 0);
+	if (!*thread) return false;
+#else
+	if (pthread_create(thread, 0, worker, executor)) return false;
+#endif
+	++executor->nthreads;
+	return true;
+}
+
+static void stopWorkers(Executor *executor) {
+	Operation *op, *dead = 0;
+	int i;
+	mutexLock(&executor->mutex);
+	executor->stop = true;
+	while ((op = executor->head)) { /* Cancel pending operations */
+		executor->head = op->next;
+		bson_init(&op->reply);
+		bson_set_error(&op->error, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NOT_READY, "client is closed");
+		op->done = true;
+		if (!--op->refs) {
+			op->next = dead;
+			dead = op;
+		}
+	}
+	executor->tail = 0;
+	condBroadcast(&executor->work);
+	condBroadcast(&executor->done);
+	mutexUnlock(&executor->mutex);
+	while ((op = dead)) {
+		dead = op->next;
+		destroyOperation(op);
+	}
+	for (i = 0; i < executor->nthreads; ++i) { /* Running operations are completed */
+#ifdef _WIN32
+		WaitForSingleObject(executor->threads[i], INFINITE);
+		CloseHandle(executor->threads[i]);
+#else
+		pthread_join(executor->threads[i], 0);
+#endif
+	}
+	executor->nthreads = 0;
+}
+
+/* Operation */
+
+static Operation *checkOperation(lua_State *L, int idx) {
+	return *(Operation **)luaL_checkudata(L, idx, TYPE_ASYNCOPERATION);
+}
+
+static bool isDone(Operation *op) {
+	bool done;
+	mutexLock(&op->executor->mutex);
+	done = op->done;
+	mutexUnlock(&op->executor->mutex);
+	return done;
+}
+
+static int pushResult(lua_State *L, Operation *op) {
+	bson_iter_t iter;
+	int i = 0;
+	if (!op->status) return commandError(L, &op->error);
+	switch (op->kind) {
+		case OP_COMMAND:
+			pushBSON(L, &op->reply, 0);
+			break;
+		case OP_COUNT:
+			check(L, bson_iter_init_find(&iter, &op->reply, "n"));
+			pushInt64(L, bson_iter_int64(&iter));
+			break;
+		case OP_FIND:
+			check(L, bson_iter_init(&iter, &op->reply));
+			lua_createtable(L, bson_count_keys(&op->reply), 0);
+			while (bson_iter_next(&iter)) {
+				const uint8_t *data;
+				uint32_t len;
+				bson_t bson;
+				bson_iter_document(&iter, &len, &data);
+				check(L, bson_init_static(&bson, data, len));
+				pushBSON(L, &bson, 0);
+				lua_rawseti(L, -2, ++i);
+			}
+			break;
+		default:
+			lua_pushboolean(L, 1);
+			break;
+	}
+	return 1;
+}
+
+static int op_done(lua_State *L) {
+	lua_pushboolean(L, isDone(checkOperation(L, 1)));
+	return 1;
+}
+
+static int op_wait(lua_State *L) {
+	Operation *op = checkOperation(L, 1);
+	Executor *executor = op->executor;
+	double timeout = luaL_optnumber(L, 2, -1);
+	int64_t deadline = bson_get_monotonic_time() + (int64_t)(timeout * 1e6);
+	bool done;
+	mutexLock(&executor->mutex);
+	while (!(done = op->done)) {
+		double left = (deadline - bson_get_monotonic_time()) * 1e-6;
+		if (timeout < 0) left = -1;
+		else if (left <= 0) break;
+		condWait(&executor->done, &executor->mutex, left);
+	}
+	mutexUnlock(&executor->mutex);
+	if (!done) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+	return pushResult(L, op);
+}
+
+static int op__gc(lua_State *L) {
+	Operation *op = checkOperation(L, 1);
+	bool last;
+	mutexLock(&op->executor->mutex);
+	last = !--op->refs;
+	mutexUnlock(&op->executor->mutex);
+	if (last) destroyOperation(op);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg opfuncs[] = {
+	{"done", op_done},
+	{"wait", op_wait},
+	{"__gc", op__gc},
+	{0, 0}
+};
+
+/* Client */
+
+static Executor *checkExecutor(lua_State *L, int idx) {
+	return *(Executor **)luaL_checkudata(L, idx, TYPE_ASYNCCLIENT);
+}
+
+static Operation *newOperation(Executor *executor, OpKind kind, const char *dbname, const char *collname) {
+	Operation *op = bson_malloc0(sizeof *op);
+	op->executor = executor;
+	op->refs = 2;
+	op->kind = kind;
+	op->dbname = bson_strdup(dbname);
+	op->collname = bson_strdup(collname);
+	return op;
+}
+
+static int submit(lua_State *L, Executor *executor, Operation *op) {
+	mutexLock(&executor->mutex);
+	++executor->refs;
+	if (executor->tail) executor->tail->next = op;
+	else executor->head = op;
+	executor->tail = op;
+	condSignal(&executor->work);
+	mutexUnlock(&executor->mutex);
+	pushHandle(L, op, 0, 1);
+	setType(L, TYPE_ASYNCOPERATION, opfuncs);
+	return 1;
+}
+
+static int m_command(lua_State *L) {
+	Executor *executor = checkExecutor(L, 1);
+	const char *dbname = luaL_checkstring(L, 2);
+	bson_t *command = castBSON(L, 3);
+	bson_t *options = toBSON(L, 4);
+	mongoc_read_prefs_t *prefs = toReadPrefs(L, 5);
+	Operation *op = newOperation(executor, OP_COMMAND, dbname, 0);
+	op->query = bson_copy(command);
+	if (options) op->options = bson_copy(options);
+	if (prefs) op->prefs = mongoc_read_prefs_copy(prefs);
+	return submit(L, executor, op);
+}
+
+static int query(lua_State *L, OpKind kind) {
+	Executor *executor = checkExecutor(L, 1);
+	const char *dbname = luaL_checkstring(L, 2);
+	const char *collname = luaL_checkstring(L, 3);
+	bson_t *query = castBSON(L, 4);
+	bson_t *options = toBSON(L, 5);
+	mongoc_read_prefs_t *prefs = toReadPrefs(L, 6);
+	Operation *op = newOperation(executor, kind, dbname, collname);
+	op->query = bson_copy(query);
+	if (options) op->options = bson_copy(options);
+	if (prefs) op->prefs = mongoc_read_prefs_copy(prefs);
+	return submit(L, executor, op);
+}
+
+static int m_count(lua_State *L) {
+	return query(L, OP_COUNT);
+}
+
+static int m_find(lua_State *L) {
+	return query(L, OP_FIND);
+}
+
+static int m_insert(lua_State *L) {
+	Executor *executor = checkExecutor(L, 1);
+	const char *dbname = luaL_checkstring(L, 2);
+	const char *collname = luaL_checkstring(L, 3);
+	int flags = toInsertFlags(L, 5);
+	bson_t *document = castScratchBSON(L, 4);
+	Operation *op = newOperation(executor, OP_INSERT, dbname, collname);
+	op->query = bson_copy(document);
+	op->flags = flags;
+	return submit(L, executor, op);
+}
+
+static int m_remove(lua_State *L) {
+	Executor *executor = checkExecutor(L, 1);
+	const char *dbname = luaL_checkstring(L, 2);
+	const char *collname = luaL_checkstring(L, 3);
+	bson_t *query = castBSON(L, 4);
+	int flags = toRemoveFlags(L, 5);
+	Operation *op = newOperation(executor, OP_REMOVE, dbname, collname);
+	op->query = bson_copy(query);
+	op->flags = flags;
+	return submit(L, executor, op);
+}
+
+static int m_update(lua_State *L) {
+	Executor *executor = checkExecutor(L, 1);
+	const char *dbname = luaL_checkstring(L, 2);
+	const char *collname = luaL_checkstring(L, 3);
+	bson_t *query = castBSON(L, 4);
+	bson_t *update = castBSON(L, 5);
+	int flags = toUpdateFlags(L, 6);
+	Operation *op = newOperation(executor, OP_UPDATE, dbname, collname);
+	op->query = bson_copy(query);
+	op->update = bson_copy(update);
+	op->flags = flags;
+	return submit(L, executor, op);
+}
+
+static int m_fd(lua_State *L) {
+	Executor *executor = checkExecutor(L, 1);
+	if (executor->fd[0] == -1) return 0;
+	lua_pushinteger(L, executor->fd[0]);
+	return 1;
+}
+
+static int m_drain(lua_State *L) {
+	Executor *executor = checkExecutor(L, 1);
+	lua_Integer n = 0;
+#ifndef _WIN32
+	char buf[256];
+	ssize_t r;
+	while ((r = read(executor->fd[0], buf, sizeof buf)) > 0 || (r == -1 && errno == EINTR)) {
+		if (r > 0) n += r;
+	}
+#endif
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	Executor *executor = checkExecutor(L, 1);
+	stopWorkers(executor);
+	mongoc_client_pool_destroy(executor->pool);
+#ifndef _WIN32
+	if (executor->fd[0] != -1) {
+		close(executor->fd[0]);
+		close(executor->fd[1]);
+	}
+#endif
+	releaseExecutor(executor);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"command", m_command},
+	{"count", m_count},
+	{"drain", m_drain},
+	{"fd", m_fd},
+	{"find", m_find},
+	{"insert", m_insert},
+	{"remove", m_remove},
+	{"update", m_update},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+int newAsyncClient(lua_State *L) {
+	const char *str = luaL_checkstring(L, 1);
+	int i, nthreads = luaL_optinteger(L, 2, DEFTHREADS);
+	mongoc_uri_t *uri;
+	mongoc_client_pool_t *pool;
+	Executor *executor;
+	argCheck(L, nthreads >= 1 && nthreads <= MAXTHREADS, 2, "value must be in the range 1..%d", MAXTHREADS);
+	uri = mongoc_uri_new(str);
+	luaL_argcheck(L, uri, 1, "invalid format");
+	pool = mongoc_client_pool_new(uri);
+	mongoc_uri_destroy(uri);
+	luaL_argcheck(L, pool, 1, "invalid format");
+	executor = bson_malloc0(sizeof *executor);
+	mutexInit(&executor->mutex);
+	condInit(&executor->work);
+	condInit(&executor->done);
+	executor->refs = 1;
+	executor->pool = pool;
+	executor->fd[0] = executor->fd[1] = -1;
+#ifndef _WIN32
+	if (!pipe(executor->fd)) {
+		for (i = 0; i < 2; ++i) {
+			fcntl(executor->fd[i], F_SETFL, fcntl(executor->fd[i], F_GETFL) | O_NONBLOCK);
+			fcntl(executor->fd[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+#endif
+	pushHandle(L, executor, 0, 0);
+	setType(L, TYPE_ASYNCCLIENT, funcs); /* Stops workers on error */
+	for (i = 0; i < nthreads; ++i) {
+		if (!startWorker(executor)) return luaL_error(L, "cannot create worker thread");
+	}
+	return 1;
+}
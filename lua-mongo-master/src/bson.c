@@ -23,8 +23,46 @@
 #include "common.h"
 
 #define MAXSTACK 1000 /* Arbitrary stack size limit to check for recursion */
+#define MAXDEPTH 32 /* Nesting depth beyond which tables are checked for circular references */
+#define MAXJSONBUFFER 0x100000 /* Largest JSON output buffer kept for reuse */
 #define isInt32(i) ((i) >= INT32_MIN && (i) <= INT32_MAX)
 
+static char SCRATCH_BSON; /* Registry key of the scratch document of castScratchBSON() */
+static char LAZY_PARENT; /* Cache key of the parent of a nested lazy document */
+static char DATETIME_FORMAT; /* Registry key of the DateTime decoding settings */
+static char JSON_BUFFER; /* Registry key of the output buffer of pushJSON() */
+
+enum { DATETIME_RAW, DATETIME_OBJECT, DATETIME_ISO, DATETIME_LOCAL };
+
+static const char *const dateTimeFormats[] = {"raw", "object", "iso", "local", 0};
+
+static const char DIGITS[] = /* Two-digit numbers 00..99 */
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+typedef struct DateTimeFormat {
+	int format;
+	int64_t day; /* Day (since epoch) of the cached date */
+	size_t dlen; /* Length of the cached date (0 if none) */
+	char date[32]; /* ISO-8601 date 'YYYY-MM-DDT' */
+} DateTimeFormat;
+
+typedef struct LazyBSON {
+	const uint8_t *data; /* Owned by the root document */
+	uint32_t len;
+	bool array;
+	lua_Integer size; /* Array length (-1 if not counted yet) */
+	lua_Integer pos; /* Last array element accessed (0 if none) */
+	uint32_t off, klen; /* Offset and key length of that element */
+} LazyBSON;
+
+typedef struct LazyIterator {
+	uint32_t off, klen; /* Offset and key length of the current field (0 if not started) */
+	lua_Integer n; /* Array elements passed */
+	bool done;
+} LazyIterator;
+
 static void
 format_timestamp(time_t tmDaypoint, char *chFormat, size_t *outLen, struct tm *outTp)
 {
@@ -50,6 +88,320 @@ format_timestamp(time_t tmDaypoint, char *chFormat, size_t *outLen, struct tm *o
 	}
 }
 
+static char *formatNumber(char *p, uint64_t n, int digits) { /* Writes at least 'digits' digits */
+	char buf[24], *e = buf + sizeof buf, *b = e;
+	do {
+		*--b = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (e - b < digits) *--b = '0';
+	memcpy(p, b, e - b);
+	return p + (e - b);
+}
+
+static char *formatDate(char *p, int64_t day) { /* Civil from days, see http://howardhinnant.github.io/date_algorithms.html */
+	int64_t z = day + 719468;
+	int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	int64_t doe = z - era * 146097;
+	int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int64_t mp = (5 * doy + 2) / 153;
+	int d = doy - (153 * mp + 2) / 5 + 1;
+	int m = mp < 10 ? mp + 3 : mp - 9;
+	int64_t y = yoe + era * 400 + (m <= 2);
+	if (y < 0) {
+		*p++ = '-';
+		p = formatNumber(p, -y, 4);
+	} else {
+		if (y > 9999) *p++ = '+';
+		p = formatNumber(p, y, 4);
+	}
+	*p++ = '-';
+	memcpy(p, DIGITS + m * 2, 2);
+	p[2] = '-';
+	memcpy(p + 3, DIGITS + d * 2, 2);
+	p[5] = 'T';
+	return p + 6;
+}
+
+/* Writes ISO-8601 UTC date and time omitting zero milliseconds unless 'msec' is set */
+static char *formatDateTime(char *p, int64_t ms, DateTimeFormat *dtf, bool msec) {
+	int64_t day = ms / 86400000;
+	int t = ms % 86400000;
+	if (t < 0) {
+		t += 86400000;
+		--day;
+	}
+	if (!dtf->dlen || dtf->day != day) { /* Date not cached */
+		dtf->dlen = formatDate(dtf->date, day) - dtf->date;
+		dtf->day = day;
+	}
+	memcpy(p, dtf->date, dtf->dlen);
+	p += dtf->dlen;
+	memcpy(p, DIGITS + t / 3600000 * 2, 2);
+	p[2] = ':';
+	memcpy(p + 3, DIGITS + t / 60000 % 60 * 2, 2);
+	p[5] = ':';
+	memcpy(p + 6, DIGITS + t / 1000 % 60 * 2, 2);
+	p += 8;
+	if (msec || t % 1000) {
+		*p++ = '.';
+		p = formatNumber(p, t % 1000, 3);
+	}
+	*p++ = 'Z';
+	return p;
+}
+
+static void pushISODateTime(lua_State *L, int64_t ms, DateTimeFormat *dtf) {
+	char buf[64];
+	lua_pushlstring(L, buf, formatDateTime(buf, ms, dtf, true) - buf);
+}
+
+static DateTimeFormat *getDateTimeFormat(lua_State *L) {
+	DateTimeFormat *dtf;
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &DATETIME_FORMAT);
+	dtf = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return dtf;
+}
+
+/* JSON writer producing the same output as libbson's bson_as_*_extended_json() without intermediate
+   allocations. The output buffer is a userdata at stack index 'idx' kept for reuse between calls. */
+
+typedef struct JSONWriter {
+	lua_State *L;
+	int idx;
+	char *b, *p, *e; /* Buffer start, position and end */
+	bool canonical;
+	DateTimeFormat dtf; /* Date cache */
+} JSONWriter;
+
+static char *reserveJSON(JSONWriter *w, size_t n) {
+	if ((size_t)(w->e - w->p) < n) { /* Grow buffer */
+		size_t len = w->p - w->b, size = (w->e - w->b) * 2;
+		char *b;
+		if (size < len + n) size = len + n;
+		b = lua_newuserdata(w->L, size);
+		memcpy(b, w->b, len);
+		lua_replace(w->L, w->idx);
+		w->b = b;
+		w->p = b + len;
+		w->e = b + size;
+	}
+	return w->p;
+}
+
+static void writeJSON(JSONWriter *w, const char *str, size_t len) {
+	memcpy(reserveJSON(w, len), str, len);
+	w->p += len;
+}
+
+#define writeJSONLiteral(w, str) writeJSON(w, "" str, sizeof str - 1)
+
+static void writeJSONString(JSONWriter *w, const char *str, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	const char *s, *e = str + len;
+	size_t n = len + 2;
+	char *p;
+	for (s = str; s < e; ++s) { /* Compute length of escaped string */
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') ++n;
+		else if (c < ' ') n += c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t' ? 1 : 5;
+	}
+	p = reserveJSON(w, n);
+	*p++ = '"';
+	while (str < e) {
+		unsigned char c = *str++;
+		switch (c) {
+			case '"':
+			case '\\':
+				*p++ = '\\';
+				*p++ = c;
+				break;
+			case '\b':
+				*p++ = '\\';
+				*p++ = 'b';
+				break;
+			case '\f':
+				*p++ = '\\';
+				*p++ = 'f';
+				break;
+			case '\n':
+				*p++ = '\\';
+				*p++ = 'n';
+				break;
+			case '\r':
+				*p++ = '\\';
+				*p++ = 'r';
+				break;
+			case '\t':
+				*p++ = '\\';
+				*p++ = 't';
+				break;
+			default:
+				if (c < ' ') {
+					memcpy(p, "\\u00", 4);
+					p[4] = hex[c >> 4];
+					p[5] = hex[c & 15];
+					p += 6;
+				} else *p++ = c;
+				break;
+		}
+	}
+	*p++ = '"';
+	w->p = p;
+}
+
+static void writeJSONInteger(JSONWriter *w, int64_t n) {
+	char *p = reserveJSON(w, 21);
+	if (n < 0) {
+		*p++ = '-';
+		w->p = formatNumber(p, -(uint64_t)n, 1);
+	} else w->p = formatNumber(p, n, 1);
+}
+
+/* Rare types are written by libbson as a single-field document stripped of its braces and key */
+static void writeJSONOther(JSONWriter *w, const bson_iter_t *iter) {
+	bson_t bson;
+	size_t len;
+	char *str;
+	bson_init(&bson);
+	bson_append_iter(&bson, "", 0, iter);
+	str = w->canonical ? bson_as_canonical_extended_json(&bson, &len) : bson_as_relaxed_extended_json(&bson, &len);
+	bson_destroy(&bson);
+	if (!str) luaL_error(w->L, "invalid BSON");
+	writeJSON(w, str + 7, len - 9); /* Strip '{ "" : ' and ' }' */
+	bson_free(str);
+}
+
+static void writeJSONDocument(JSONWriter *w, bson_iter_t *iter, int depth, bool array);
+
+static void writeJSONValue(JSONWriter *w, bson_iter_t *iter, int depth) {
+	switch (bson_iter_type(iter)) {
+		case BSON_TYPE_UTF8: {
+			uint32_t len;
+			const char *str = bson_iter_utf8(iter, &len);
+			writeJSONString(w, str, len);
+			break;
+		}
+		case BSON_TYPE_INT32:
+			if (w->canonical) writeJSONLiteral(w, "{ \"$numberInt\" : \"");
+			writeJSONInteger(w, bson_iter_int32(iter));
+			if (w->canonical) writeJSONLiteral(w, "\" }");
+			break;
+		case BSON_TYPE_INT64:
+			if (w->canonical) writeJSONLiteral(w, "{ \"$numberLong\" : \"");
+			writeJSONInteger(w, bson_iter_int64(iter));
+			if (w->canonical) writeJSONLiteral(w, "\"}");
+			break;
+		case BSON_TYPE_DOUBLE: {
+			double d = bson_iter_double(iter);
+			char *p;
+			int n;
+			if (w->canonical || d != d || d * 0 != 0) { /* Wrapped value */
+				writeJSONOther(w, iter);
+				break;
+			}
+			p = reserveJSON(w, 32);
+			n = snprintf(p, 30, "%.20g", d);
+			if (strspn(p, "0123456789-") == (size_t)n) { /* Distinguish '3.0' from '3' */
+				p[n++] = '.';
+				p[n++] = '0';
+			}
+			w->p += n;
+			break;
+		}
+		case BSON_TYPE_BOOL:
+			if (bson_iter_bool(iter)) writeJSONLiteral(w, "true");
+			else writeJSONLiteral(w, "false");
+			break;
+		case BSON_TYPE_NULL:
+			writeJSONLiteral(w, "null");
+			break;
+		case BSON_TYPE_OID:
+			writeJSONLiteral(w, "{ \"$oid\" : \"");
+			bson_oid_to_string(bson_iter_oid(iter), reserveJSON(w, 25));
+			w->p += 24;
+			writeJSONLiteral(w, "\" }");
+			break;
+		case BSON_TYPE_DATE_TIME: {
+			int64_t ms = bson_iter_date_time(iter);
+			if (w->canonical || ms < 0) {
+				writeJSONLiteral(w, "{ \"$date\" : { \"$numberLong\" : \"");
+				writeJSONInteger(w, ms);
+				writeJSONLiteral(w, "\" } }");
+			} else if (ms < INT64_C(253402300800000)) { /* Four-digit year */
+				writeJSONLiteral(w, "{ \"$date\" : \"");
+				w->p = formatDateTime(reserveJSON(w, 64), ms, &w->dtf, false);
+				writeJSONLiteral(w, "\" }");
+			} else writeJSONOther(w, iter);
+			break;
+		}
+		case BSON_TYPE_DOCUMENT:
+		case BSON_TYPE_ARRAY: {
+			bson_iter_t tmp;
+			if (depth >= 200) { /* Same limit as in libbson */
+				writeJSONLiteral(w, "{ ... }");
+				break;
+			}
+			check(w->L, bson_iter_recurse(iter, &tmp));
+			writeJSONDocument(w, &tmp, depth + 1, BSON_ITER_HOLDS_ARRAY(iter));
+			break;
+		}
+		default:
+			writeJSONOther(w, iter);
+			break;
+	}
+}
+
+static void writeJSONDocument(JSONWriter *w, bson_iter_t *iter, int depth, bool array) {
+	bool first = true;
+	if (array) writeJSONLiteral(w, "[ ");
+	else writeJSONLiteral(w, "{ ");
+	while (bson_iter_next(iter)) {
+		if (!first) writeJSONLiteral(w, ", ");
+		first = false;
+		if (!array) {
+			writeJSONString(w, bson_iter_key(iter), bson_iter_key_len(iter));
+			writeJSONLiteral(w, " : ");
+		}
+		writeJSONValue(w, iter, depth);
+	}
+	if (iter->err_off) luaL_error(w->L, "invalid BSON");
+	if (array) writeJSONLiteral(w, " ]");
+	else writeJSONLiteral(w, " }");
+}
+
+static void pushJSON(lua_State *L, const uint8_t *data, uint32_t len, bool canonical) {
+	JSONWriter w;
+	bson_iter_t iter;
+	size_t size;
+	check(L, bson_iter_init_from_data(&iter, data, len));
+	if (len == 5) { /* Empty document */
+		lua_pushliteral(L, "{ }");
+		return;
+	}
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &JSON_BUFFER);
+	if (!lua_isuserdata(L, -1)) {
+		lua_pop(L, 1);
+		lua_newuserdata(L, 256);
+	}
+	w.L = L;
+	w.idx = lua_gettop(L);
+	w.b = w.p = lua_touserdata(L, -1);
+	w.e = w.b + lua_rawlen(L, -1);
+	w.canonical = canonical;
+	w.dtf.dlen = 0;
+	writeJSONDocument(&w, &iter, 0, false);
+	lua_pushlstring(L, w.b, w.p - w.b);
+	size = w.e - w.b;
+	if (size <= MAXJSONBUFFER) { /* Keep buffer for reuse */
+		lua_pushvalue(L, w.idx);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &JSON_BUFFER);
+	}
+	lua_remove(L, w.idx);
+}
+
 static int m_append(lua_State *L) {
 	bson_t *bson = checkBSON(L, 1);
 	size_t klen;
@@ -82,17 +434,26 @@ static int m_find(lua_State *L) {
 	return 1;
 }
 
+static int m_lazy(lua_State *L) {
+	pushLazyBSON(L, checkBSON(L, 1));
+	return 1;
+}
+
 static int m_value(lua_State *L) {
 	pushBSON(L, checkBSON(L, 1), 2);
 	return 1;
 }
 
+static int m_toJSON(lua_State *L) {
+	static const char *const modes[] = {"relaxed", "canonical", 0};
+	bson_t *bson = checkBSON(L, 1);
+	pushJSON(L, bson_get_data(bson), bson->len, luaL_checkoption(L, 2, modes[0], modes));
+	return 1;
+}
+
 static int m__tostring(lua_State *L) {
-	size_t len;
-	/*char *str = bson_as_canonical_extended_json(checkBSON(L, 1), &len);*/
-	char *str = bson_as_relaxed_extended_json(checkBSON(L, 1), &len);
-	lua_pushlstring(L, str, len);
-	bson_free(str);
+	bson_t *bson = checkBSON(L, 1);
+	pushJSON(L, bson_get_data(bson), bson->len, false);
 	return 1;
 }
 
@@ -117,6 +478,8 @@ static const luaL_Reg funcs[] = {
 	{"concat", m_concat},
 	{"data", m_data},
 	{"find", m_find},
+	{"lazy", m_lazy},
+	{"to_json", m_toJSON},
 	{"value", m_value},
 	{"__tostring", m__tostring},
 	{"__len", m__len},
@@ -283,9 +646,13 @@ static bool isArray(const bson_t *bson) {
 	return bson_iter_init(&iter, bson) && bson_iter_next(&iter) && !strcmp(bson_iter_key(&iter), "0");
 }
 
-static lua_Integer getArrayLength(lua_State *L, int idx) {
+/* Tables are converted with the following stack slots starting at 'ridx': the table of tables being
+   converted beyond MAXDEPTH (nil until needed) and the key '__array'. */
+
+static lua_Integer getArrayLength(lua_State *L, int idx, int ridx) {
 	lua_Integer len = -1;
-	lua_getfield(L, idx, "__array");
+	lua_pushvalue(L, ridx + 1);
+	lua_rawget(L, idx);
 	if (lua_toboolean(L, -1)) {
 		if (!isInteger(L, -1, &len)) len = lua_rawlen(L, idx);
 		else if (len < 0) len = 0;
@@ -294,9 +661,9 @@ static lua_Integer getArrayLength(lua_State *L, int idx) {
 	return len;
 }
 
-static bool appendTable(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson, lua_Integer len);
+static bool appendTable(lua_State *L, int idx, int ridx, int depth, int *nerr, bson_t *bson, lua_Integer len);
 
-static bool appendValue(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson, const char *key, size_t klen) {
+static bool appendValue(lua_State *L, int idx, int ridx, int depth, int *nerr, bson_t *bson, const char *key, size_t klen) {
 	if (luaL_getmetafield(L, idx, "__toBSON")) { /* Transform value */
 		lua_pushvalue(L, idx);
 		if (lua_pcall(L, 1, 1, 0)) return error(L, nerr, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1) : "(error object is not a string)");
@@ -333,14 +700,14 @@ static bool appendValue(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson
 				lua_pop(L, 1);
 				break;
 			}
-			len = getArrayLength(L, idx);
+			len = getArrayLength(L, idx, ridx);
 			if (len != -1) {
 				bson_append_array_begin(bson, key, klen, &doc);
-				if (!appendTable(L, idx, ridx, nerr, &doc, len)) return false;
+				if (!appendTable(L, idx, ridx, depth + 1, nerr, &doc, len)) return false;
 				bson_append_array_end(bson, &doc);
 			} else {
 				bson_append_document_begin(bson, key, klen, &doc);
-				if (!appendTable(L, idx, ridx, nerr, &doc, len)) return false;
+				if (!appendTable(L, idx, ridx, depth + 1, nerr, &doc, len)) return false;
 				bson_append_document_end(bson, &doc);
 			}
 			break;
@@ -364,19 +731,25 @@ static bool appendValue(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson
 	return true;
 }
 
-static bool appendTable(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson, lua_Integer len) {
+static bool appendTable(lua_State *L, int idx, int ridx, int depth, int *nerr, bson_t *bson, lua_Integer len) {
 	const char *key;
 	size_t klen;
 	int top = lua_gettop(L);
 	if (top >= MAXSTACK) return error(L, nerr, "recursion detected");
 	if (lua_getmetatable(L, idx)) return error(L, nerr, "table with metatable unexpected");
-	lua_pushvalue(L, idx);
-	lua_rawget(L, ridx);
-	if (lua_toboolean(L, -1)) return error(L, nerr, "circular reference detected");
-	lua_pushvalue(L, idx);
-	lua_pushboolean(L, 1);
-	lua_rawset(L, ridx);
-	lua_settop(L, top);
+	if (depth > MAXDEPTH) { /* A circular reference repeats its tables past any depth */
+		if (lua_isnil(L, ridx)) {
+			lua_newtable(L);
+			lua_replace(L, ridx);
+		}
+		lua_pushvalue(L, idx);
+		lua_rawget(L, ridx);
+		if (lua_toboolean(L, -1)) return error(L, nerr, "circular reference detected");
+		lua_pushvalue(L, idx);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, ridx);
+		lua_settop(L, top);
+	}
 	luaL_checkstack(L, LUA_MINSTACK, "too many nested values");
 	if (len != -1) { /* As array */
 		char buf[64];
@@ -384,25 +757,42 @@ static bool appendTable(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson
 		for (i = 0; i < len; ++i) {
 			lua_rawgeti(L, idx, i + 1);
 			klen = bson_uint32_to_string(i, &key, buf, sizeof buf);
-			if (!appendValue(L, top + 1, ridx, nerr, bson, key, klen)) return error(L, nerr, "[%d] => ", i + 1);
+			if (!appendValue(L, top + 1, ridx, depth, nerr, bson, key, klen)) return error(L, nerr, "[%d] => ", i + 1);
 			lua_pop(L, 1);
 		}
 	} else { /* As document */
 		for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
 			if (lua_type(L, top + 1) != LUA_TSTRING) return error(L, nerr, "string index expected, got %s", typeName(L, top + 1));
 			key = lua_tolstring(L, top + 1, &klen);
-			if (!appendValue(L, top + 2, ridx, nerr, bson, key, klen)) return error(L, nerr, "[\"%s\"] => ", key);
+			if (!appendValue(L, top + 2, ridx, depth, nerr, bson, key, klen)) return error(L, nerr, "[\"%s\"] => ", key);
 		}
 	}
-	lua_pushvalue(L, idx);
+	if (depth > MAXDEPTH) {
+		lua_pushvalue(L, idx);
+		lua_pushnil(L);
+		lua_rawset(L, ridx);
+	}
+	return true;
+}
+
+/* Appends the fields of the table at 'idx' to 'bson' and stores its array length (or -1) in 'len'.
+   On error, returns 'false' with the error message on the stack. */
+static bool appendRoot(lua_State *L, int idx, bson_t *bson, lua_Integer *len) {
+	int nerr = 0, ridx = lua_gettop(L) + 1;
 	lua_pushnil(L);
-	lua_rawset(L, ridx);
+	lua_pushliteral(L, "__array");
+	*len = getArrayLength(L, idx, ridx);
+	if (!appendTable(L, idx, ridx, 1, &nerr, bson, *len)) {
+		lua_concat(L, nerr);
+		return false;
+	}
+	lua_pop(L, 2);
 	return true;
 }
 
-static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, bool array);
+static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, DateTimeFormat *dtf, bool array);
 
-static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
+static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx, DateTimeFormat *dtf) {
 	switch (bson_iter_type(iter)) {
 		case BSON_TYPE_BOOL:
 			lua_pushboolean(L, bson_iter_bool(iter));
@@ -426,7 +816,7 @@ static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
 		case BSON_TYPE_ARRAY: {
 			bson_iter_t tmp;
 			check(L, bson_iter_recurse(iter, &tmp));
-			unpackTable(L, &tmp, hidx, BSON_ITER_HOLDS_ARRAY(iter));
+			unpackTable(L, &tmp, hidx, dtf, BSON_ITER_HOLDS_ARRAY(iter));
 			break;
 		}
 		case BSON_TYPE_OID:
@@ -454,16 +844,28 @@ static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
 			break;
 		}
 		case BSON_TYPE_DATE_TIME: {
-			char chFormat[256] = { 0 };
-			size_t formatLen;
-			struct tm formatTp;
-			time_t tmDaypoint;
-			/*lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_DATETIME);
-			pushInt64(L, bson_iter_date_time(iter));
-			lua_call(L, 1, 1);*/
-			tmDaypoint = bson_iter_date_time(iter) / 1000;
-			format_timestamp(tmDaypoint, chFormat, &formatLen, &formatTp);
-			lua_pushlstring(L, chFormat, formatLen);
+			int64_t ms = bson_iter_date_time(iter);
+			switch (dtf ? dtf->format : DATETIME_RAW) {
+				case DATETIME_OBJECT:
+					lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_DATETIME);
+					pushInt64(L, ms / 1000); /* Same as pushBSONValue() */
+					lua_call(L, 1, 1);
+					break;
+				case DATETIME_ISO:
+					pushISODateTime(L, ms, dtf);
+					break;
+				case DATETIME_LOCAL: {
+					char chFormat[256] = { 0 };
+					size_t formatLen;
+					struct tm formatTp;
+					format_timestamp(ms / 1000, chFormat, &formatLen, &formatTp);
+					lua_pushlstring(L, chFormat, formatLen);
+					break;
+				}
+				default:
+					pushInt64(L, ms);
+					break;
+			}
 			break;
 		}
 		case BSON_TYPE_CODE: {
@@ -519,14 +921,17 @@ static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
 	}
 }
 
-static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, bool array) {
+static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, DateTimeFormat *dtf, bool array) {
 	lua_Integer len = 0;
-	lua_newtable(L);
+	bson_iter_t tmp = *iter;
+	int n = 0;
+	while (bson_iter_next(&tmp)) ++n; /* Count fields to presize table */
+	lua_createtable(L, array ? n : 0, array ? 1 : n);
 	luaL_checkstack(L, LUA_MINSTACK, "too many nested values");
 	while (bson_iter_next(iter)) {
 		if (array) lua_pushinteger(L, ++len);
 		else lua_pushlstring(L, bson_iter_key(iter), bson_iter_key_len(iter));
-		unpackValue(L, iter, hidx);
+		unpackValue(L, iter, hidx, dtf);
 		lua_rawset(L, -3);
 	}
 	if (array) {
@@ -539,6 +944,204 @@ static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, bool array) {
 	lua_call(L, 1, 1); /* Transform value */
 }
 
+static void pushLazy(lua_State *L, const uint8_t *data, uint32_t len, bool array, int pidx);
+
+static LazyBSON *checkLazy(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_LAZYBSON);
+}
+
+static void pushLazyValue(lua_State *L, bson_iter_t *iter, int idx) {
+	uint32_t len;
+	const uint8_t *data;
+	switch (bson_iter_type(iter)) {
+		case BSON_TYPE_DOCUMENT:
+			bson_iter_document(iter, &len, &data);
+			pushLazy(L, data, len, false, idx);
+			break;
+		case BSON_TYPE_ARRAY:
+			bson_iter_array(iter, &len, &data);
+			pushLazy(L, data, len, true, idx);
+			break;
+		default:
+			unpackValue(L, iter, 0, getDateTimeFormat(L));
+			break;
+	}
+}
+
+static lua_Integer getLazySize(lua_State *L, LazyBSON *lazy) {
+	if (lazy->size < 0) {
+		bson_iter_t iter;
+		lua_Integer n = 0;
+		check(L, bson_iter_init_from_data(&iter, lazy->data, lazy->len));
+		while (bson_iter_next(&iter)) ++n;
+		lazy->size = n;
+	}
+	return lazy->size;
+}
+
+/* Positions 'iter' at array element 'i' continuing from the last element accessed if possible,
+   so that sequential access is linear */
+static bool seekLazy(lua_State *L, LazyBSON *lazy, lua_Integer i, bson_iter_t *iter) {
+	lua_Integer pos = lazy->pos;
+	if (i < 1 || (lazy->size >= 0 && i > lazy->size)) return false;
+	if (pos && i >= pos) check(L, bson_iter_init_from_data_at_offset(iter, lazy->data, lazy->len, lazy->off, lazy->klen));
+	else {
+		check(L, bson_iter_init_from_data(iter, lazy->data, lazy->len));
+		pos = 0;
+	}
+	while (pos < i) {
+		if (!bson_iter_next(iter)) {
+			lazy->size = pos;
+			return false;
+		}
+		++pos;
+	}
+	lazy->pos = pos;
+	lazy->off = bson_iter_offset(iter);
+	lazy->klen = bson_iter_key_len(iter);
+	return true;
+}
+
+static int lazy__index(lua_State *L) {
+	LazyBSON *lazy = checkLazy(L, 1);
+	bson_iter_t iter, tmp;
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 3);
+	if (!lua_isnil(L, -1)) return 1; /* Cached value */
+	lua_pop(L, 1);
+	if (lazy->array) {
+		lua_Integer i;
+		if (lua_type(L, 2) == LUA_TSTRING && !strcmp(lua_tostring(L, 2), "__array")) {
+			lua_pushinteger(L, getLazySize(L, lazy));
+			return 1;
+		}
+		if (!isInteger(L, 2, &i) || !seekLazy(L, lazy, i, &iter)) return 0;
+	} else {
+		if (lua_type(L, 2) != LUA_TSTRING) return 0;
+		check(L, bson_iter_init_from_data(&tmp, lazy->data, lazy->len));
+		if (!bson_iter_find_descendant(&tmp, lua_tostring(L, 2), &iter)) return 0;
+	}
+	pushLazyValue(L, &iter, 1);
+	if (lua_isnil(L, -1)) return 1;
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 3); /* Cache value */
+	return 1;
+}
+
+static int lazy__newindex(lua_State *L) {
+	return luaL_error(L, "%s is read-only", TYPE_LAZYBSON);
+}
+
+static int lazyNext(lua_State *L) {
+	LazyIterator *it = lua_touserdata(L, lua_upvalueindex(2));
+	LazyBSON *lazy = lua_touserdata(L, lua_upvalueindex(1));
+	bson_iter_t iter;
+	if (it->done) return 0;
+	if (it->off) check(L, bson_iter_init_from_data_at_offset(&iter, lazy->data, lazy->len, it->off, it->klen));
+	else check(L, bson_iter_init_from_data(&iter, lazy->data, lazy->len));
+	lua_getuservalue(L, lua_upvalueindex(1));
+	while (!it->done) {
+		if (!bson_iter_next(&iter)) {
+			it->done = true;
+			if (!lazy->array) break;
+			lazy->size = it->n;
+			lua_pushliteral(L, "__array");
+			lua_pushinteger(L, it->n);
+			return 2;
+		}
+		it->off = bson_iter_offset(&iter);
+		it->klen = bson_iter_key_len(&iter);
+		if (lazy->array) lua_pushinteger(L, ++it->n);
+		else lua_pushlstring(L, bson_iter_key(&iter), it->klen);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -3);
+		if (!lua_isnil(L, -1)) return 2; /* Cached value */
+		lua_pop(L, 1);
+		pushLazyValue(L, &iter, lua_upvalueindex(1));
+		if (lua_isnil(L, -1)) { /* Skip null values as unpacking does */
+			lua_pop(L, 2);
+			continue;
+		}
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -5); /* Cache value */
+		return 2;
+	}
+	return 0;
+}
+
+static int lazy__pairs(lua_State *L) {
+	LazyIterator *it;
+	checkLazy(L, 1);
+	lua_settop(L, 1);
+	it = lua_newuserdata(L, sizeof *it);
+	it->off = 0;
+	it->klen = 0;
+	it->n = 0;
+	it->done = false;
+	lua_pushcclosure(L, lazyNext, 2);
+	return 1;
+}
+
+static int lazy__len(lua_State *L) {
+	LazyBSON *lazy = checkLazy(L, 1);
+	lua_pushinteger(L, lazy->array ? getLazySize(L, lazy) : 0);
+	return 1;
+}
+
+static int lazy__toBSON(lua_State *L) {
+	LazyBSON *lazy = checkLazy(L, 1);
+	bson_t bson;
+	check(L, bson_init_static(&bson, lazy->data, lazy->len));
+	pushBSON(L, &bson, 0);
+	return 1;
+}
+
+static int lazy__tostring(lua_State *L) {
+	LazyBSON *lazy = checkLazy(L, 1);
+	pushJSON(L, lazy->data, lazy->len, false);
+	return 1;
+}
+
+static const luaL_Reg lazyFuncs[] = {
+	{"__index", lazy__index},
+	{"__newindex", lazy__newindex},
+	{"__pairs", lazy__pairs},
+	{"__len", lazy__len},
+	{"__toBSON", lazy__toBSON},
+	{"__tostring", lazy__tostring},
+	{0, 0}
+};
+
+/* A nested document refers to the data of its parent, which is kept alive through the cache */
+static void pushLazy(lua_State *L, const uint8_t *data, uint32_t len, bool array, int pidx) {
+	LazyBSON *lazy;
+	if (pidx) {
+		lazy = lua_newuserdata(L, sizeof *lazy);
+		lazy->data = data;
+	} else { /* Root document owns a copy of the data */
+		lazy = lua_newuserdata(L, sizeof *lazy + len);
+		lazy->data = memcpy(lazy + 1, data, len);
+	}
+	lazy->len = len;
+	lazy->array = array;
+	lazy->size = -1;
+	lazy->pos = 0;
+	lazy->off = 0;
+	lazy->klen = 0;
+	lua_newtable(L);
+	if (pidx) {
+		int cidx = lua_gettop(L);
+		lua_pushvalue(L, pidx);
+		lua_rawsetp(L, cidx, &LAZY_PARENT);
+	}
+	lua_setuservalue(L, -2);
+	setType(L, TYPE_LAZYBSON, lazyFuncs);
+}
+
 int newBSON(lua_State *L) {
 	castBSON(L, 1);
 	return 1;
@@ -554,11 +1157,29 @@ void pushBSON(lua_State *L, const bson_t *bson, int hidx) {
 		bson_iter_t iter;
 		check(L, bson_iter_init(&iter, bson));
 		lua_pushvalue(L, hidx); /* Ensure handler index is valid */
-		unpackTable(L, &iter, lua_gettop(L), isArray(bson));
+		unpackTable(L, &iter, lua_gettop(L), getDateTimeFormat(L), isArray(bson));
 		lua_replace(L, -2);
 	}
 }
 
+void pushLazyBSON(lua_State *L, const bson_t *bson) {
+	pushLazy(L, bson_get_data(bson), bson->len, isArray(bson), 0);
+}
+
+int setDateTimeFormat(lua_State *L) {
+	int format = luaL_checkoption(L, 1, 0, dateTimeFormats);
+	DateTimeFormat *dtf = getDateTimeFormat(L);
+	if (!dtf) {
+		dtf = lua_newuserdata(L, sizeof *dtf);
+		dtf->format = DATETIME_RAW;
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &DATETIME_FORMAT);
+	}
+	lua_pushstring(L, dateTimeFormats[dtf->format]);
+	dtf->format = format;
+	dtf->dlen = 0;
+	return 1;
+}
+
 void pushBSONWithSteal(lua_State *L, bson_t *bson) {
 	bson_steal(lua_newuserdata(L, sizeof *bson), bson);
 	setType(L, TYPE_BSON, funcs);
@@ -677,25 +1298,50 @@ bson_t *castBSON(lua_State *L, int idx) {
 		bson = lua_newuserdata(L, sizeof *bson);
 		checkStatus(L, bson_init_from_json(bson, str, len, &error), &error);
 	} else { /* From value */
-		int nerr = 0;
+		lua_Integer alen;
 		if (luaL_callmeta(L, idx, "__toBSON")) lua_replace(L, idx); /* Transform value */
 		if ((bson = testBSON(L, idx))) return bson; /* Nothing to do */
 		if (!lua_istable(L, idx)) typeError(L, idx, "string, table or " TYPE_BSON);
 		bson = lua_newuserdata(L, sizeof *bson);
 		bson_init(bson);
-		lua_newtable(L);
-		if (!appendTable(L, idx, lua_gettop(L), &nerr, bson, getArrayLength(L, idx))) {
+		if (!appendRoot(L, idx, bson, &alen)) {
 			bson_destroy(bson);
-			lua_concat(L, nerr);
 			luaL_argerror(L, idx, lua_tostring(L, -1));
 		}
-		lua_pop(L, 1);
 	}
 	setType(L, TYPE_BSON, funcs);
 	lua_replace(L, idx);
 	return bson;
 }
 
+/* Same as castBSON(), but converts a plain table into a document that is reused by subsequent calls
+   (keeping its buffer), so the result is only valid until Lua code can run again */
+bson_t *castScratchBSON(lua_State *L, int idx) {
+	bson_t *bson;
+	lua_Integer len;
+	if (lua_type(L, idx) != LUA_TTABLE) return castBSON(L, idx);
+	if (lua_getmetatable(L, idx)) { /* May have '__toBSON' */
+		lua_pop(L, 1);
+		return castBSON(L, idx);
+	}
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &SCRATCH_BSON);
+	if ((bson = lua_touserdata(L, -1))) { /* Take scratch document for the time of conversion */
+		bson_reinit(bson);
+		lua_pushnil(L);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &SCRATCH_BSON);
+	} else {
+		lua_pop(L, 1);
+		bson = lua_newuserdata(L, sizeof *bson);
+		bson_init(bson);
+		setType(L, TYPE_BSON, funcs);
+	}
+	if (!appendRoot(L, idx, bson, &len)) luaL_argerror(L, idx, lua_tostring(L, -1));
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &SCRATCH_BSON);
+	lua_replace(L, idx);
+	return bson;
+}
+
 bson_t *toBSON(lua_State *L, int idx) {
 	return luaL_opt(L, castBSON, idx, 0);
 }
@@ -738,21 +1384,16 @@ void toBSONValue(lua_State *L, int idx, bson_value_t *val) {
 		case LUA_TTABLE: {
 			lua_Integer len;
 			bson_t bson;
-			int nerr = 0;
 			if (luaL_getmetafield(L, idx, "__type")) {
 				toBSONType(L, lua_tointeger(L, -1), idx, val);
 				lua_pop(L, 1);
 				break;
 			}
-			len = getArrayLength(L, idx);
 			bson_init(&bson);
-			lua_newtable(L);
-			if (!appendTable(L, idx, lua_gettop(L), &nerr, &bson, len)) {
+			if (!appendRoot(L, idx, &bson, &len)) {
 				bson_destroy(&bson);
-				lua_concat(L, nerr);
 				luaL_argerror(L, idx, lua_tostring(L, -1));
 			}
-			lua_pop(L, 1);
 			val->value_type = len != -1 ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT;
 			val->value.v_doc.data = bson_destroy_with_steal(&bson, true, &val->value.v_doc.data_len);
 			break;
@@ -0,0 +1,126 @@
+/*
+** Copyright (C) 2016-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+#define DEFBATCH 100 /* Default number of events per batch */
+#define MAXPRESIZE 1000 /* Maximum number of events to presize a batch for */
+
+typedef struct ChangeStream {
+	mongoc_change_stream_t *stream;
+	bson_t *token; /* Resume token of the last event */
+} ChangeStream;
+
+static ChangeStream *checkChangeStream(lua_State *L, int idx) {
+	return *(ChangeStream **)luaL_checkudata(L, idx, TYPE_CHANGESTREAM);
+}
+
+static bool nextEvent(ChangeStream *stream, const bson_t **bson) {
+	bson_iter_t iter;
+	uint32_t len;
+	const uint8_t *data;
+	if (!mongoc_change_stream_next(stream->stream, bson)) return false;
+	if (bson_iter_init_find(&iter, *bson, "_id") && BSON_ITER_HOLDS_DOCUMENT(&iter)) { /* Checked by the driver */
+		bson_iter_document(&iter, &len, &data);
+		bson_destroy(stream->token);
+		stream->token = bson_new_from_data(data, len);
+	}
+	return true;
+}
+
+static int m_getResumeToken(lua_State *L) {
+	ChangeStream *stream = checkChangeStream(L, 1);
+	if (!stream->token) lua_pushnil(L);
+	else pushBSON(L, stream->token, 0);
+	return 1;
+}
+
+static int m_next(lua_State *L) {
+	ChangeStream *stream = checkChangeStream(L, 1);
+	const bson_t *bson;
+	bson_error_t error;
+	if (nextEvent(stream, &bson)) {
+		pushBSON(L, bson, 0);
+		return 1;
+	}
+	if (mongoc_change_stream_error_document(stream->stream, &error, 0)) return commandError(L, &error);
+	lua_pushnil(L);
+	return 1;
+}
+
+static int m_nextBatch(lua_State *L) {
+	ChangeStream *stream = checkChangeStream(L, 1);
+	lua_Integer n = luaL_optinteger(L, 2, DEFBATCH);
+	lua_Integer timeout = luaL_optinteger(L, 3, 0);
+	int64_t deadline = bson_get_monotonic_time() + timeout * 1000;
+	lua_Integer i = 0;
+	const bson_t *bson;
+	bson_error_t error;
+	luaL_argcheck(L, n > 0, 2, "invalid number of events");
+	luaL_argcheck(L, timeout >= 0, 3, "invalid timeout");
+	lua_settop(L, 4);
+	lua_createtable(L, n < MAXPRESIZE ? n : 0, 0);
+	while (i != n) {
+		if (nextEvent(stream, &bson)) {
+			pushBSON(L, bson, 4);
+			lua_rawseti(L, -2, ++i);
+			continue;
+		}
+		if (mongoc_change_stream_error_document(stream->stream, &error, 0)) {
+			checkStatus(L, i > 0, &error); /* Throw exception unless some events have been read */
+			break;
+		}
+		if (i || bson_get_monotonic_time() >= deadline) break; /* No more events for now */
+	}
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	ChangeStream *stream = checkChangeStream(L, 1);
+	mongoc_change_stream_destroy(stream->stream);
+	if (stream->token) bson_destroy(stream->token);
+	bson_free(stream);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"get_resume_token", m_getResumeToken},
+	{"next", m_next},
+	{"next_batch", m_nextBatch},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+void pushChangeStream(lua_State *L, mongoc_change_stream_t *stream, const bson_t *options, int pidx) {
+	ChangeStream *s = bson_malloc0(sizeof *s);
+	bson_iter_t iter;
+	uint32_t len;
+	const uint8_t *data;
+	s->stream = stream;
+	if (options && bson_iter_init_find(&iter, options, "resumeAfter") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+		bson_iter_document(&iter, &len, &data);
+		s->token = bson_new_from_data(data, len);
+	}
+	pushHandle(L, s, -1, pidx);
+	setType(L, TYPE_CHANGESTREAM, funcs);
+}
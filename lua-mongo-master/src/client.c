@@ -22,6 +22,155 @@
 
 #include "common.h"
 
+/* Latencies in microseconds are counted in log-linear buckets: values below 2^(SUBBITS+1) have a
+   bucket each, and every further power of two is split into 2^SUBBITS buckets, which bounds the
+   relative error by 2^-SUBBITS while keeping the histogram at a fixed size. */
+#define SUBBITS 3
+#define SUBBUCKETS (1 << SUBBITS)
+#define MAXBITS 36 /* Larger values (about 19 hours) are counted in the last bucket */
+#define NBUCKETS (SUBBUCKETS * (MAXBITS - SUBBITS + 1))
+
+typedef struct Entry {
+	struct Entry *next;
+	const char *command, *ns; /* Stored after the entry */
+	int64_t count, errors, bytesOut, bytesIn, total, min, max;
+	uint32_t buckets[NBUCKETS];
+} Entry;
+
+typedef struct Monitor {
+	Entry *entries;
+	Entry *pending; /* Entry of the command in progress */
+	int64_t request; /* Request ID of the command in progress */
+	int64_t bytesOut; /* Size of the command in progress */
+	bool dead; /* Finalized: the client may still run commands while its dependants are collected */
+} Monitor;
+
+static char MONITOR; /* Environment key of the monitor of a client */
+
+static int bucketIndex(int64_t val) {
+	int shift = 0;
+	if (val < 0) return 0;
+	if (val >= (int64_t)1 << MAXBITS) return NBUCKETS - 1;
+	while (val >> shift >= SUBBUCKETS * 2) ++shift;
+	return SUBBUCKETS * shift + (int)(val >> shift);
+}
+
+static int64_t bucketLimit(int idx) { /* Highest value counted in bucket 'idx' */
+	int shift = idx < SUBBUCKETS * 2 ? 0 : idx / SUBBUCKETS - 1;
+	return ((int64_t)(idx - SUBBUCKETS * shift + 1) << shift) - 1;
+}
+
+static Entry *getEntry(Monitor *m, const char *command, const char *db, const char *coll) {
+	Entry *e, **p = &m->entries;
+	size_t clen = strlen(command), dlen = strlen(db), nlen = coll ? dlen + strlen(coll) + 1 : dlen;
+	char *str;
+	for (e = *p; e; p = &e->next, e = e->next) {
+		if (strcmp(e->command, command) || strncmp(e->ns, db, dlen)) continue;
+		if (coll ? e->ns[dlen] == '.' && !strcmp(e->ns + dlen + 1, coll) : !e->ns[dlen]) return e;
+	}
+	e = bson_malloc0(sizeof *e + clen + nlen + 2);
+	str = (char *)(e + 1);
+	memcpy(str, command, clen + 1);
+	e->command = str;
+	str += clen + 1;
+	if (coll) bson_snprintf(str, nlen + 1, "%s.%s", db, coll);
+	else memcpy(str, db, dlen + 1);
+	e->ns = str;
+	*p = e;
+	return e;
+}
+
+static void record(Monitor *m, int64_t request, const char *command, int64_t duration, const bson_t *reply, bool failed) {
+	Entry *e = m->pending;
+	int64_t bytesOut = m->bytesOut;
+	if (m->dead) return;
+	if (!e || m->request != request) { /* Missed start */
+		e = getEntry(m, command, "", 0);
+		bytesOut = 0;
+	}
+	m->pending = 0;
+	if (!e->count || duration < e->min) e->min = duration;
+	if (duration > e->max) e->max = duration;
+	++e->count;
+	if (failed) ++e->errors;
+	e->bytesOut += bytesOut;
+	if (reply) e->bytesIn += reply->len;
+	e->total += duration;
+	++e->buckets[bucketIndex(duration)];
+}
+
+static void commandStarted(const mongoc_apm_command_started_t *event) {
+	Monitor *m = mongoc_apm_command_started_get_context(event);
+	const bson_t *command = mongoc_apm_command_started_get_command(event);
+	const char *name = mongoc_apm_command_started_get_command_name(event);
+	const char *coll = 0;
+	bson_iter_t iter;
+	if (m->dead) return;
+	if (bson_iter_init_find(&iter, command, strcmp(name, "getMore") ? name : "collection") && BSON_ITER_HOLDS_UTF8(&iter))
+		coll = bson_iter_utf8(&iter, 0); /* Collection is the value of the command field */
+	m->pending = getEntry(m, name, mongoc_apm_command_started_get_database_name(event), coll);
+	m->request = mongoc_apm_command_started_get_request_id(event);
+	m->bytesOut = command->len;
+}
+
+static void commandSucceeded(const mongoc_apm_command_succeeded_t *event) {
+	record(mongoc_apm_command_succeeded_get_context(event), mongoc_apm_command_succeeded_get_request_id(event),
+		mongoc_apm_command_succeeded_get_command_name(event), mongoc_apm_command_succeeded_get_duration(event),
+		mongoc_apm_command_succeeded_get_reply(event), false);
+}
+
+static void commandFailed(const mongoc_apm_command_failed_t *event) {
+	record(mongoc_apm_command_failed_get_context(event), mongoc_apm_command_failed_get_request_id(event),
+		mongoc_apm_command_failed_get_command_name(event), mongoc_apm_command_failed_get_duration(event),
+		mongoc_apm_command_failed_get_reply(event), true);
+}
+
+static void clearMonitor(Monitor *m) {
+	Entry *e = m->entries;
+	while (e) {
+		Entry *next = e->next;
+		bson_free(e);
+		e = next;
+	}
+	m->entries = 0;
+	m->pending = 0;
+}
+
+static int monitor__gc(lua_State *L) {
+	Monitor *m = lua_touserdata(L, 1);
+	clearMonitor(m);
+	m->dead = true;
+	return 0;
+}
+
+static const luaL_Reg monitorFuncs[] = {
+	{"__gc", monitor__gc},
+	{0, 0}
+};
+
+static Monitor *getMonitor(lua_State *L, int idx) {
+	Monitor *m;
+	int eidx;
+	lua_getuservalue(L, idx);
+	eidx = lua_gettop(L);
+	lua_rawgetp(L, eidx, &MONITOR);
+	m = lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	return m;
+}
+
+/* Returns the value at quantile 'q' of entry 'e' */
+static int64_t quantile(const Entry *e, double q) {
+	int64_t n = 0, rank = (int64_t)(q * e->count + 0.5);
+	int i;
+	if (rank < 1) rank = 1;
+	for (i = 0; i < NBUCKETS; ++i) {
+		if ((n += e->buckets[i]) < rank) continue;
+		return i == NBUCKETS - 1 || bucketLimit(i) > e->max ? e->max : bucketLimit(i) < e->min ? e->min : bucketLimit(i);
+	}
+	return e->max;
+}
+
 static int m_command(lua_State *L) {
 	mongoc_client_t *client = checkClient(L, 1);
 	const char *dbname = luaL_checkstring(L, 2);
@@ -87,8 +236,99 @@ static int m_setReadPrefs(lua_State *L) {
 	return 0;
 }
 
+static int m_setMonitoring(lua_State *L) {
+	mongoc_client_t *client = checkClient(L, 1);
+	bool enable = lua_toboolean(L, 2);
+	mongoc_apm_callbacks_t *callbacks;
+	Monitor *m;
+	luaL_argcheck(L, !getHandleMode(L, 1), 1, "monitoring of pooled clients is not supported");
+	m = getMonitor(L, 1);
+	if (!enable == !m) return 0; /* Nothing to do */
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
+	if (enable) {
+		m = lua_newuserdata(L, sizeof *m);
+		memset(m, 0, sizeof *m);
+		newType(L, TYPE_MONITOR, monitorFuncs);
+		lua_setmetatable(L, -2);
+		callbacks = mongoc_apm_callbacks_new();
+		mongoc_apm_set_command_started_cb(callbacks, commandStarted);
+		mongoc_apm_set_command_succeeded_cb(callbacks, commandSucceeded);
+		mongoc_apm_set_command_failed_cb(callbacks, commandFailed);
+		mongoc_client_set_apm_callbacks(client, callbacks, m);
+		mongoc_apm_callbacks_destroy(callbacks);
+	} else {
+		mongoc_client_set_apm_callbacks(client, 0, 0);
+		lua_pushnil(L);
+	}
+	lua_rawsetp(L, 2, &MONITOR);
+	return 0;
+}
+
+static int m_stats(lua_State *L) {
+	const Entry *e;
+	int i = 0;
+	Monitor *m;
+	checkClient(L, 1);
+	m = getMonitor(L, 1);
+	if (!m) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_newtable(L);
+	for (e = m->entries; e; e = e->next) {
+		if (!e->count) continue;
+		lua_createtable(L, 0, 14);
+		lua_pushstring(L, e->command);
+		lua_setfield(L, -2, "command");
+		lua_pushstring(L, e->ns);
+		lua_setfield(L, -2, "ns");
+		pushInt64(L, e->count);
+		lua_setfield(L, -2, "count");
+		pushInt64(L, e->errors);
+		lua_setfield(L, -2, "errors");
+		pushInt64(L, e->bytesOut);
+		lua_setfield(L, -2, "bytes_out");
+		pushInt64(L, e->bytesIn);
+		lua_setfield(L, -2, "bytes_in");
+		pushInt64(L, e->total);
+		lua_setfield(L, -2, "total");
+		pushInt64(L, e->min);
+		lua_setfield(L, -2, "min");
+		pushInt64(L, e->max);
+		lua_setfield(L, -2, "max");
+		pushInt64(L, e->total / e->count);
+		lua_setfield(L, -2, "mean");
+		pushInt64(L, quantile(e, 0.5));
+		lua_setfield(L, -2, "p50");
+		pushInt64(L, quantile(e, 0.9));
+		lua_setfield(L, -2, "p90");
+		pushInt64(L, quantile(e, 0.99));
+		lua_setfield(L, -2, "p99");
+		pushInt64(L, quantile(e, 0.999));
+		lua_setfield(L, -2, "p999");
+		lua_rawseti(L, -2, ++i);
+	}
+	if (lua_toboolean(L, 2)) clearMonitor(m);
+	return 1;
+}
+
+static int m_watch(lua_State *L) {
+	mongoc_client_t *client = checkClient(L, 1);
+	bson_t *pipeline = toBSON(L, 2);
+	bson_t *options = toBSON(L, 3);
+	bson_t empty = BSON_INITIALIZER;
+	pushChangeStream(L, mongoc_client_watch(client, pipeline ? pipeline : &empty, options), options, 1);
+	return 1;
+}
+
 static int m__gc(lua_State *L) {
-	mongoc_client_destroy(checkClient(L, 1));
+	if (getHandleMode(L, 1)) releaseClient(L, 1); /* Pooled client */
+	else {
+		mongoc_client_t *client = checkClient(L, 1);
+		mongoc_client_set_apm_callbacks(client, 0, 0); /* Monitor may be collected first */
+		mongoc_client_destroy(client);
+	}
 	unsetType(L);
 	return 0;
 }
@@ -100,6 +340,9 @@ static const luaL_Reg funcs[] = {
 	{"get_database_names", m_getDatabaseNames},
 	{"get_default_database", m_getDefaultDatabase},
 	{"get_grid_fs", m_getGridFS},
+	{"set_monitoring", m_setMonitoring},
+	{"stats", m_stats},
+	{"watch", m_watch},
 	{"get_read_prefs", m_getReadPrefs},
 	{"set_read_prefs", m_setReadPrefs},
 	{"__gc", m__gc},
@@ -114,6 +357,21 @@ int newClient(lua_State *L) {
 	return 1;
 }
 
+void pushPooledClient(lua_State *L, mongoc_client_t *client, int pidx) {
+	pushHandle(L, client, 1, pidx);
+	setType(L, TYPE_CLIENT, funcs);
+	lua_getuservalue(L, -1);
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_rawseti(L, -2, 4); /* env[4]: set of dependants, checked by 'pool:push()' */
+	lua_pop(L, 1);
+}
+
 mongoc_client_t *checkClient(lua_State *L, int idx) {
-	return *(mongoc_client_t **)luaL_checkudata(L, idx, TYPE_CLIENT);
+	mongoc_client_t *client = *(mongoc_client_t **)luaL_checkudata(L, idx, TYPE_CLIENT);
+	luaL_argcheck(L, client, idx, "client is pushed back to pool");
+	return client;
 }
@@ -0,0 +1,360 @@
+/*
+** Copyright (C) 2016-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#ifdef _WIN32
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Cond;
+#define MUTEX_INIT SRWLOCK_INIT
+#define mutexLock(m) AcquireSRWLockExclusive(m)
+#define mutexUnlock(m) ReleaseSRWLockExclusive(m)
+#define condInit(c) InitializeConditionVariable(c)
+#define condDestroy(c) (void)(c)
+#define condSignal(c) WakeConditionVariable(c)
+#define condBroadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#define MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define mutexLock(m) pthread_mutex_lock(m)
+#define mutexUnlock(m) pthread_mutex_unlock(m)
+#define condInit(c) pthread_cond_init(c, 0)
+#define condDestroy(c) pthread_cond_destroy(c)
+#define condSignal(c) pthread_cond_signal(c)
+#define condBroadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/* Pools are shared by all Lua states of a process and looked up by URI. The driver's pool is only
+   accessed with 'mutex' held, so that the gauges below track its queue exactly. */
+typedef struct Pool {
+	struct Pool *next;
+	char *uri;
+	mongoc_client_pool_t *pool;
+	Cond cond; /* Signalled when a client is pushed back or the limits change */
+	int refs; /* References from Lua handles and popped clients */
+	int min, max; /* Minimum and maximum number of clients */
+	int keep; /* Number of idle clients kept by the driver ('minPoolSize' in URI), 0 for all */
+	double timeout; /* Default timeout of 'pool:pop()' in seconds, 0 to fail at once */
+	int inuse, waiting, idle, size; /* Gauges */
+	int64_t created; /* Total number of clients created */
+} Pool;
+
+static Mutex mutex = MUTEX_INIT; /* Guards the list of pools and their state */
+static Pool *pools;
+
+static char POOLS; /* Registry key of the table of pool handles by URI */
+
+static double now(void) {
+#ifdef _WIN32
+	return GetTickCount64() * 1e-3;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+/* Waits on 'cond' until 'deadline' (forever if negative) */
+static void condWait(Cond *cond, Mutex *m, double deadline) {
+#ifdef _WIN32
+	double t = deadline - now();
+	SleepConditionVariableSRW(cond, m, deadline < 0 ? INFINITE : t > 0 ? (DWORD)(t * 1e3) : 0, 0);
+#else
+	struct timespec ts;
+	if (deadline < 0) {
+		pthread_cond_wait(cond, m);
+		return;
+	}
+	ts.tv_sec = (time_t)deadline;
+	ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+	pthread_cond_timedwait(cond, m, &ts);
+#endif
+}
+
+/* Creates a pool for 'str', returns NULL on error */
+static Pool *newPool(const char *str, bson_error_t *error) {
+	mongoc_uri_t *uri;
+	mongoc_client_pool_t *pool;
+	Pool *p;
+	if (!(uri = mongoc_uri_new_with_error(str, error))) return 0;
+	if (!(pool = mongoc_client_pool_new(uri))) {
+		bson_set_error(error, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NO_ACCEPTABLE_PEER, "SSL is not supported");
+		mongoc_uri_destroy(uri);
+		return 0;
+	}
+	mongoc_client_pool_set_error_api(pool, MONGOC_ERROR_API_VERSION_2);
+	p = bson_malloc0(sizeof *p);
+	p->uri = bson_strdup(str);
+	p->pool = pool;
+	condInit(&p->cond);
+	p->refs = 1;
+	p->keep = mongoc_uri_get_option_as_int32(uri, MONGOC_URI_MINPOOLSIZE, 0);
+	p->max = mongoc_uri_get_option_as_int32(uri, MONGOC_URI_MAXPOOLSIZE, 100);
+	p->timeout = mongoc_uri_get_option_as_int32(uri, MONGOC_URI_WAITQUEUETIMEOUTMS, 0) * 1e-3;
+	mongoc_uri_destroy(uri);
+	return p;
+}
+
+/* Finds or creates a pool for 'str', returns NULL on error */
+static Pool *getPool(const char *str, bson_error_t *error) {
+	Pool *p;
+	mutexLock(&mutex); /* Held while creating, so that a URI never gets two pools */
+	for (p = pools; p; p = p->next) if (!strcmp(p->uri, str)) break;
+	if (p) ++p->refs;
+	else if ((p = newPool(str, error))) {
+		p->next = pools;
+		pools = p;
+	}
+	mutexUnlock(&mutex);
+	return p;
+}
+
+/* Drops a reference to a pool, returns 'true' if it was the last one and the pool should be
+   destroyed (with 'mutex' held) */
+static bool unrefPool(Pool *p) {
+	Pool **pp = &pools;
+	if (--p->refs) return false;
+	while (*pp != p) pp = &(*pp)->next;
+	*pp = p->next;
+	return true;
+}
+
+static void destroyPool(Pool *p) {
+	mongoc_client_pool_destroy(p->pool);
+	condDestroy(&p->cond);
+	bson_free(p->uri);
+	bson_free(p);
+}
+
+/* Pops a client without waiting (with 'mutex' held) */
+static mongoc_client_t *tryPop(Pool *p) {
+	mongoc_client_t *client = mongoc_client_pool_try_pop(p->pool);
+	if (!client) return 0;
+	if (p->idle) --p->idle;
+	else ++p->size, ++p->created; /* The driver created a new client */
+	++p->inuse;
+	++p->refs;
+	return client;
+}
+
+/* Pushes a client back, returns 'true' if the pool should be destroyed (with 'mutex' held) */
+static bool pushClient(Pool *p, mongoc_client_t *client) {
+	mongoc_client_pool_push(p->pool, client);
+	if (++p->idle > p->keep && p->keep) --p->idle, --p->size; /* The driver destroyed the oldest idle client */
+	--p->inuse;
+	condSignal(&p->cond);
+	return unrefPool(p);
+}
+
+/* Applies size limits, creating clients up to the minimum size (with 'mutex' held) */
+static void setLimits(Pool *p, int min, int max) {
+	mongoc_client_t **clients;
+	int i, n = 0;
+	if (min >= 0) p->min = min;
+	if (max >= 0) mongoc_client_pool_max_size(p->pool, p->max = max);
+	condBroadcast(&p->cond);
+	if (p->size >= p->min) return;
+	clients = bson_malloc(p->min * sizeof *clients); /* Idle clients are popped first */
+	while (p->size < p->min && (clients[n] = tryPop(p))) ++n;
+	for (i = 0; i < n; ++i) pushClient(p, clients[i]);
+	bson_free(clients);
+}
+
+static Pool *checkPool(lua_State *L, int idx) {
+	return *(Pool **)luaL_checkudata(L, idx, TYPE_CLIENTPOOL);
+}
+
+/* Returns the pool of a pooled client handle at 'idx' */
+static Pool *toPool(lua_State *L, int idx) {
+	Pool *p;
+	lua_getuservalue(L, idx);
+	lua_rawgeti(L, -1, 3); /* env[3]: pool's environment */
+	lua_rawgeti(L, -1, 1); /* env[1]: pool handle */
+	p = *(Pool **)lua_touserdata(L, -1);
+	lua_pop(L, 3);
+	return p;
+}
+
+/* Checks if a pooled client handle at 'idx' has dependants that are not finalized */
+static bool hasDependants(lua_State *L, int idx) {
+	bool res = false;
+	lua_getuservalue(L, idx);
+	lua_rawgeti(L, -1, 4); /* env[4]: set of dependants */
+	lua_pushnil(L);
+	while (!res && lua_next(L, -2)) {
+		lua_pop(L, 1);
+		if (lua_getmetatable(L, -1)) { /* Finalized handles have no metatable */
+			lua_pop(L, 2);
+			res = true;
+		}
+	}
+	lua_pop(L, 2);
+	return res;
+}
+
+static int m_pop(lua_State *L) {
+	Pool *p = checkPool(L, 1);
+	double timeout = luaL_optnumber(L, 2, p->timeout);
+	double deadline = timeout > 0 ? now() + timeout : -1;
+	mongoc_client_t *client;
+	mutexLock(&mutex);
+	client = tryPop(p);
+	mutexUnlock(&mutex);
+	if (!client) { /* Clients held by unreachable handles are pushed back when collected */
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		mutexLock(&mutex);
+		while (!(client = tryPop(p)) && timeout) {
+			if (timeout > 0 && now() >= deadline) break;
+			++p->waiting;
+			condWait(&p->cond, &mutex, deadline);
+			--p->waiting;
+		}
+		mutexUnlock(&mutex);
+	}
+	if (!client) {
+		lua_pushnil(L);
+		if (timeout) lua_pushliteral(L, "timeout");
+		else lua_pushliteral(L, "pool exhausted");
+		return 2;
+	}
+	pushPooledClient(L, client, 1);
+	return 1;
+}
+
+static int m_push(lua_State *L) {
+	Pool *p = checkPool(L, 1);
+	checkClient(L, 2);
+	luaL_argcheck(L, getHandleMode(L, 2) && toPool(L, 2) == p, 2, "client does not belong to pool");
+	if (!hasDependants(L, 2)) releaseClient(L, 2); /* Otherwise, it is pushed back when collected */
+	return 0;
+}
+
+static int m_stats(lua_State *L) {
+	Pool s, *p = checkPool(L, 1);
+	mutexLock(&mutex);
+	s = *p; /* Take a consistent snapshot */
+	mutexUnlock(&mutex);
+	lua_createtable(L, 0, 7);
+	pushInt32(L, s.inuse);
+	lua_setfield(L, -2, "in_use");
+	pushInt32(L, s.waiting);
+	lua_setfield(L, -2, "waiting");
+	pushInt32(L, s.idle);
+	lua_setfield(L, -2, "idle");
+	pushInt32(L, s.size);
+	lua_setfield(L, -2, "size");
+	pushInt64(L, s.created);
+	lua_setfield(L, -2, "created");
+	pushInt32(L, s.min);
+	lua_setfield(L, -2, "min");
+	pushInt32(L, s.max);
+	lua_setfield(L, -2, "max");
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	Pool *p = checkPool(L, 1);
+	bool last;
+	mutexLock(&mutex);
+	last = unrefPool(p);
+	mutexUnlock(&mutex);
+	if (last) destroyPool(p);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"pop", m_pop},
+	{"push", m_push},
+	{"stats", m_stats},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+/* Returns pool size option 'key' of the table at 'idx', or -1 if it is not set */
+static int optSize(lua_State *L, int idx, const char *key, int min) {
+	int n = -1;
+	lua_getfield(L, idx, key);
+	if (!lua_isnil(L, -1)) {
+		n = lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : -1;
+		argCheck(L, n >= min, idx, "invalid option '%s'", key);
+	}
+	lua_pop(L, 1);
+	return n;
+}
+
+int newClientPool(lua_State *L) {
+	const char *str = luaL_checkstring(L, 1);
+	int min = -1, max = -1;
+	bson_error_t error;
+	Pool *p;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		min = optSize(L, 2, "min", 0);
+		max = optSize(L, 2, "max", 1);
+	}
+	lua_settop(L, 2);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &POOLS);
+	if (lua_isnil(L, 3)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, 3);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &POOLS);
+	}
+	lua_pushvalue(L, 1);
+	lua_rawget(L, 3);
+	if (lua_isnil(L, 4)) { /* First use in this state */
+		lua_pop(L, 1);
+		argCheck(L, p = getPool(str, &error), 1, "%s", error.message);
+		pushHandle(L, p, 0, 0);
+		setType(L, TYPE_CLIENTPOOL, funcs);
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 4);
+		lua_rawset(L, 3); /* Keep the handle for the lifetime of the state */
+	} else p = checkPool(L, 4);
+	if (min < 0 && max < 0) return 1;
+	mutexLock(&mutex);
+	setLimits(p, min, max);
+	mutexUnlock(&mutex);
+	return 1;
+}
+
+void releaseClient(lua_State *L, int idx) {
+	mongoc_client_t **client = luaL_checkudata(L, idx, TYPE_CLIENT);
+	Pool *p;
+	bool last;
+	if (!*client) return; /* Already pushed */
+	p = toPool(L, idx);
+	mutexLock(&mutex);
+	last = pushClient(p, *client);
+	mutexUnlock(&mutex);
+	if (last) destroyPool(p);
+	*client = 0;
+}
@@ -66,6 +66,19 @@ static int m_find(lua_State *L) {
 	return 1;
 }
 
+static int m_findAll(lua_State *L) {
+	mongoc_collection_t *collection = checkCollection(L, 1);
+	bson_t *query = castBSON(L, 2);
+	bson_t *options = toBSON(L, 3);
+	mongoc_read_prefs_t *prefs = toReadPrefs(L, 4);
+	bson_error_t error;
+	lua_settop(L, 4);
+	lua_pushnil(L); /* No handler */
+	pushCursor(L, mongoc_collection_find_with_opts(collection, query, options, prefs), 1);
+	if (!unpackCursor(L, checkCursor(L, 6), -1, 5, &error)) return commandError(L, &error);
+	return 1;
+}
+
 static int m_findAndModify(lua_State *L) {
 	mongoc_collection_t *collection = checkCollection(L, 1);
 	bson_t *query = castBSON(L, 2);
@@ -115,8 +128,8 @@ static int m_getReadPrefs(lua_State *L) {
 
 static int m_insert(lua_State *L) {
 	mongoc_collection_t *collection = checkCollection(L, 1);
-	bson_t *document = castBSON(L, 2);
 	int flags = toInsertFlags(L, 3);
+	bson_t *document = castScratchBSON(L, 2);
 	bson_error_t error;
 	return commandStatus(L, mongoc_collection_insert(collection, flags, document, 0, &error), &error);
 }
@@ -155,10 +168,18 @@ static int m_update(lua_State *L) {
 	return commandStatus(L, mongoc_collection_update(collection, flags, query, update, 0, &error), &error);
 }
 
+static int m_watch(lua_State *L) {
+	mongoc_collection_t *collection = checkCollection(L, 1);
+	bson_t *pipeline = toBSON(L, 2);
+	bson_t *options = toBSON(L, 3);
+	bson_t empty = BSON_INITIALIZER;
+	pushChangeStream(L, mongoc_collection_watch(collection, pipeline ? pipeline : &empty, options), options, 1);
+	return 1;
+}
+
 static int m__gc(lua_State *L) {
 	mongoc_collection_t *collection = checkCollection(L, 1);
-	if (getHandleMode(L, 1)) return 0; /* Reference handle */
-	mongoc_collection_destroy(collection);
+	if (!getHandleMode(L, 1)) mongoc_collection_destroy(collection); /* Not a reference handle */
 	unsetType(L);
 	return 0;
 }
@@ -169,6 +190,7 @@ static const luaL_Reg funcs[] = {
 	{"create_bulk_operation", m_createBulkOperation},
 	{"drop", m_drop},
 	{"find", m_find},
+	{"find_all", m_findAll},
 	{"find_and_modify", m_findAndModify},
 	{"find_one", m_findOne},
 	{"get_name", m_getName},
@@ -176,6 +198,7 @@ static const luaL_Reg funcs[] = {
 	{"remove", m_remove},
 	{"rename", m_rename},
 	{"update", m_update},
+	{"watch", m_watch},
 	{"get_read_prefs", m_getReadPrefs},
 	{"set_read_prefs", m_setReadPrefs},
 	{"__gc", m__gc},
@@ -34,10 +34,14 @@
 #define MODNAME "lua-mongo"
 #define VERSION "1.2.1"
 
+#define TYPE_ASYNCCLIENT "mongo.AsyncClient"
+#define TYPE_ASYNCOPERATION "mongo.AsyncOperation"
 #define TYPE_BINARY "mongo.Binary"
 #define TYPE_BSON "mongo.BSON"
 #define TYPE_BULKOPERATION "mongo.BulkOperation"
+#define TYPE_CHANGESTREAM "mongo.ChangeStream"
 #define TYPE_CLIENT "mongo.Client"
+#define TYPE_CLIENTPOOL "mongo.ClientPool"
 #define TYPE_COLLECTION "mongo.Collection"
 #define TYPE_CURSOR "mongo.Cursor"
 #define TYPE_DATABASE "mongo.Database"
@@ -45,13 +49,18 @@
 #define TYPE_DECIMAL128 "mongo.Decimal128"
 #define TYPE_DOUBLE "mongo.Double"
 #define TYPE_GRIDFS "mongo.GridFS"
+#define TYPE_GRIDFSBUCKET "mongo.GridFSBucket"
+#define TYPE_GRIDFSDOWNLOAD "mongo.GridFSDownload"
 #define TYPE_GRIDFSFILE "mongo.GridFSFile"
 #define TYPE_GRIDFSFILELIST "mongo.GridFSFileList"
+#define TYPE_GRIDFSUPLOAD "mongo.GridFSUpload"
 #define TYPE_INT32 "mongo.Int32"
 #define TYPE_INT64 "mongo.Int64"
 #define TYPE_JAVASCRIPT "mongo.Javascript"
+#define TYPE_LAZYBSON "mongo.LazyBSON"
 #define TYPE_MAXKEY "mongo.MaxKey"
 #define TYPE_MINKEY "mongo.MinKey"
+#define TYPE_MONITOR "mongo.Monitor"
 #define TYPE_NULL "mongo.Null"
 #define TYPE_OBJECTID "mongo.ObjectId"
 #define TYPE_READPREFS "mongo.ReadPrefs"
@@ -61,9 +70,11 @@
 extern char NEW_BINARY, NEW_DATETIME, NEW_DECIMAL128, NEW_JAVASCRIPT, NEW_REGEX, NEW_TIMESTAMP;
 extern char GLOBAL_MAXKEY, GLOBAL_MINKEY, GLOBAL_NULL;
 
+int newAsyncClient(lua_State *L);
 int newBinary(lua_State *L);
 int newBSON(lua_State *L);
 int newClient(lua_State *L);
+int newClientPool(lua_State *L);
 int newDateTime(lua_State *L);
 int newDecimal128(lua_State *L);
 int newDouble(lua_State *L);
@@ -76,28 +87,39 @@ int newReadPrefs(lua_State *L);
 int newRegex(lua_State *L);
 int newTimestamp(lua_State *L);
 
+int setDateTimeFormat(lua_State *L);
+
 void pushBSON(lua_State *L, const bson_t *bson, int hidx);
 void pushBSONWithSteal(lua_State *L, bson_t *bson);
 void pushBSONValue(lua_State *L, const bson_value_t *val);
 void pushBSONField(lua_State *L, const bson_t *bson, const char *key, bool any);
+void pushLazyBSON(lua_State *L, const bson_t *bson);
 void pushBulkOperation(lua_State *L, mongoc_bulk_operation_t *bulk, int pidx);
+void pushChangeStream(lua_State *L, mongoc_change_stream_t *stream, const bson_t *options, int pidx);
 void pushCollection(lua_State *L, mongoc_collection_t *collection, bool ref, int pidx);
 void pushCursor(lua_State *L, mongoc_cursor_t *cursor, int pidx);
 void pushDatabase(lua_State *L, mongoc_database_t *database, int pidx);
 void pushGridFS(lua_State *L, mongoc_gridfs_t *gridfs, int pidx);
+void pushGridFSBucket(lua_State *L, mongoc_gridfs_bucket_t *bucket, mongoc_database_t *database, const bson_t *options, const mongoc_read_prefs_t *prefs, int pidx);
+void pushGridFSDownload(lua_State *L, bson_t *file, mongoc_cursor_t *cursor, int pidx);
 void pushGridFSFile(lua_State *L, mongoc_gridfs_file_t *file, int pidx);
 void pushGridFSFileList(lua_State *L, mongoc_gridfs_file_list_t *list, int pidx);
+void pushGridFSUpload(lua_State *L, mongoc_stream_t *stream, const bson_value_t *id, int pidx);
 void pushMaxKey(lua_State *L);
 void pushMinKey(lua_State *L);
 void pushNull(lua_State *L);
 void pushObjectId(lua_State *L, const bson_oid_t *oid);
+void pushPooledClient(lua_State *L, mongoc_client_t *client, int pidx);
 void pushReadPrefs(lua_State *L, const mongoc_read_prefs_t *prefs);
 
 int iterateCursor(lua_State *L, mongoc_cursor_t *cursor, int hidx);
+bool unpackCursor(lua_State *L, mongoc_cursor_t *cursor, lua_Integer n, int hidx, bson_error_t *error);
+void releaseClient(lua_State *L, int idx);
 
 bson_t *checkBSON(lua_State *L, int idx);
 bson_t *testBSON(lua_State *L, int idx);
 bson_t *castBSON(lua_State *L, int idx);
+bson_t *castScratchBSON(lua_State *L, int idx);
 bson_t *toBSON(lua_State *L, int idx);
 
 void toBSONValue(lua_State *L, int idx, bson_value_t *val);
@@ -22,6 +22,9 @@
 
 #include "common.h"
 
+#define DEFBATCH 100 /* Default number of documents per batch */
+#define MAXPRESIZE 1000 /* Maximum number of documents to presize a batch for */
+
 static int m_more(lua_State *L) {
 	lua_pushboolean(L, mongoc_cursor_more(checkCursor(L, 1)));
 	return 1;
@@ -31,6 +34,22 @@ static int m_next(lua_State *L) {
 	return iterateCursor(L, checkCursor(L, 1), 0);
 }
 
+static int m_nextBatch(lua_State *L) {
+	mongoc_cursor_t *cursor = checkCursor(L, 1);
+	lua_Integer n = mongoc_cursor_get_batch_size(cursor);
+	bson_error_t error;
+	n = luaL_optinteger(L, 2, n ? n : DEFBATCH);
+	luaL_argcheck(L, n > 0, 2, "invalid number of documents");
+	lua_settop(L, 3);
+	if (!mongoc_cursor_more(cursor) && !mongoc_cursor_error(cursor, &error)) { /* Exhausted by previous batch */
+		lua_pushnil(L);
+		return 1;
+	}
+	if (!unpackCursor(L, cursor, n, 3, &error) && !lua_rawlen(L, -1)) checkStatus(L, false, &error);
+	if (!lua_rawlen(L, -1)) lua_pushnil(L); /* No more documents */
+	return 1;
+}
+
 static int m_value(lua_State *L) {
 	return iterateCursor(L, checkCursor(L, 1), 2);
 }
@@ -44,6 +63,7 @@ static int m__gc(lua_State *L) {
 static const luaL_Reg funcs[] = {
 	{"more", m_more},
 	{"next", m_next},
+	{"next_batch", m_nextBatch},
 	{"value", m_value},
 	{"__gc", m__gc},
 	{0, 0}
@@ -89,6 +109,19 @@ int iterateCursor(lua_State *L, mongoc_cursor_t *cursor, int hidx) {
 	return 1;
 }
 
+/* Pushes an array of at most 'n' (unlimited if negative) values read from 'cursor' and unpacked
+   with handler at 'hidx'. On error, returns 'false' with the values read so far. */
+bool unpackCursor(lua_State *L, mongoc_cursor_t *cursor, lua_Integer n, int hidx, bson_error_t *error) {
+	const bson_t *bson;
+	lua_Integer i = 0;
+	lua_createtable(L, n > 0 && n < MAXPRESIZE ? n : 0, 0);
+	while (i != n && mongoc_cursor_next(cursor, &bson)) {
+		pushBSON(L, bson, hidx);
+		lua_rawseti(L, -2, ++i);
+	}
+	return !mongoc_cursor_error(cursor, error);
+}
+
 mongoc_cursor_t *checkCursor(lua_State *L, int idx) {
 	return *(mongoc_cursor_t **)luaL_checkudata(L, idx, TYPE_CURSOR);
 }
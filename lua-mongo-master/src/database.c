@@ -64,6 +64,17 @@ static int m_getCollectionNames(lua_State *L) {
 	return commandStrVec(L, mongoc_database_get_collection_names_with_opts(database, options, &error), &error);
 }
 
+static int m_getGridFSBucket(lua_State *L) {
+	mongoc_database_t *database = checkDatabase(L, 1);
+	bson_t *options = toBSON(L, 2);
+	mongoc_read_prefs_t *prefs = toReadPrefs(L, 3);
+	bson_error_t error;
+	mongoc_gridfs_bucket_t *bucket = mongoc_gridfs_bucket_new(database, options, prefs, &error);
+	if (!bucket) return commandError(L, &error);
+	pushGridFSBucket(L, bucket, database, options, prefs, 1);
+	return 1;
+}
+
 static int m_getName(lua_State *L) {
 	lua_pushstring(L, mongoc_database_get_name(checkDatabase(L, 1)));
 	return 1;
@@ -101,6 +112,15 @@ static int m_setReadPrefs(lua_State *L) {
 	return 0;
 }
 
+static int m_watch(lua_State *L) {
+	mongoc_database_t *database = checkDatabase(L, 1);
+	bson_t *pipeline = toBSON(L, 2);
+	bson_t *options = toBSON(L, 3);
+	bson_t empty = BSON_INITIALIZER;
+	pushChangeStream(L, mongoc_database_watch(database, pipeline ? pipeline : &empty, options), options, 1);
+	return 1;
+}
+
 static int m__gc(lua_State *L) {
 	mongoc_database_destroy(checkDatabase(L, 1));
 	unsetType(L);
@@ -113,10 +133,12 @@ static const luaL_Reg funcs[] = {
 	{"drop", m_drop},
 	{"get_collection", m_getCollection},
 	{"get_collection_names", m_getCollectionNames},
+	{"get_grid_fs_bucket", m_getGridFSBucket},
 	{"get_name", m_getName},
 	{"has_collection", m_hasCollection},
 	{"remove_all_users", m_removeAllUsers},
 	{"remove_user", m_removeUser},
+	{"watch", m_watch},
 	{"get_read_prefs", m_getReadPrefs},
 	{"set_read_prefs", m_setReadPrefs},
 	{"__gc", m__gc},
@@ -0,0 +1,150 @@
+/*
+** Copyright (C) 2016-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+typedef struct GridFSBucket {
+	mongoc_gridfs_bucket_t *bucket;
+	mongoc_collection_t *files, *chunks; /* Used to read files directly */
+} GridFSBucket;
+
+static GridFSBucket *checkBucket(lua_State *L, int idx) {
+	return *(GridFSBucket **)luaL_checkudata(L, idx, TYPE_GRIDFSBUCKET);
+}
+
+static int m_delete(lua_State *L) {
+	GridFSBucket *bucket = checkBucket(L, 1);
+	bson_value_t id;
+	bson_error_t error;
+	bool status;
+	toBSONValue(L, 2, &id);
+	status = mongoc_gridfs_bucket_delete_by_id(bucket->bucket, &id, &error);
+	bson_value_destroy(&id);
+	return commandStatus(L, status, &error);
+}
+
+static int m_find(lua_State *L) {
+	GridFSBucket *bucket = checkBucket(L, 1);
+	bson_t *filter = castBSON(L, 2);
+	bson_t *options = toBSON(L, 3);
+	pushCursor(L, mongoc_gridfs_bucket_find(bucket->bucket, filter, options), 1);
+	return 1;
+}
+
+static int m_openDownload(lua_State *L) {
+	GridFSBucket *bucket = checkBucket(L, 1);
+	lua_Integer readahead = luaL_optinteger(L, 3, 0);
+	bson_value_t id;
+	bson_t filter, opts;
+	const bson_t *doc;
+	bson_t *file = 0;
+	mongoc_cursor_t *cursor;
+	bson_error_t error;
+	luaL_argcheck(L, readahead >= 0 && readahead <= INT32_MAX, 3, "out of range");
+	toBSONValue(L, 2, &id);
+	bson_init(&filter);
+	BSON_APPEND_VALUE(&filter, "_id", &id);
+	bson_init(&opts);
+	BSON_APPEND_INT64(&opts, "limit", 1);
+	cursor = mongoc_collection_find_with_opts(bucket->files, &filter, &opts, 0);
+	if (mongoc_cursor_next(cursor, &doc)) file = bson_copy(doc);
+	else if (!mongoc_cursor_error(cursor, &error))
+		bson_set_error(&error, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_BUCKET_FILE_NOT_FOUND, "No file with given id exists");
+	mongoc_cursor_destroy(cursor);
+	bson_destroy(&filter);
+	bson_destroy(&opts);
+	if (!file) {
+		bson_value_destroy(&id);
+		return commandError(L, &error);
+	}
+	/* Chunks are read in batches of 'readahead' so that each round trip fetches several of them */
+	bson_init(&filter);
+	BSON_APPEND_VALUE(&filter, "files_id", &id);
+	bson_init(&opts);
+	BCON_APPEND(&opts, "sort", "{", "n", BCON_INT32(1), "}");
+	if (readahead) BSON_APPEND_INT32(&opts, "batchSize", (int32_t)readahead);
+	cursor = mongoc_collection_find_with_opts(bucket->chunks, &filter, &opts, 0);
+	bson_destroy(&filter);
+	bson_destroy(&opts);
+	bson_value_destroy(&id);
+	pushGridFSDownload(L, file, cursor, 1);
+	return 1;
+}
+
+static int m_openUpload(lua_State *L) {
+	GridFSBucket *bucket = checkBucket(L, 1);
+	const char *filename = luaL_checkstring(L, 2);
+	bson_t *options = toBSON(L, 3);
+	bson_value_t id;
+	bson_error_t error;
+	mongoc_stream_t *stream;
+	if (lua_isnoneornil(L, 4)) stream = mongoc_gridfs_bucket_open_upload_stream(bucket->bucket, filename, options, &id, &error);
+	else {
+		toBSONValue(L, 4, &id);
+		stream = mongoc_gridfs_bucket_open_upload_stream_with_id(bucket->bucket, &id, filename, options, &error);
+	}
+	if (!stream) {
+		if (!lua_isnoneornil(L, 4)) bson_value_destroy(&id);
+		return commandError(L, &error);
+	}
+	pushGridFSUpload(L, stream, &id, 1);
+	bson_value_destroy(&id);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	GridFSBucket *bucket = checkBucket(L, 1);
+	mongoc_collection_destroy(bucket->files);
+	mongoc_collection_destroy(bucket->chunks);
+	mongoc_gridfs_bucket_destroy(bucket->bucket);
+	bson_free(bucket);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"delete", m_delete},
+	{"find", m_find},
+	{"open_download", m_openDownload},
+	{"open_upload", m_openUpload},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+void pushGridFSBucket(lua_State *L, mongoc_gridfs_bucket_t *bucket, mongoc_database_t *database, const bson_t *options, const mongoc_read_prefs_t *prefs, int pidx) {
+	GridFSBucket *b = bson_malloc(sizeof *b);
+	const char *name = "fs";
+	char buf[128];
+	bson_iter_t iter;
+	if (options && bson_iter_init_find(&iter, options, "bucketName") && BSON_ITER_HOLDS_UTF8(&iter)) name = bson_iter_utf8(&iter, 0);
+	b->bucket = bucket;
+	bson_snprintf(buf, sizeof buf, "%s.files", name); /* Same buffer size as in mongoc_gridfs_bucket_new() */
+	b->files = mongoc_database_get_collection(database, buf);
+	bson_snprintf(buf, sizeof buf, "%s.chunks", name);
+	b->chunks = mongoc_database_get_collection(database, buf);
+	if (prefs) {
+		mongoc_collection_set_read_prefs(b->files, prefs);
+		mongoc_collection_set_read_prefs(b->chunks, prefs);
+	}
+	pushHandle(L, b, 0, pidx); /* New environment due to dependants */
+	setType(L, TYPE_GRIDFSBUCKET, funcs);
+}
@@ -0,0 +1,166 @@
+/*
+** Copyright (C) 2016-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+typedef struct GridFSDownload {
+	mongoc_cursor_t *cursor; /* Chunks sorted by number */
+	bson_t *file;
+	int64_t length;
+	int32_t chunkSize;
+	int64_t chunks; /* Number of chunks */
+	int64_t n; /* Number of the next chunk */
+	const uint8_t *data; /* Unread data of the current chunk (valid until the cursor advances) */
+	uint32_t len;
+	bool failed;
+	bson_error_t error;
+} GridFSDownload;
+
+static GridFSDownload *checkDownload(lua_State *L, int idx) {
+	return *(GridFSDownload **)luaL_checkudata(L, idx, TYPE_GRIDFSDOWNLOAD);
+}
+
+static bool fail(GridFSDownload *download, uint32_t code, const char *msg) {
+	bson_set_error(&download->error, MONGOC_ERROR_GRIDFS, code, msg, download->n);
+	download->failed = true;
+	return false;
+}
+
+/* Fetches the next chunk, returns false on EOF or error */
+static bool nextChunk(GridFSDownload *download) {
+	const bson_t *doc;
+	bson_iter_t iter;
+	bson_subtype_t subtype;
+	int64_t size;
+	if (download->failed || download->n == download->chunks) return false;
+	if (!mongoc_cursor_next(download->cursor, &doc)) {
+		if (!mongoc_cursor_error(download->cursor, &download->error)) return fail(download, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk %" PRId64 ".");
+		download->failed = true;
+		return false;
+	}
+	if (!bson_iter_init_find(&iter, doc, "n") || !BSON_ITER_HOLDS_NUMBER(&iter)) return fail(download, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk %" PRId64 " missing a required field 'n'.");
+	if (bson_iter_as_int64(&iter) != download->n) return fail(download, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk %" PRId64 ".");
+	if (!bson_iter_init_find(&iter, doc, "data") || !BSON_ITER_HOLDS_BINARY(&iter)) return fail(download, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk %" PRId64 " missing a required field 'data'.");
+	bson_iter_binary(&iter, &subtype, &download->len, &download->data);
+	size = ++download->n == download->chunks ? download->length - (download->chunks - 1) * download->chunkSize : download->chunkSize;
+	if (download->len != size) {
+		download->len = 0;
+		--download->n;
+		return fail(download, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk %" PRId64 " has wrong size.");
+	}
+	return true;
+}
+
+static int downloadError(lua_State *L, GridFSDownload *download) {
+	lua_pushnil(L);
+	if (!download->failed) return 1; /* EOF */
+	lua_pushstring(L, download->error.message);
+	return 2;
+}
+
+static int m_getFile(lua_State *L) {
+	pushBSON(L, checkDownload(L, 1)->file, 0);
+	return 1;
+}
+
+static int m_getLength(lua_State *L) {
+	pushInt64(L, checkDownload(L, 1)->length);
+	return 1;
+}
+
+static int m_read(lua_State *L) {
+	GridFSDownload *download = checkDownload(L, 1);
+	lua_Integer maxlen;
+	luaL_Buffer b;
+	if (lua_isnoneornil(L, 2)) { /* Rest of the current chunk or the next one as is */
+		if (!download->len && !nextChunk(download)) return downloadError(L, download);
+		lua_pushlstring(L, (const char *)download->data, download->len);
+		download->len = 0;
+		return 1;
+	}
+	maxlen = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, maxlen > 0, 2, "must be positive");
+	luaL_buffinit(L, &b);
+	while (maxlen > 0 && (download->len || nextChunk(download))) {
+		uint32_t len = maxlen < download->len ? (uint32_t)maxlen : download->len;
+		luaL_addlstring(&b, (const char *)download->data, len);
+		download->data += len;
+		download->len -= len;
+		maxlen -= len;
+	}
+	luaL_pushresult(&b);
+	if (download->failed || !lua_rawlen(L, -1)) return downloadError(L, download);
+	return 1;
+}
+
+static int m_writeTo(lua_State *L) {
+	GridFSDownload *download = checkDownload(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	while (download->len || nextChunk(download)) {
+		lua_pushvalue(L, 2);
+		lua_pushlstring(L, (const char *)download->data, download->len);
+		download->len = 0;
+		lua_call(L, 1, 2);
+		if (!lua_toboolean(L, -2) && (lua_isboolean(L, -2) || !lua_isnil(L, -1))) { /* Stopped by sink */
+			lua_pushnil(L);
+			lua_replace(L, -3);
+			return 2;
+		}
+		lua_pop(L, 2);
+	}
+	if (download->failed) return downloadError(L, download);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	GridFSDownload *download = checkDownload(L, 1);
+	mongoc_cursor_destroy(download->cursor);
+	bson_destroy(download->file);
+	bson_free(download);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"get_file", m_getFile},
+	{"get_length", m_getLength},
+	{"read", m_read},
+	{"write_to", m_writeTo},
+	{"__len", m_getLength},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+void pushGridFSDownload(lua_State *L, bson_t *file, mongoc_cursor_t *cursor, int pidx) {
+	GridFSDownload *download = bson_malloc0(sizeof *download);
+	bson_iter_t iter;
+	download->cursor = cursor;
+	download->file = file;
+	if (bson_iter_init_find(&iter, file, "length") && BSON_ITER_HOLDS_NUMBER(&iter)) download->length = bson_iter_as_int64(&iter);
+	if (bson_iter_init_find(&iter, file, "chunkSize") && BSON_ITER_HOLDS_NUMBER(&iter)) download->chunkSize = bson_iter_as_int64(&iter);
+	if (download->length < 0 || (download->length && download->chunkSize <= 0))
+		fail(download, MONGOC_ERROR_GRIDFS_CORRUPT, "File has invalid length or chunk size.");
+	else if (download->length) download->chunks = (download->length - 1) / download->chunkSize + 1;
+	pushHandle(L, download, -1, pidx);
+	setType(L, TYPE_GRIDFSDOWNLOAD, funcs);
+}
@@ -0,0 +1,112 @@
+/*
+** Copyright (C) 2016-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+typedef struct GridFSUpload {
+	mongoc_stream_t *stream; /* NULL when closed */
+	bson_value_t id;
+} GridFSUpload;
+
+static GridFSUpload *checkUpload(lua_State *L, int idx) {
+	return *(GridFSUpload **)luaL_checkudata(L, idx, TYPE_GRIDFSUPLOAD);
+}
+
+static mongoc_stream_t *checkStream(lua_State *L, int idx) {
+	mongoc_stream_t *stream = checkUpload(L, idx)->stream;
+	luaL_argcheck(L, stream, idx, "upload is closed");
+	return stream;
+}
+
+static int uploadError(lua_State *L, mongoc_stream_t *stream) {
+	bson_error_t error;
+	mongoc_gridfs_bucket_stream_error(stream, &error);
+	return commandError(L, &error);
+}
+
+static int m_abort(lua_State *L) {
+	GridFSUpload *upload = checkUpload(L, 1);
+	mongoc_stream_t *stream = checkStream(L, 1);
+	bson_error_t error;
+	bool status = mongoc_gridfs_bucket_abort_upload(stream);
+	if (!status) mongoc_gridfs_bucket_stream_error(stream, &error);
+	mongoc_stream_destroy(stream);
+	upload->stream = 0;
+	return commandStatus(L, status, &error);
+}
+
+static int m_close(lua_State *L) {
+	GridFSUpload *upload = checkUpload(L, 1);
+	mongoc_stream_t *stream = checkStream(L, 1);
+	bson_error_t error;
+	bool status = !mongoc_stream_close(stream);
+	if (!status) mongoc_gridfs_bucket_stream_error(stream, &error);
+	mongoc_stream_destroy(stream);
+	upload->stream = 0;
+	if (!status) return commandError(L, &error);
+	pushBSONValue(L, &upload->id);
+	return 1;
+}
+
+static int m_getId(lua_State *L) {
+	pushBSONValue(L, &checkUpload(L, 1)->id);
+	return 1;
+}
+
+static int m_write(lua_State *L) {
+	mongoc_stream_t *stream = checkStream(L, 1);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	ssize_t n = mongoc_stream_write(stream, (void *)data, len, 0);
+	if (n < 0) return uploadError(L, stream);
+	lua_pushinteger(L, (lua_Integer)n);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	GridFSUpload *upload = checkUpload(L, 1);
+	if (upload->stream) {
+		mongoc_gridfs_bucket_abort_upload(upload->stream);
+		mongoc_stream_destroy(upload->stream);
+	}
+	bson_value_destroy(&upload->id);
+	bson_free(upload);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"abort", m_abort},
+	{"close", m_close},
+	{"get_id", m_getId},
+	{"write", m_write},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+void pushGridFSUpload(lua_State *L, mongoc_stream_t *stream, const bson_value_t *id, int pidx) {
+	GridFSUpload *upload = bson_malloc0(sizeof *upload);
+	upload->stream = stream;
+	bson_value_copy(id, &upload->id);
+	pushHandle(L, upload, -1, pidx);
+	setType(L, TYPE_GRIDFSUPLOAD, funcs);
+}
@@ -57,9 +57,12 @@ static int f_type(lua_State *L) {
 
 static const luaL_Reg funcs[] = {
 	{"type", f_type},
+	{"set_datetime_format", setDateTimeFormat},
+	{"AsyncClient", newAsyncClient},
 	{"Binary", newBinary},
 	{"BSON", newBSON},
 	{"Client", newClient},
+	{"ClientPool", newClientPool},
 	{"DateTime", newDateTime},
 	{"Decimal128", newDecimal128},
 	{"Double", newDouble},
@@ -66,6 +66,23 @@ int typeError(lua_State *L, int idx, const char *name) {
 	return argError(L, idx, "%s expected, got %s", name, typeName(L, idx));
 }
 
+/* Adds the handle at 'idx' to the sets of dependants kept by its ancestors */
+static void addDependant(lua_State *L, int idx) {
+	lua_getuservalue(L, idx);
+	while (lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 4); /* env[4]: set of dependants (if tracked) */
+		if (lua_istable(L, -1)) {
+			lua_pushvalue(L, idx);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -3);
+		}
+		lua_pop(L, 1);
+		lua_rawgeti(L, -1, 3); /* env[3]: parent environment */
+		lua_remove(L, -2);
+	}
+	lua_pop(L, 1);
+}
+
 void pushHandle(lua_State *L, void *ptr, int mode, int pidx) {
 	check(L, ptr);
 	*(void **)lua_newuserdata(L, sizeof ptr) = ptr;
@@ -82,6 +99,7 @@ void pushHandle(lua_State *L, void *ptr, int mode, int pidx) {
 		}
 	}
 	lua_setuservalue(L, -2);
+	if (pidx) addDependant(L, lua_gettop(L));
 }
 
 int getHandleMode(lua_State *L, int idx) {
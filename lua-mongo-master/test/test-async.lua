@@ -0,0 +1,56 @@
+local mongo = require 'mongo'
+local client = mongo.AsyncClient(test.uri, 2)
+
+test.failure(mongo.AsyncClient, 'abc') -- Invalid URI format
+test.failure(mongo.AsyncClient, test.uri, 0) -- Invalid number of threads
+assert(mongo.type(client) == 'mongo.AsyncClient')
+
+local db, coll = test.dbname, test.collname
+client:command(db, {drop = coll}):wait() -- May fail if there is no collection
+
+-- Writes
+local op = client:insert(db, coll, {_id = 123})
+assert(mongo.type(op) == 'mongo.AsyncOperation')
+assert(op:wait() == true)
+assert(op:done())
+assert(op:wait() == true) -- Same result again
+test.error(client:insert(db, coll, {_id = 123}):wait()) -- Duplicate key
+local ops = {}
+for i = 1, 10 do
+	ops[i] = client:insert(db, coll, {_id = 1000 + i, n = i})
+end
+for i = 1, 10 do
+	assert(ops[i]:wait())
+end
+assert(client:update(db, coll, {_id = 123}, {['$set'] = {n = 0}}):wait())
+assert(client:remove(db, coll, {_id = 1010}):wait())
+
+-- Reads
+assert(client:count(db, coll, {}):wait() == 10)
+local docs = assert(client:find(db, coll, {n = {['$lt'] = 5}}, {sort = {n = 1}}):wait())
+assert(#docs == 5)
+assert(mongo.type(docs[1]) == 'mongo.BSON')
+assert(docs[1]:value()._id == 123)
+assert(docs[5]:value().n == 4)
+assert(#assert(client:find(db, coll, {n = 100}):wait()) == 0)
+assert(mongo.type(assert(client:command(db, {ping = 1}):wait())) == 'mongo.BSON')
+test.error(client:command(db, {INVALID_COMMAND = 1}):wait())
+
+-- Polling and notifications
+op = client:find(db, coll, {})
+while not op:done() do end
+assert(#op:wait(0) == 10)
+if client:fd() then
+	assert(client:drain() > 0)
+	assert(client:drain() == 0)
+end
+
+-- Pending operations do not keep running after the client is closed
+local slow = mongo.AsyncClient('mongodb://127.0.0.1:1/?serverSelectionTimeoutMS=500', 1)
+op = slow:find(db, coll, {})
+local r, e = op:wait(0.01)
+assert(r == nil and e == 'timeout')
+test.error(op:wait())
+
+-- Cleanup
+assert(client:command(db, {dropDatabase = 1}):wait())
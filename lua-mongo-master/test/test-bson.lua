@@ -43,6 +43,16 @@ b1:concat(b2)
 testV(b1, '{ "a" : 1, "b" : 2, "b" : 2 }')
 test.failure(b1.concat, b1) -- Invalid value
 
+-- bson:to_json()
+local b = BSON{a = 1, b = {c = 'x"\n', d = {__array = true, 2.5, true}}, e = mongo.Null, f = mongo.Int64(3)}
+assert(b:to_json() == tostring(b))
+local a = BSON{a = {__array = true, 'x"\n', 2.5, true, mongo.Null}}
+assert(a:to_json() == '{ "a" : [ "x\\"\\n", 2.5, true, null ] }')
+assert(a:to_json('canonical') == '{ "a" : [ "x\\"\\n", { "$numberDouble" : "2.5" }, true, null ] }')
+assert(BSON(b:to_json('canonical')) == b)
+assert(BSON{}:to_json() == '{ }')
+test.failure(b.to_json, b, 'abc') -- Invalid mode
+
 -- bson:find()
 local b = BSON{a = {b = mongo.Null}}
 assert(b:find('') == nil)
@@ -50,6 +60,25 @@ assert(b:find('abc') == nil)
 assert(b:find('a.b') == mongo.Null)
 
 
+-- bson:lazy()
+local b = BSON{a = 1, b = {c = {d = 'x'}}, n = mongo.Null, t = {__array = true, 1, {e = 2}, 3}}
+local l = b:lazy()
+assert(l.a == 1 and l.n == nil and l.z == nil and l[1] == nil)
+assert(l.b.c.d == 'x' and l['b.c.d'] == 'x')
+assert(l.b == l.b) -- Cached
+assert(l.t.__array == 3 and #l.t == 3 and l.t[2].e == 2 and l.t[3] == 3 and l.t[1] == 1 and l.t[4] == nil)
+local t = {}
+for k, v in getmetatable(l.t).__pairs(l.t) do -- Lua 5.1 'pairs()' ignores '__pairs'
+	t[k] = v
+end
+assert(t.__array == 3 and t[1] == 1 and t[2] == l.t[2] and t[3] == 3)
+assert(BSON(l) == b and BSON(l.b) == b:find('b')) -- Convert back
+test.failure(function () l.a = 2 end) -- Read-only
+local c = BSON{a = {b = 1}}:lazy().a
+collectgarbage()
+assert(c.b == 1) -- Nested document keeps its root
+
+
 -- Arrays
 
 local function a(n)
@@ -116,6 +145,18 @@ else -- DateTime as Double
 	testV({a = mongo.DateTime(9007199254740991)}, '{ "a" : { "$date": { "$numberLong" : "9007199254740991" } } }')
 	testV({a = mongo.DateTime(-9007199254740992)}, '{ "a" : { "$date": { "$numberLong" : "-9007199254740992" } } }')
 end
+
+-- DateTime decoding
+local b = BSON('{ "a" : { "$date" : { "$numberLong" : "1700000000123" } }, "b" : { "$date" : { "$numberLong" : "-1" } } }')
+assert(b:value().a == 1700000000123) -- Milliseconds by default
+assert(mongo.set_datetime_format('iso') == 'raw')
+assert(b:value().a == '2023-11-14T22:13:20.123Z' and b:value().b == '1969-12-31T23:59:59.999Z')
+assert(b:lazy().a == '2023-11-14T22:13:20.123Z')
+assert(mongo.set_datetime_format('object') == 'iso')
+assert(mongo.type(b:value().a) == 'mongo.DateTime')
+assert(mongo.set_datetime_format('raw') == 'object')
+test.failure(mongo.set_datetime_format, 'abc') -- Invalid format
+
 testV({a = mongo.Javascript('abc')}, '{ "a" : { "$code" : "abc" } }')
 testV({a = mongo.Javascript('abc', {a = 1})}, '{ "a" : { "$code" : "abc", "$scope" : { "a" : 1 } } }')
 testV({a = mongo.Regex('abc')}, '{ "a" : { "$regex" : "abc", "$options" : "" } }')
@@ -149,6 +190,16 @@ testF{a = setmetatable({}, {__toBSON = function (t) t() end})} -- Run-time error
 local t = {}
 t.t = t
 testF(t) -- Circular reference
+local t = {}
+local n = t
+for i = 1, 100 do
+	n.n = {}
+	n = n.n
+end
+assert(#BSON(t):data() == 5 + 100 * 8) -- Deeply nested tables
+n.t = t
+testF(t) -- Deeply nested circular reference
+testF{a = t} -- Nested circular reference
 local f = function () end
 testF{a = f} -- Invalid value
 testF{[f] = 1} -- Invalid key
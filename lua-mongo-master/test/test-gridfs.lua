@@ -1,8 +1,8 @@
 local mongo = require 'mongo'
 local client = mongo.Client(test.uri)
-local gridfs = assert(client:getGridFS(test.dbname))
-local chunks = gridfs:getChunks()
-local files = gridfs:getFiles()
+local gridfs = assert(client:get_grid_fs(test.dbname))
+local chunks = gridfs:get_chunks()
+local files = gridfs:get_files()
 gridfs:drop()
 
 local t = {}
@@ -14,33 +14,33 @@ local data = table.concat(t)
 
 -- GridFS file
 
-local file = assert(gridfs:createFile())
-
-assert(file:getAliases() == nil)
-assert(file:getChunkSize() > 0)
-assert(file:getContentType() == nil)
-assert(file:getFilename() == nil)
-assert(mongo.type(file:getId()) == 'mongo.ObjectID')
-assert(file:getLength() == 0)
-assert(file:getMD5() == nil)
-assert(file:getMetadata() == nil)
-assert(file:getUploadDate() > 1486000000)
-
-file:setAliases('[ "a", "b" ]')
-file:setContentType('content-type1')
-file:setFilename('myfile1')
-file:setId(123)
-file:setMD5('abc')
-file:setMetadata('{ "a" : 1, "b" : 2 }')
+local file = assert(gridfs:create_file())
+
+assert(file:get_aliases() == nil)
+assert(file:get_chunk_size() > 0)
+assert(file:get_content_type() == nil)
+assert(file:get_filename() == nil)
+assert(mongo.type(file:get_id()) == 'mongo.ObjectID')
+assert(file:get_length() == 0)
+assert(file:get_md5() == nil)
+assert(file:get_metadata() == nil)
+assert(file:get_upload_date() > 1486000000)
+
+file:set_aliases('[ "a", "b" ]')
+file:set_content_type('content-type1')
+file:set_filename('myfile1')
+file:set_id(123)
+file:set_md5('abc')
+file:set_metadata('{ "a" : 1, "b" : 2 }')
 
 assert(file:save())
 
-assert(tostring(file:getAliases()) == '{ "0" : "a", "1" : "b" }')
-assert(file:getContentType() == 'content-type1')
-assert(file:getFilename() == 'myfile1')
-assert(file:getId() == 123)
-assert(file:getMD5() == 'abc')
-assert(tostring(file:getMetadata()) == '{ "a" : 1, "b" : 2 }')
+assert(tostring(file:get_aliases()) == '{ "0" : "a", "1" : "b" }')
+assert(file:get_content_type() == 'content-type1')
+assert(file:get_filename() == 'myfile1')
+assert(file:get_id() == 123)
+assert(file:get_md5() == 'abc')
+assert(tostring(file:get_metadata()) == '{ "a" : 1, "b" : 2 }')
 
 assert(file:write(data) == #data)
 assert(file:read(#data) == nil) -- Reading past the end -> EOF
@@ -52,7 +52,7 @@ assert(file:tell() == #data)
 file = nil
 collectgarbage()
 
-file = assert(gridfs:createFile{
+file = assert(gridfs:create_file{
 	aliases = '[ "a", "b", "c" ]',
 	chunkSize = 10000,
 	contentType = 'content-type2',
@@ -61,12 +61,12 @@ file = assert(gridfs:createFile{
 	metadata = '{ "a" : 1, "b" : 2, "c" : 3 }',
 })
 
-assert(tostring(file:getAliases()) == '{ "0" : "a", "1" : "b", "2" : "c" }')
-assert(file:getChunkSize() == 10000)
-assert(file:getContentType() == 'content-type2')
-assert(file:getFilename() == 'myfile2')
-assert(file:getMD5() == 'def')
-assert(tostring(file:getMetadata()) == '{ "a" : 1, "b" : 2, "c" : 3 }')
+assert(tostring(file:get_aliases()) == '{ "0" : "a", "1" : "b", "2" : "c" }')
+assert(file:get_chunk_size() == 10000)
+assert(file:get_content_type() == 'content-type2')
+assert(file:get_filename() == 'myfile2')
+assert(file:get_md5() == 'def')
+assert(tostring(file:get_metadata()) == '{ "a" : 1, "b" : 2, "c" : 3 }')
 
 -- Write in chunks
 local m, n = 0, 256
@@ -119,27 +119,27 @@ collectgarbage()
 local i, s = gridfs:find({}, {sort = {filename = 1}}):iterator()
 local f1 = assert(i(s))
 local f2 = assert(i(s))
-assert(f1:getFilename() == 'myfile1')
-assert(f2:getFilename() == 'myfile2')
+assert(f1:get_filename() == 'myfile1')
+assert(f2:get_filename() == 'myfile2')
 assert(i(s) == nil) -- No more items
 test.failure(i, s) -- Exception is thrown
 collectgarbage()
 
 assert(file:remove())
 
--- gridfs:createFileFrom()
-test.error(gridfs:createFileFrom('NON-EXISTENT-FILE'))
+-- gridfs:create_file_from()
+test.error(gridfs:create_file_from('NON-EXISTENT-FILE'))
 local f = io.open(test.filename, 'w')
 if f then
 	f:write(data)
 	f:close()
-	file = assert(gridfs:createFileFrom(test.filename, {filename = 'myfile3'}))
+	file = assert(gridfs:create_file_from(test.filename, {filename = 'myfile3'}))
 	os.remove(test.filename)
 	assert(file:read(#data) == data)
 	assert(file:tell() == #data)
 	assert(file:remove())
 else
-	print 'gridfs:createFileFrom() testing skipped - unable to create local file'
+	print 'gridfs:create_file_from() testing skipped - unable to create local file'
 end
 
 file = nil
@@ -148,15 +148,59 @@ collectgarbage()
 
 -- GridFS
 
-assert(gridfs:findOne{_id = 123})
-assert(gridfs:findOne{filename = 'myfile2'} == nil)
-assert(gridfs:findOneByFilename('myfile1'))
-assert(gridfs:findOneByFilename('myfile2') == nil)
-assert(gridfs:removeByFilename('myfile1'))
+assert(gridfs:find_one{_id = 123})
+assert(gridfs:find_one{filename = 'myfile2'} == nil)
+assert(gridfs:find_one_by_filename('myfile1'))
+assert(gridfs:find_one_by_filename('myfile2') == nil)
+assert(gridfs:remove_by_filename('myfile1'))
 
 assert(chunks:count{} == 0)
 assert(files:count{} == 0)
 assert(gridfs:drop())
 
+
+-- GridFS bucket
+
+local database = client:get_database(test.dbname)
+database:get_collection('bucket.files'):drop()
+database:get_collection('bucket.chunks'):drop()
+local bucket = assert(database:get_grid_fs_bucket{bucketName = 'bucket', chunkSizeBytes = 1000})
+local upload = assert(bucket:open_upload('myfile', {metadata = {a = 1}}, 123))
+assert(upload:get_id() == 123)
+assert(upload:write(data) == #data)
+assert(upload:close() == 123)
+test.failure(upload.write, upload, data) -- Closed upload
+upload = assert(bucket:open_upload('myfile'))
+assert(upload:write(data))
+assert(upload:abort())
+local n = 0
+for _ in bucket:find{}:iterator() do n = n + 1 end
+assert(n == 1)
+
+local download = assert(bucket:open_download(123))
+assert(#download == #data)
+assert(download:get_file():value().metadata.a == 1)
+assert(download:read(10) == data:sub(1, 10))
+assert(download:read() == data:sub(11, 1000)) -- Rest of the chunk
+assert(download:read(1500) == data:sub(1001, 2500))
+local t = {}
+assert(download:write_to(function (s) t[#t + 1] = s end))
+assert(table.concat(t) == data:sub(2501))
+assert(download:read() == nil) -- End of file
+
+download = assert(bucket:open_download(123, 10)) -- With read-ahead
+t = {}
+assert(download:write_to(function (s) t[#t + 1] = s end))
+assert(#t == 50 and table.concat(t) == data)
+download = assert(bucket:open_download(123))
+local _, e = download:write_to(function () return nil, 'stop' end)
+assert(e == 'stop')
+assert(download:read() == data:sub(1001, 2000)) -- Stopped after the first chunk
+
+test.error(bucket:open_download(456))
+assert(bucket:delete(123))
+test.error(bucket:delete(123))
+assert(database:get_collection('bucket.chunks'):count{} == 0)
+
 local c = mongo.Client('mongodb://INVALID-URI')
-test.error(c:getGridFS(test.dbname))
+test.error(c:get_grid_fs(test.dbname))
@@ -14,10 +14,10 @@ test.failure(mongo.type)
 
 -- Collection
 
-local collection = client:getCollection(test.dbname, test.collname)
-assert(collection:getName() == test.collname)
-assert(mongo.type(collection:getReadPrefs()) == 'mongo.ReadPrefs')
-collection:setReadPrefs(prefs)
+local collection = client:get_collection(test.dbname, test.collname)
+assert(collection:get_name() == test.collname)
+assert(mongo.type(collection:get_read_prefs()) == 'mongo.ReadPrefs')
+collection:set_read_prefs(prefs)
 collection:drop()
 
 test.error(collection:insert({['$a'] = 123})) -- Client-side error
@@ -67,25 +67,62 @@ i, s = collection:find({_id = 123}):iterator(function (t) return {id = t._id} en
 assert(i(s).id == 123)
 collectgarbage()
 
+-- cursor:next_batch()
+cursor = collection:find({}, {sort = {_id = 1}})
+local b = cursor:next_batch(2)
+assert(#b == 2 and b[1]._id == 123 and b[2]._id == 456)
+b = cursor:next_batch(2, function (t) return {id = t._id} end) -- With transformation
+assert(#b == 1 and b[1].id == 789)
+assert(cursor:next_batch() == nil) -- No more items
+test.failure(cursor.next_batch, cursor, 0) -- Invalid number of documents
+collectgarbage()
+
+-- collection:find_all()
+b = assert(collection:find_all({_id = {['$gt'] = 123}}, {sort = {_id = -1}}))
+assert(#b == 2 and b[1]._id == 789 and b[2]._id == 456)
+assert(#assert(collection:find_all{_id = 'abc'}) == 0) -- Not found
+test.error(collection:find_all({}, {sort = 'abc'})) -- Invalid options
+
 assert(collection:remove({}, {single = true})) -- Flags
 assert(collection:count{} == 2)
 assert(collection:remove{_id = 123})
 assert(collection:remove{_id = 123}) -- Remove reports 'true' even if not found
-assert(collection:findOne({_id = 123}) == nil) -- Not found
+assert(collection:find_one({_id = 123}) == nil) -- Not found
 
 assert(collection:update({_id = 123}, {a = 'abc'}, {upsert = true})) -- inSERT
 assert(collection:update({_id = 123}, {a = 'def'}, {upsert = true})) -- UPdate
-assert(collection:findOne({_id = 123}):value().a == 'def')
+assert(collection:find_one({_id = 123}):value().a == 'def')
 
-assert(collection:findAndModify({_id = 123}, {update = {a = 'abc'}}):find('a') == 'def') -- Old value
-assert(collection:findAndModify({_id = 'abc'}, {remove = true}) == nil) -- Not found
+assert(collection:find_and_modify({_id = 123}, {update = {a = 'abc'}}):find('a') == 'def') -- Old value
+assert(collection:find_and_modify({_id = 'abc'}, {remove = true}) == nil) -- Not found
 
 assert(collection:aggregate('[ { "$group" : { "_id" : "$a", "count" : { "$sum" : 1 } } } ]'):value().count == 1)
 
+-- collection:watch()
+local info = assert(client:command('admin', {isMaster = 1})):value()
+if (info.setName or info.msg == 'isdbgrid') and (info.maxWireVersion or 0) >= 6 then -- Replica set or sharded cluster, 3.6+
+	local stream = collection:watch({__array = true, {['$match'] = {operationType = 'insert'}}}, {maxAwaitTimeMS = 100})
+	b = stream:next_batch()
+	assert(#b == 0) -- No events yet
+	assert(stream:get_resume_token() == nil)
+	assert(collection:insert{_id = 'w1'})
+	assert(collection:insert{_id = 'w2'})
+	assert(collection:remove{_id = 'w1'})
+	b = stream:next_batch(10, 1000, function (t) return t.documentKey._id end) -- With transformation
+	assert(#b == 2 and b[1] == 'w1' and b[2] == 'w2')
+	stream = collection:watch(nil, {maxAwaitTimeMS = 100, resumeAfter = assert(stream:get_resume_token())})
+	assert(stream:next():value().operationType == 'delete') -- Resumed after the last insert
+	assert(collection:remove{_id = 'w2'})
+	test.failure(stream.next_batch, stream, 0) -- Invalid number of events
+else
+	print 'collection:watch() testing skipped - change streams require a replica set or sharded cluster'
+end
+collectgarbage()
+
 -- Bulk operation
 local function bulkInsert(ordered, n)
 	collection:drop()
-	local bulk = collection:createBulkOperation{ordered = ordered}
+	local bulk = collection:create_bulk_operation{ordered = ordered}
 	for id = 1, n do
 		bulk:insert{_id = id}
 		bulk:insert{_id = id}
@@ -97,15 +134,15 @@ assert(bulkInsert(false, 3) == 3) -- Unordered insert
 assert(bulkInsert(true, 3) == 1) -- Ordered insert
 
 collection:drop()
-local bulk = collection:createBulkOperation()
+local bulk = collection:create_bulk_operation()
 for a = 1, 6 do
 	bulk:insert{a = a}
 end
-bulk:removeMany('{ "a" : { "$gt" : 4 } }')
-bulk:removeOne{}
-bulk:replaceOne({}, {b = 1})
-bulk:updateMany({}, '{ "$inc" : { "b" : 1 } }')
-bulk:updateOne({}, '{ "$inc" : { "b" : 1 } }')
+bulk:remove_many('{ "a" : { "$gt" : 4 } }')
+bulk:remove_one{}
+bulk:replace_one({}, {b = 1})
+bulk:update_many({}, '{ "$inc" : { "b" : 1 } }')
+bulk:update_one({}, '{ "$inc" : { "b" : 1 } }')
 assert(bulk:execute())
 local cursor = collection:find{}
 assert(cursor:value().b == 3)
@@ -115,7 +152,7 @@ assert(cursor:value().b == 1)
 -- Rename collection
 assert(collection:rename(test.dbname, tostring(mongo.ObjectID()))) -- Rename with arbitrary name
 local newCollection = collection
-collection = client:getCollection(test.dbname, test.collname) -- Recreate a testing collection
+collection = client:get_collection(test.dbname, test.collname) -- Recreate a testing collection
 assert(collection:insert{a = 1}) -- Insert something to create the actual storage
 assert(newCollection:rename(test.dbname, test.collname, true)) -- Rename back with force
 newCollection = nil
@@ -126,24 +163,24 @@ collectgarbage()
 
 -- Database
 
-local database = client:getDatabase(test.dbname)
-assert(database:getName() == test.dbname)
-assert(mongo.type(database:getReadPrefs()) == 'mongo.ReadPrefs')
-database:setReadPrefs(prefs)
+local database = client:get_database(test.dbname)
+assert(database:get_name() == test.dbname)
+assert(mongo.type(database:get_read_prefs()) == 'mongo.ReadPrefs')
+database:set_read_prefs(prefs)
 
-assert(database:removeAllUsers())
-assert(database:addUser(test.dbname, 'pwd'))
-test.error(database:addUser(test.dbname, 'pwd'))
-assert(database:removeUser(test.dbname))
-test.error(database:removeUser(test.dbname))
+assert(database:remove_all_users())
+assert(database:add_user(test.dbname, 'pwd'))
+test.error(database:add_user(test.dbname, 'pwd'))
+assert(database:remove_user(test.dbname))
+test.error(database:remove_user(test.dbname))
 
-test.value(assert(database:getCollectionNames()), test.collname)
-assert(database:hasCollection(test.collname))
+test.value(assert(database:get_collection_names()), test.collname)
+assert(database:has_collection(test.collname))
 
-test.error(database:createCollection(test.collname)) -- Collection already exists
-collection = database:getCollection(test.collname)
+test.error(database:create_collection(test.collname)) -- Collection already exists
+collection = database:get_collection(test.collname)
 collection:drop()
-collection = assert(database:createCollection(test.collname, {capped = true, size = 1024})) -- Create collection explicitly
+collection = assert(database:create_collection(test.collname, {capped = true, size = 1024})) -- Create collection explicitly
 collection = nil
 
 database = nil
@@ -154,20 +191,41 @@ collectgarbage()
 
 test.failure(mongo.Client, 'abc') -- Invalid URI format
 
--- client:getDefaultDatabase()
+-- client:get_default_database()
 local c1 = mongo.Client('mongodb://aaa')
 local c2 = mongo.Client('mongodb://aaa/bbb')
-test.failure(c1.getDefaultDatabase, c1) -- No default database in URI
-assert(c2:getDefaultDatabase():getName() == 'bbb')
+test.failure(c1.get_default_database, c1) -- No default database in URI
+assert(c2:get_default_database():get_name() == 'bbb')
 
-test.value(assert(client:getDatabaseNames()), test.dbname)
-assert(mongo.type(client:getReadPrefs()) == 'mongo.ReadPrefs')
-client:setReadPrefs(prefs)
+test.value(assert(client:get_database_names()), test.dbname)
+assert(mongo.type(client:get_read_prefs()) == 'mongo.ReadPrefs')
+client:set_read_prefs(prefs)
 
 -- client:command()
 assert(mongo.type(assert(client:command(test.dbname, {find = test.collname}))) == 'mongo.Cursor') -- client:command() returns cursor
 assert(mongo.type(assert(client:command(test.dbname, {validate = test.collname}))) == 'mongo.BSON') -- client:command() returns BSON
 test.error(client:command('abc', {INVALID_COMMAND = test.collname}))
 
+-- client:set_monitoring()
+assert(client:stats() == nil) -- Monitoring is disabled
+client:set_monitoring(true)
+assert(#client:stats() == 0)
+collection = client:get_collection(test.dbname, test.collname)
+for i = 1, 10 do assert(collection:find_one{_id = i} == nil) end
+test.error(client:command('abc', {INVALID_COMMAND = test.collname}))
+local stats = {}
+for _, s in ipairs(client:stats(true)) do stats[s.command .. ' ' .. s.ns] = s end
+local s = stats['find ' .. test.dbname .. '.' .. test.collname]
+assert(s.count == 10 and s.errors == 0 and s.bytes_out > 0 and s.bytes_in > 0)
+assert(s.min <= s.p50 and s.p50 <= s.p99 and s.p99 <= s.max and s.total >= s.max)
+s = stats['INVALID_COMMAND abc.' .. test.collname]
+assert(s.count == 1 and s.errors == 1)
+assert(#client:stats() == 0) -- Reset by previous call
+client:set_monitoring(false)
+assert(client:stats() == nil)
+local pooled = mongo.ClientPool(test.uri):pop()
+test.failure(pooled.set_monitoring, pooled, true) -- Pooled client
+pooled = nil
+
 -- Cleanup
-assert(client:getDatabase(test.dbname):drop())
+assert(client:get_database(test.dbname):drop())
@@ -0,0 +1,55 @@
+local mongo = require 'mongo'
+local pool = mongo.ClientPool(test.uri, {max = 2})
+
+test.failure(mongo.ClientPool, 'abc') -- Invalid URI format
+test.failure(mongo.ClientPool, test.uri, {max = 0}) -- Invalid maximum size
+assert(mongo.type(pool) == 'mongo.ClientPool')
+assert(mongo.ClientPool(test.uri) == pool) -- Same pool for the same URI
+
+local client = pool:pop()
+assert(mongo.type(client) == 'mongo.Client')
+assert(client:command('admin', {ping = 1}))
+local collection = client:get_collection(test.dbname, test.collname)
+collection:drop() -- May fail if there is no collection
+assert(collection:insert({_id = 123}))
+assert(collection:count({}) == 1)
+collection = nil
+
+local stats = pool:stats()
+assert(stats.in_use == 1 and stats.created >= 1 and stats.max == 2)
+
+-- Exhaustion
+local other = assert(pool:pop(0))
+assert(pool:pop(0) == nil)
+local c, e = pool:pop(0.1)
+assert(c == nil and e == 'timeout')
+c, e = pool:pop() -- Does not wait by default
+assert(c == nil and e == 'pool exhausted')
+assert(pool:stats().in_use == 2)
+other = nil
+other = assert(pool:pop(0)) -- Unreachable client is collected and reused
+assert(pool:stats().in_use == 2)
+
+-- Push back
+pool:push(client)
+test.failure(client.command, client, 'admin', {ping = 1}) -- Pushed back
+test.failure(pool.push, pool, mongo.Client(test.uri)) -- Not from the pool
+stats = pool:stats()
+assert(stats.in_use == 1 and stats.idle == 1)
+client = pool:pop() -- Reused
+assert(pool:stats().created == stats.created)
+collection = client:get_collection(test.dbname, test.collname)
+pool:push(client) -- Collection is still alive
+assert(pool:stats().in_use == 2)
+client, collection = nil
+collectgarbage() -- Pushed back along with its dependants
+assert(pool:stats().in_use == 1)
+client = pool:pop()
+client, other = nil
+collectgarbage()
+assert(pool:stats().in_use == 0)
+
+-- Limits
+mongo.ClientPool(test.uri, {min = 3, max = 4})
+stats = pool:stats()
+assert(stats.size >= 3 and stats.min == 3 and stats.max == 4)